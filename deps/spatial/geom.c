@@ -31,6 +31,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <math.h>
 #include "zmalloc.h"
 #include "geom.h"
 #include "grisu3.h"
@@ -1218,6 +1219,7 @@ int geomRectString(geomRect r, int withZ, int withM, char *str){
 #include "geom_levels.c"
 #include "geom_polymap.c"
 #include "geom_json.c"
+#include "geom_packed.c"
 
 
 // geomGetCoord return any coord that is contained somewhere within the specified geometry.
@@ -1302,6 +1304,8 @@ geomErr geomDecode(const void *input, size_t length, geomWKTDecodeOpts opts, geo
             return geomDecodeWKB(input, length, g, size);
         case '{':
             return geomDecodeJSON(input, length, g, size);
+        case GEOM_PACKED_MAGIC:
+            return geomDecodePacked(input, length, g, size);
         case '\t': case ' ': case '\r': case '\v': case '\n': case '\f':
             for (int i=0;i<length;i++){
                 switch (bytes[i]){
@@ -1383,6 +1387,21 @@ geom geomNewRectPolygon(geomRect rect, int *size){
     return (geom)b;
 }
 
+// geomWritePoint writes a 2D point to a buffer of at least GEOM_POINT_SIZE
+// bytes and returns the number of bytes written. 
+int geomWritePoint(geomCoord c, void *buf){
+    uint8_t *b = buf;
+    if (LITTLE_ENDIAN){
+        b[0] = 0x01;
+    } else{
+        b[0] = 0x00;
+    }
+    uint32_t type = 1;
+    memcpy(b+1, &type, 4);
+    memcpy(b+5, &c.x, 8);
+    memcpy(b+13, &c.y, 8);
+    return GEOM_POINT_SIZE;
+}
 
 int geomIsSimplePoint(geom g){
     if (g){
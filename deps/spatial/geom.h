@@ -115,9 +115,19 @@ geom *geomGeometryCollectionFlattenedArray(geom g, int *count);
 void geomFreeFlattenedArray(geom *garr);
 geom geomNewCirclePolygon(geomCoord center, double meters, int steps, int *size);
 geom geomNewRectPolygon(geomRect rect, int *size);
+#define GEOM_POINT_SIZE 21
+int geomWritePoint(geomCoord c, void *buf);
 int geomIsSimplePoint(geom g);
 int geomCoordWithinRadius(geomCoord c, geomCoord center, double meters);
 
+// Packed geometries, see geom_packed.c.
+#define GEOM_PACKED_MAGIC 0x02
+#define GEOM_PACKED_MAX_PRECISION 15
+int geomIsPacked(const void *value, size_t len);
+geomErr geomPack(geom g, int sz, int precision, void **packed, int *size);
+int geomPackedPrecision(const void *value, size_t len);
+int geomUnpack(const void *packed, size_t len, void *wkb, int cap);
+
 
 
 /* geomPolyMap is flattened representation of a geometry.
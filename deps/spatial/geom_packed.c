@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2016, Josh Baker <joshbaker77@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of Redis nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FROM_GEOM_C
+#error This is not a standalone source file.
+#endif
+
+// Packed geometries are a compact form of the WKB, close to TWKB. Each
+// coordinate is a fixed point integer with 'precision' decimal digits,
+// stored as the zigzag varint of its difference with the previous
+// coordinate of the same dimension. The structure follows the WKB:
+//
+//   value    = magic precision geometry
+//   geometry = head body     head is the type, Z is bit 4 and M is bit 5.
+//   body     = coord                   point
+//            | n coord*                linestring, multipoint
+//            | n (n coord*)*           polygon, multilinestring
+//            | n (n (n coord*)*)*      multipolygon
+//            | n geometry*             geometrycollection
+//
+// A number with at most 'precision' decimals comes back the same, the
+// others are rounded.
+
+typedef struct packCtx {
+    uint8_t *buf;
+    int len, cap;
+    double scale;
+    int64_t prev[4];
+} packCtx;
+
+static int packGrow(packCtx *c, int n){
+    if (c->len+n > c->cap){
+        int cap = c->cap ? c->cap : 64;
+        while (cap < c->len+n){
+            cap *= 2;
+        }
+        uint8_t *buf = zrealloc(c->buf, cap);
+        if (!buf){
+            return 0;
+        }
+        c->buf = buf;
+        c->cap = cap;
+    }
+    return 1;
+}
+
+static int packVarint(packCtx *c, uint64_t n){
+    if (!packGrow(c, 10)){
+        return 0;
+    }
+    while (n >= 0x80){
+        c->buf[c->len++] = (uint8_t)(n|0x80);
+        n >>= 7;
+    }
+    c->buf[c->len++] = (uint8_t)n;
+    return 1;
+}
+
+static int packCoord(packCtx *c, ghdr *h, uint8_t *p, uint8_t *end){
+    int dims[4] = {0, 1, 2, 3};
+    int ndims = 2;
+    if (h->z) dims[ndims++] = 2;
+    if (h->m) dims[ndims++] = 3;
+    if (end-p < ndims*8){
+        return -1;
+    }
+    for (int i=0;i<ndims;i++){
+        double v;
+        memcpy(&v, p+i*8, 8);
+        v = round(v*c->scale);
+        // also false for NaN.
+        if (!(fabs(v) < 2e18)){
+            return -1;
+        }
+        int64_t n = (int64_t)v;
+        int64_t d = n-c->prev[dims[i]];
+        c->prev[dims[i]] = n;
+        if (!packVarint(c, ((uint64_t)d<<1)^(uint64_t)(d>>63))){
+            return -1;
+        }
+    }
+    return ndims*8;
+}
+
+// packSeries packs a point at level 1, or a count and as many series of
+// the level below. Returns the number of bytes read, or -1.
+static int packSeries(packCtx *c, ghdr *h, uint8_t *p, uint8_t *end, int level){
+    uint8_t *start = p;
+    uint32_t count;
+    if (level == 1){
+        return packCoord(c, h, p, end);
+    }
+    if (end-p < 4){
+        return -1;
+    }
+    memcpy(&count, p, 4);
+    p += 4;
+    if (!packVarint(c, count)){
+        return -1;
+    }
+    for (uint32_t i=0;i<count;i++){
+        int n = packSeries(c, h, p, end, level-1);
+        if (n == -1){
+            return -1;
+        }
+        p += n;
+    }
+    return p-start;
+}
+
+static int packGeometry(packCtx *c, uint8_t *p, uint8_t *end){
+    uint8_t *start = p;
+    uint32_t count;
+    int level, n;
+    if (end-p < 5 || p[0] != (LITTLE_ENDIAN ? 1 : 0)){
+        return -1;
+    }
+    ghdr h = readhdr(p+1);
+    p += 5;
+    switch (h.type){
+    default:
+        return -1;
+    case GEOM_POINT:
+        level = 1;
+        break;
+    case GEOM_LINESTRING: case GEOM_MULTIPOINT:
+        level = 2;
+        break;
+    case GEOM_POLYGON: case GEOM_MULTILINESTRING:
+        level = 3;
+        break;
+    case GEOM_MULTIPOLYGON:
+        level = 4;
+        break;
+    case GEOM_GEOMETRYCOLLECTION:
+        level = 0;
+        break;
+    }
+    if (!packGrow(c, 1)){
+        return -1;
+    }
+    c->buf[c->len++] = h.type|(h.z<<4)|(h.m<<5);
+    if (level){
+        n = packSeries(c, &h, p, end, level);
+        return n == -1 ? -1 : (p+n)-start;
+    }
+    if (end-p < 4){
+        return -1;
+    }
+    memcpy(&count, p, 4);
+    p += 4;
+    if (!packVarint(c, count)){
+        return -1;
+    }
+    for (uint32_t i=0;i<count;i++){
+        if ((n = packGeometry(c, p, end)) == -1){
+            return -1;
+        }
+        p += n;
+    }
+    return p-start;
+}
+
+// geomIsPacked returns true if the value is a packed geometry.
+int geomIsPacked(const void *value, size_t len){
+    return len >= 3 && ((uint8_t*)value)[0] == GEOM_PACKED_MAGIC;
+}
+
+// geomPack packs a WKB geometry with 'precision' decimal digits, from 0
+// to 15. The packed value must be freed with geomFree. Geometries that can't
+// be represented, such as NaN coordinates, return GEOM_ERR_UNSUPPORTED.
+geomErr geomPack(geom g, int sz, int precision, void **packed, int *size){
+    packCtx c;
+    if (precision < 0 || precision > GEOM_PACKED_MAX_PRECISION){
+        return GEOM_ERR_INPUT;
+    }
+    memset(&c, 0, sizeof(packCtx));
+    c.scale = pow(10, precision);
+    if (!packGrow(&c, 2)){
+        return GEOM_ERR_MEMORY;
+    }
+    c.buf[c.len++] = GEOM_PACKED_MAGIC;
+    c.buf[c.len++] = precision;
+    if (packGeometry(&c, (uint8_t*)g, (uint8_t*)g+sz) != sz){
+        zfree(c.buf);
+        return GEOM_ERR_UNSUPPORTED;
+    }
+    *packed = c.buf;
+    *size = c.len;
+    return GEOM_ERR_NONE;
+}
+
+// geomPackedPrecision returns the precision of a packed geometry.
+int geomPackedPrecision(const void *value, size_t len){
+    if (!geomIsPacked(value, len)){
+        return -1;
+    }
+    return ((uint8_t*)value)[1];
+}
+
+typedef struct unpackCtx {
+    uint8_t *p, *end;
+    uint8_t *out;
+    int len, cap;
+    double scale;
+    int64_t prev[4];
+} unpackCtx;
+
+static int unpackVarint(unpackCtx *c, uint64_t *n){
+    *n = 0;
+    for (int shift=0;shift<64;shift+=7){
+        if (c->p == c->end){
+            return 0;
+        }
+        uint8_t b = *(c->p++);
+        *n |= (uint64_t)(b&0x7F)<<shift;
+        if (!(b&0x80)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// unpackWrite writes only what fits, the length is always counted.
+static void unpackWrite(unpackCtx *c, const void *b, int n){
+    if (c->len+n <= c->cap){
+        memcpy(c->out+c->len, b, n);
+    }
+    c->len += n;
+}
+
+static int unpackCoord(unpackCtx *c, int z, int m){
+    int dims[4] = {0, 1, 2, 3};
+    int ndims = 2;
+    if (z) dims[ndims++] = 2;
+    if (m) dims[ndims++] = 3;
+    for (int i=0;i<ndims;i++){
+        uint64_t u;
+        if (!unpackVarint(c, &u)){
+            return 0;
+        }
+        int64_t d = (int64_t)(u>>1)^-(int64_t)(u&1);
+        c->prev[dims[i]] = (int64_t)((uint64_t)c->prev[dims[i]]+(uint64_t)d);
+        double v = (double)c->prev[dims[i]]/c->scale;
+        unpackWrite(c, &v, 8);
+    }
+    return 1;
+}
+
+static int unpackSeries(unpackCtx *c, int z, int m, int level){
+    uint64_t count;
+    uint32_t count32;
+    if (level == 1){
+        return unpackCoord(c, z, m);
+    }
+    if (!unpackVarint(c, &count) || count > UINT32_MAX){
+        return 0;
+    }
+    count32 = count;
+    unpackWrite(c, &count32, 4);
+    for (uint64_t i=0;i<count;i++){
+        if (!unpackSeries(c, z, m, level-1)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int unpackGeometry(unpackCtx *c){
+    uint8_t byteOrder = LITTLE_ENDIAN ? 1 : 0;
+    uint64_t count;
+    uint32_t type, count32;
+    int level, z, m;
+    if (c->p == c->end){
+        return 0;
+    }
+    type = *c->p&0x0F;
+    z = (*c->p>>4)&1;
+    m = (*c->p>>5)&1;
+    c->p++;
+    switch (type){
+    default:
+        return 0;
+    case GEOM_POINT:
+        level = 1;
+        break;
+    case GEOM_LINESTRING: case GEOM_MULTIPOINT:
+        level = 2;
+        break;
+    case GEOM_POLYGON: case GEOM_MULTILINESTRING:
+        level = 3;
+        break;
+    case GEOM_MULTIPOLYGON:
+        level = 4;
+        break;
+    case GEOM_GEOMETRYCOLLECTION:
+        level = 0;
+        break;
+    }
+    unpackWrite(c, &byteOrder, 1);
+    type += (z ? 1000 : 0) + (m ? 2000 : 0);
+    unpackWrite(c, &type, 4);
+    if (level){
+        return unpackSeries(c, z, m, level);
+    }
+    if (!unpackVarint(c, &count) || count > UINT32_MAX){
+        return 0;
+    }
+    count32 = count;
+    unpackWrite(c, &count32, 4);
+    for (uint64_t i=0;i<count;i++){
+        if (!unpackGeometry(c)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// geomUnpack writes the WKB of a packed geometry to 'wkb' and returns its
+// size. The buffer must hold 'cap' bytes, it's complete only when the size
+// is not more than 'cap'. It may be NULL to get the size. Returns -1 for
+// invalid input.
+int geomUnpack(const void *packed, size_t len, void *wkb, int cap){
+    unpackCtx c;
+    if (!geomIsPacked(packed, len) ||
+        ((uint8_t*)packed)[1] > GEOM_PACKED_MAX_PRECISION)
+    {
+        return -1;
+    }
+    memset(&c, 0, sizeof(unpackCtx));
+    c.p = (uint8_t*)packed+2;
+    c.end = (uint8_t*)packed+len;
+    c.out = wkb;
+    c.cap = wkb ? cap : 0;
+    c.scale = pow(10, ((uint8_t*)packed)[1]);
+    if (!unpackGeometry(&c) || c.p != c.end){
+        return -1;
+    }
+    return c.len;
+}
+
+static geomErr geomDecodePacked(const void *input, size_t length, geom *g, int *size){
+    int sz = geomUnpack(input, length, NULL, 0);
+    if (sz == -1){
+        return GEOM_ERR_INPUT;
+    }
+    if (g && size){
+        *g = zmalloc(sz);
+        if (!*g){
+            return GEOM_ERR_MEMORY;
+        }
+        geomUnpack(input, length, *g, sz);
+        *size = sz;
+    }
+    return GEOM_ERR_NONE;
+}
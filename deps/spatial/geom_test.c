@@ -716,7 +716,87 @@ int test_GeomPolyMapWithin(){
     return 1;
 }
 
+int test_GeomWritePoint(){
+    char buf[GEOM_POINT_SIZE];
+    geomCoord c = { 10.5, -11.25, 0, 0 };
+    assert(geomWritePoint(c, buf) == GEOM_POINT_SIZE);
+    assert(geomIsSimplePoint((geom)buf));
+    geom g = NULL;
+    int sz = 0;
+    assert(geomDecode(buf, sizeof(buf), 0, &g, &sz) == GEOM_ERR_NONE);
+    assert(sz == GEOM_POINT_SIZE);
+    char *wkt = geomEncodeWKT(g, 0);
+    assert(strcmp(wkt, "POINT(10.5 -11.25)") == 0);
+    geomFreeWKT(wkt);
+    geomFree(g);
+    return 1;
+}
 
+// packAndCompare packs a geometry and checks that it comes back the same.
+static void packAndCompare(const char *input, int precision){
+    geom g = NULL, g2 = NULL;
+    void *packed = NULL;
+    int sz = 0, psz = 0, sz2 = 0;
+    assert(geomDecode(input, strlen(input), 0, &g, &sz) == GEOM_ERR_NONE);
+    assert(geomPack(g, sz, precision, &packed, &psz) == GEOM_ERR_NONE);
+    assert(geomIsPacked(packed, psz));
+    assert(geomPackedPrecision(packed, psz) == precision);
+    assert(geomUnpack(packed, psz, NULL, 0) == sz);
+    assert(geomDecode(packed, psz, 0, &g2, &sz2) == GEOM_ERR_NONE);
+    assert(sz2 == sz);
+    assert(memcmp(g, g2, sz) == 0);
+    geomFree(g);
+    geomFree(g2);
+    zfree(packed);
+}
+
+int test_GeomPacked(){
+    packAndCompare("POINT(10.5 -11.25)", 7);
+    packAndCompare("POINT Z(10.5 -11.25 100)", 7);
+    packAndCompare("POINT ZM(10.5 -11.25 100 -3)", 2);
+    packAndCompare("LINESTRING(-112.1234567 33.1234567,-112.1234568 33.1234561,-111 34)", 7);
+    packAndCompare("POLYGON((0 0,10 0,10 10,0 10,0 0),(1 1,2 1,2 2,1 1))", 0);
+    packAndCompare("MULTIPOINT(1 2,3 4)", 7);
+    packAndCompare("MULTILINESTRING((1 2,3 4),(5 6,7 8.5))", 1);
+    packAndCompare("MULTIPOLYGON(((0 0,10 0,10 10,0 0)),((20 20,30 20,30 30,20 20)))", 7);
+    packAndCompare("GEOMETRYCOLLECTION(POINT(1 2),LINESTRING Z(1 2 3,4 5 6),POLYGON((0 0,1 0,1 1,0 0)))", 7);
+
+    // rounding to the precision.
+    geom g = NULL, g2 = NULL;
+    void *packed = NULL;
+    int sz = 0, psz = 0, sz2 = 0;
+    const char *input = "LINESTRING(1.123456789 2.987654321,1.123456 2.987654)";
+    assert(geomDecode(input, strlen(input), 0, &g, &sz) == GEOM_ERR_NONE);
+    assert(geomPack(g, sz, 4, &packed, &psz) == GEOM_ERR_NONE);
+    assert(geomDecode(packed, psz, 0, &g2, &sz2) == GEOM_ERR_NONE);
+    char *wkt = geomEncodeWKT(g2, 0);
+    assert(strcmp(wkt, "LINESTRING(1.1235 2.9877,1.1235 2.9877)") == 0);
+    geomFreeWKT(wkt);
+    geomFree(g2);
+    zfree(packed);
+
+    // invalid values.
+    assert(geomPack(g, sz, 16, &packed, &psz) == GEOM_ERR_INPUT);
+    assert(geomPack(g, sz-1, 7, &packed, &psz) == GEOM_ERR_UNSUPPORTED);
+    assert(geomPack(g, sz, 7, &packed, &psz) == GEOM_ERR_NONE);
+    assert(geomUnpack(packed, psz-1, NULL, 0) == -1);
+    assert(geomUnpack(g, sz, NULL, 0) == -1);
+    zfree(packed);
+    geomFree(g);
 
-
-
+    // a long line takes a few bytes per vertex.
+    char *line = malloc(64*1000+64);
+    char *p = line;
+    p += sprintf(p, "LINESTRING(");
+    for (int i=0;i<1000;i++){
+        p += sprintf(p, "%s%.6f %.6f", i?",":"", -112.0+i*0.0001, 33.0+i*0.00013);
+    }
+    sprintf(p, ")");
+    assert(geomDecode(line, strlen(line), 0, &g, &sz) == GEOM_ERR_NONE);
+    assert(geomPack(g, sz, 6, &packed, &psz) == GEOM_ERR_NONE);
+    assert(psz*3 < sz);
+    zfree(packed);
+    geomFree(g);
+    free(line);
+    return 1;
+}
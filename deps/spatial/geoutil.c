@@ -90,4 +90,28 @@ geomRect geoutilBoundsFromLatLon(double centerLat, double centerLon, double dist
 	return r;
 }
 
-
+// geoutilHilbert returns the distance along a Hilbert curve of order 16
+// that covers the world. Coordinates that are close together mostly have
+// close values, so sorting by it groups nearby objects.
+uint64_t geoutilHilbert(double lat, double lon){
+	uint64_t n = 1<<16, d = 0;
+	double fx = (lon+180)/360*(n-1);
+	double fy = (lat+90)/180*(n-1);
+	uint64_t x = fx < 0 ? 0 : fx > n-1 ? n-1 : (uint64_t)fx;
+	uint64_t y = fy < 0 ? 0 : fy > n-1 ? n-1 : (uint64_t)fy;
+	for (uint64_t s = n/2; s > 0; s /= 2){
+		uint64_t rx = (x & s) > 0;
+		uint64_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0){
+			if (rx == 1){
+				x = n-1 - x;
+				y = n-1 - y;
+			}
+			uint64_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
@@ -39,6 +39,7 @@ extern "C" {
 double geoutilDistance(double latA, double lonA, double latB, double lonB);
 void geoutilDestinationLatLon(double lat, double lon, double distanceMeters, double bearingDegrees, double *destLat, double *destLon);
 geomRect geoutilBoundsFromLatLon(double centerLat, double centerLon, double distanceMeters);
+uint64_t geoutilHilbert(double lat, double lon);
 
 #if defined(__cplusplus)
 }
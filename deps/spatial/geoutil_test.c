@@ -18,3 +18,17 @@ int test_GeoUtilDestination(){
 	assert(fabs(lat - 32.995417)<0.00001 && fabs(lon - -113.927719)<0.00001);
 	return 1;
 }
+
+int test_GeoUtilHilbert(){
+	// the first level of the curve goes through the quadrants in this order.
+	uint64_t sw = geoutilHilbert(-45, -90);
+	uint64_t nw = geoutilHilbert(45, -90);
+	uint64_t ne = geoutilHilbert(45, 90);
+	uint64_t se = geoutilHilbert(-45, 90);
+	assert(sw < nw && nw < ne && ne < se);
+	assert(geoutilHilbert(-90, -180) == 0);
+	assert(geoutilHilbert(-91, -181) == 0);
+	// points in the same cell share the value.
+	assert(geoutilHilbert(33.000001, -115.000001) == geoutilHilbert(33.000002, -115.000002));
+	return 1;
+}
@@ -33,10 +33,26 @@
 #include "rtree_tmpl.c"
 #include "rtree.h"
 
+#define CURSOR_MAX_DEPTH 64
+
 typedef struct rtree {
 	nodeT *root;
+	arenaT *arena;
+	unsigned long long searches; // calls to Search and SearchNodes.
+	unsigned long long visits;   // nodes visited by those calls.
 } rtree;
 
+typedef struct rtreeCursor {
+	arenaT *arena;
+	nodeT *root;
+	rectT rect;
+	int depth;
+	struct {
+		nodeT *node;
+		int index;
+	} stack[CURSOR_MAX_DEPTH];
+} rtreeCursor;
+
 typedef struct rtreeIterator {
 	iteratorT *iterator;
 } rtreeIterator;
@@ -47,23 +63,47 @@ rtree *rtreeNew() {
 		return NULL;
 	}
 	memset(tr, 0, sizeof(rtree));
+	tr->arena = zmalloc(sizeof(arenaT));
+	if (!tr->arena){
+		zfree(tr);
+		return NULL;
+	}
+	memset(tr->arena, 0, sizeof(arenaT));
+	tr->arena->refs = 1;
 	return tr;
 }
 
+static void unrefArena(arenaT *arena){
+	if (--arena->refs == 0){
+		releaseAllNodes(arena);
+		zfree(arena);
+	}
+}
+
+// releaseRoot drops the nodes of the tree. They can only be freed all at 
+// once when no cursor shares them.
+static void releaseRoot(rtree *tr){
+	if (tr->arena->refs == 1){
+		releaseAllNodes(tr->arena);
+	} else if (tr->root){
+		unrefNode(tr->arena, tr->root);
+	}
+	tr->root = NULL;
+}
+
 void rtreeFree(rtree *tr){
 	if (!tr){
 		return;
 	}
-	if (tr->root){
-		freeNode(tr->root);
-	}
+	releaseRoot(tr);
+	unrefArena(tr->arena);
 	zfree(tr);
 }
 
 // Remove removes item from rtree
 int rtreeRemove(rtree *tr, double minX, double minY, double maxX, double maxY, void *item) {
 	if (tr && tr->root){
-		return removeRect(makeRect(minX, minY, maxX, maxY), item, &(tr->root))?0:1;
+		return removeRect(tr->arena, makeRect(minX, minY, maxX, maxY), item, &(tr->root))?0:1;
 	}
 	return 0;
 }
@@ -73,7 +113,48 @@ int rtreeCount(rtree *tr) {
 	if (!tr || !tr->root){
 		return 0;
 	}
-	return countRec(tr->root, 0);
+	return tr->root->total;
+}
+
+// Memory returns the number of bytes used by the tree.
+size_t rtreeMemory(rtree *tr) {
+	if (!tr){
+		return 0;
+	}
+	return sizeof(rtree)+sizeof(arenaT)+tr->arena->bytes;
+}
+
+// Stats fills 'stats' from the counters of the tree, without walking it.
+// The nodes include the old versions that are only reachable by cursors,
+// and the fill assumes there's none.
+void rtreeGetStats(rtree *tr, rtreeStats *stats) {
+	memset(stats, 0, sizeof(rtreeStats));
+	if (!tr){
+		return;
+	}
+	stats->count = rtreeCount(tr);
+	stats->height = tr->root ? tr->root->level+1 : 0;
+	stats->nodes = tr->arena->nnodes;
+	if (stats->nodes > 0){
+		// every node but the root is a branch of its parent.
+		stats->fill = (double)(stats->count+stats->nodes-1)/((double)stats->nodes*MAX_NODES);
+	}
+	stats->bytes = rtreeMemory(tr);
+	stats->searches = tr->searches;
+	stats->visits = tr->visits;
+}
+
+// Bounds returns the rectangle that covers all items. Returns 0 when empty.
+int rtreeBounds(rtree *tr, double *minX, double *minY, double *maxX, double *maxY) {
+	if (!tr || !tr->root || tr->root->count == 0){
+		return 0;
+	}
+	rectT rect = nodeCover(tr->root);
+	*minX = rect.min[0];
+	*minY = rect.min[1];
+	*maxX = rect.max[0];
+	*maxY = rect.max[1];
+	return 1;
 }
 
 // Insert inserts item into rtree
@@ -82,20 +163,18 @@ int rtreeInsert(rtree *tr, double minX, double minY, double maxX, double maxY, v
 		return 0;
 	}
 	if (!tr->root) {
-		tr->root = zmalloc(sizeof(nodeT));
+		tr->root = allocNode(tr->arena, NULL);
 		if (!tr->root){
 			return 0;
 		}
-		memset(tr->root, 0, sizeof(nodeT));
 	}
-	insertRect(makeRect(minX, minY, maxX, maxY), item, &(tr->root), 0);
+	insertRect(tr->arena, makeRect(minX, minY, maxX, maxY), item, &(tr->root), 0);
 	return 1;
 }
 
 void rtreeRemoveAll(rtree *tr){
-	if (tr && tr->root){
-		freeNode(tr->root);
-		tr->root = NULL;
+	if (tr){
+		releaseRoot(tr);
 	}
 }
 
@@ -111,14 +190,154 @@ static int iteratorFunc(rectT rect, void *item, void *userdata){
 	return ud->iterator(minX, minY, maxX, maxY, item, ud->userdata);
 }
 
+typedef struct nodeIteratorUserData {
+	rtreeNodeFunc nodeIterator;
+	rtreeSearchFunc iterator;
+	void *userdata;
+} nodeIteratorUserData;
+
+static int nodeIteratorFunc(rectT rect, int count, void *userdata){
+	nodeIteratorUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->nodeIterator(minX, minY, maxX, maxY, count, ud->userdata);
+}
+
+static int nodeItemIteratorFunc(rectT rect, void *item, void *userdata){
+	nodeIteratorUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->iterator(minX, minY, maxX, maxY, item, ud->userdata);
+}
+
 int rtreeSearch(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata){
 	if (!tr || !tr->root){
 		return 0;
 	}
+	tr->searches++;
 	if (iterator){
 		iteratorUserData ud = {iterator, userdata};
-		return search(tr->root, makeRect(minX, minY, maxX, maxY), iteratorFunc, &ud);
+		return search(tr->root, makeRect(minX, minY, maxX, maxY), NULL, iteratorFunc, &ud, &tr->visits);
 	} else{
-		return search(tr->root, makeRect(minX, minY, maxX, maxY), NULL, NULL);
+		return search(tr->root, makeRect(minX, minY, maxX, maxY), NULL, NULL, NULL, &tr->visits);
+	}
+}
+
+// SearchNodes is like Search, but each subtree that overlaps the search rect
+// is first offered to nodeIterator. When it returns true the items of the 
+// subtree are counted, but not visited.
+int rtreeSearchNodes(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeNodeFunc nodeIterator, rtreeSearchFunc iterator, void *userdata){
+	if (!tr || !tr->root){
+		return 0;
+	}
+	nodeIteratorUserData ud = {nodeIterator, iterator, userdata};
+	tr->searches++;
+	return search(tr->root, makeRect(minX, minY, maxX, maxY), 
+		nodeIterator?nodeIteratorFunc:NULL, iterator?nodeItemIteratorFunc:NULL, &ud, &tr->visits);
+}
+
+// Scan calls iterator for every item, in the order of the leaves of the 
+// tree, so that items that are close together come one after another.
+// Returns 0 if the iterator asked to stop.
+int rtreeScan(rtree *tr, rtreeSearchFunc iterator, void *userdata){
+	if (!tr || !tr->root){
+		return 1;
+	}
+	iteratorUserData ud = {iterator, userdata};
+	return scan(tr->root, iteratorFunc, &ud);
+}
+
+// Load replaces the content of the tree with 'count' items, and 'rects' 
+// holding the minX, minY, maxX, maxY of each item. The tree is packed from
+// the items in the order they are given, which should keep items that are
+// close together next to each other, such as the order of rtreeScan().
+int rtreeLoad(rtree *tr, int count, double *rects, void **items){
+	if (!tr){
+		return 0;
+	}
+	rtreeRemoveAll(tr);
+	if (count == 0){
+		return 1;
+	}
+	branchT *branches = zmalloc(sizeof(branchT)*count);
+	if (!branches){
+		return 0;
+	}
+	for (int i=0;i<count;i++){
+		branches[i].rect = makeRect(rects[i*4+0], rects[i*4+1], rects[i*4+2], rects[i*4+3]);
+		branches[i].item = items[i];
+		branches[i].child = NULL;
+	}
+	tr->root = bulkLoad(tr->arena, branches, count);
+	zfree(branches);
+	return 1;
+}
+
+// CursorNew returns a cursor over the items of the tree that overlap the 
+// rect. The cursor sees the tree as it was when it was created: the nodes
+// it can reach are copied by the tree before being modified. The cursor 
+// must be released with rtreeCursorFree(), and it stays valid after the 
+// tree itself is freed.
+rtreeCursor *rtreeCursorNew(rtree *tr, double minX, double minY, double maxX, double maxY){
+	if (!tr){
+		return NULL;
+	}
+	rtreeCursor *rc = zmalloc(sizeof(rtreeCursor));
+	if (!rc){
+		return NULL;
+	}
+	rc->arena = tr->arena;
+	rc->arena->refs++;
+	rc->root = tr->root;
+	rc->rect = makeRect(minX, minY, maxX, maxY);
+	rc->depth = 0;
+	if (rc->root){
+		rc->root->refs++;
+		rc->stack[0].node = rc->root;
+		rc->stack[0].index = 0;
+		rc->depth = 1;
+	}
+	return rc;
+}
+
+// CursorNext moves the cursor to the next item and stores it along with
+// its rect. Returns 0 when there are no more items.
+int rtreeCursorNext(rtreeCursor *rc, double *minX, double *minY, double *maxX, double *maxY, void **item){
+	while (rc->depth > 0){
+		nodeT *node = rc->stack[rc->depth-1].node;
+		int index = rc->stack[rc->depth-1].index;
+		if (index == node->count){
+			rc->depth--;
+			continue;
+		}
+		rc->stack[rc->depth-1].index++;
+		branchT *branch = &node->branch[index];
+		if (!overlap(rc->rect, branch->rect)){
+			continue;
+		}
+		if (node->level > 0){
+			if (rc->depth == CURSOR_MAX_DEPTH){
+				continue;
+			}
+			rc->stack[rc->depth].node = branch->child;
+			rc->stack[rc->depth].index = 0;
+			rc->depth++;
+			continue;
+		}
+		getRect(branch->rect, minX, minY, maxX, maxY);
+		*item = branch->item;
+		return 1;
+	}
+	return 0;
+}
+
+void rtreeCursorFree(rtreeCursor *rc){
+	if (!rc){
+		return;
+	}
+	if (rc->root){
+		unrefNode(rc->arena, rc->root);
 	}
+	unrefArena(rc->arena);
+	zfree(rc);
 }
@@ -37,15 +37,36 @@ extern "C" {
 #include "geom.h"
 
 typedef struct rtree rtree;
+typedef struct rtreeCursor rtreeCursor;
+
+typedef struct rtreeStats {
+	int count;
+	int height;                  // number of levels, zero when empty.
+	int nodes;
+	double fill;                 // average share of the branches in use.
+	size_t bytes;                // see rtreeMemory().
+	unsigned long long searches; // calls to rtreeSearch() and rtreeSearchNodes().
+	unsigned long long visits;   // nodes visited by those searches.
+} rtreeStats;
 
 rtree *rtreeNew();
 void rtreeFree(rtree *tr);
 int rtreeRemove(rtree *tr, double minX, double minY, double maxX, double maxY, void *item);
 void rtreeRemoveAll(rtree *tr);
 int rtreeCount(rtree *tr);
+size_t rtreeMemory(rtree *tr);
+void rtreeGetStats(rtree *tr, rtreeStats *stats);
+int rtreeBounds(rtree *tr, double *minX, double *minY, double *maxX, double *maxY);
 int rtreeInsert(rtree *tr, double minX, double minY, double maxX, double maxY, void *item);
 typedef int(*rtreeSearchFunc)(double minX, double minY, double maxX, double maxY, void *item, void *userdata);
 int rtreeSearch(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata);
+typedef int(*rtreeNodeFunc)(double minX, double minY, double maxX, double maxY, int count, void *userdata);
+int rtreeSearchNodes(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeNodeFunc nodeIterator, rtreeSearchFunc iterator, void *userdata);
+int rtreeScan(rtree *tr, rtreeSearchFunc iterator, void *userdata);
+int rtreeLoad(rtree *tr, int count, double *rects, void **items);
+rtreeCursor *rtreeCursorNew(rtree *tr, double minX, double minY, double maxX, double maxY);
+int rtreeCursorNext(rtreeCursor *rc, double *minX, double *minY, double *maxX, double *maxY, void **item);
+void rtreeCursorFree(rtreeCursor *rc);
 
 #if defined(__cplusplus)
 }
@@ -62,6 +62,19 @@ int test_RTreeSearch(){
 }
 
 
+int test_RTreeBounds(){
+	double minX, minY, maxX, maxY;
+	rtree *tr = rtreeNew();
+	assert(tr);
+	assert(!rtreeBounds(tr, &minX, &minY, &maxX, &maxY));
+	assert(rtreeInsert(tr, 10, 10, 20, 20, (void*)(long)100));
+	assert(rtreeInsert(tr, -30, 30, 50, 40, (void*)(long)101));
+	assert(rtreeBounds(tr, &minX, &minY, &maxX, &maxY));
+	assert(minX == -30 && minY == 10 && maxX == 50 && maxY == 40);
+	rtreeFree(tr);
+	return 1;
+}
+
 int test_RTreeRemove(){
 	rtree *tr = rtreeNew();
 	assert(tr);
@@ -94,4 +107,323 @@ int test_RTreeRemove(){
 
 	rtreeFree(tr);
 	return 1;
-}
\ No newline at end of file
+}
+typedef struct findUserData {
+	void *item;
+	int found;
+} findUserData;
+
+static int findIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+	findUserData *ud = userdata;
+	if (item == ud->item){
+		ud->found = 1;
+		return 0;
+	}
+	return 1;
+}
+
+int test_RTreeRemoveMany(){
+	srand(time(NULL)/clock());
+	rtree *tr = rtreeNew();
+	assert(tr);
+
+	int n = 10000;
+	double *rects = malloc(n*4*sizeof(double));
+	assert(rects);
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		r[0] = randx();
+		r[1] = randy();
+		r[2] = r[0]+randd();
+		r[3] = r[1]+randd();
+		assert(rtreeInsert(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	assert(rtreeCount(tr)==n);
+
+	// removing items causes underflowed internal nodes to be reinserted,
+	// which must not lose any of their subtrees.
+	for (int i=0;i<n;i+=2){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	assert(rtreeCount(tr)==n/2);
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		findUserData ud = {(void*)(long)(i+1), 0};
+		rtreeSearch(tr, r[0], r[1], r[2], r[3], findIterator, &ud);
+		assert(ud.found == (i%2 == 1));
+	}
+	for (int i=1;i<n;i+=2){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	assert(rtreeCount(tr)==0);
+
+	free(rects);
+	rtreeFree(tr);
+	return 1;
+}
+
+typedef struct nodeUserData {
+	double minX, minY, maxX, maxY;
+	int nodes;
+	int items;
+} nodeUserData;
+
+static int containedNodeIterator(double minX, double minY, double maxX, double maxY, int count, void *userdata){
+	nodeUserData *ud = userdata;
+	if (minX >= ud->minX && minY >= ud->minY && maxX <= ud->maxX && maxY <= ud->maxY){
+		ud->nodes++;
+		return 1;
+	}
+	return 0;
+}
+
+static int containedItemIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+	nodeUserData *ud = userdata;
+	ud->items++;
+	return 1;
+}
+
+int test_RTreeSearchNodes(){
+	rtree *tr = insert();
+	nodeUserData ud = {-100, -50, 100, 50, 0, 0};
+	int expect = rtreeSearch(tr, ud.minX, ud.minY, ud.maxX, ud.maxY, NULL, NULL);
+	int count = rtreeSearchNodes(tr, ud.minX, ud.minY, ud.maxX, ud.maxY, 
+		containedNodeIterator, containedItemIterator, &ud);
+	assert(count == expect);
+	assert(ud.nodes > 0);
+	assert(ud.items < count);
+	rtreeFree(tr);
+	return 1;
+}
+
+static int scanIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+	long *items = userdata;
+	items[items[0]+1] = (long)item;
+	items[0]++;
+	return 1;
+}
+
+int test_RTreeLoad(){
+	int n = 10000;
+	double *rects = malloc(sizeof(double)*4*n);
+	void **items = malloc(sizeof(void*)*n);
+	long *scanned = malloc(sizeof(long)*(n+1));
+	rtree *tr = rtreeNew();
+	assert(tr);
+	for (int i=0;i<n;i++){
+		double x = randx(), y = randy();
+		rects[i*4+0] = x;
+		rects[i*4+1] = y;
+		rects[i*4+2] = x;
+		rects[i*4+3] = y;
+		items[i] = (void*)(long)(i+1);
+	}
+	assert(rtreeInsert(tr, 0, 0, 1, 1, (void*)(long)-1));
+	assert(rtreeLoad(tr, n, rects, items));
+	assert(rtreeCount(tr)==n);
+	assert(rtreeSearch(tr, -180, -90, 180, 90, NULL, NULL)==n);
+	for (int i=0;i<n;i+=97){
+		double *r = rects+i*4;
+		assert(rtreeSearch(tr, r[0], r[1], r[2], r[3], NULL, NULL)>=1);
+	}
+
+	// items come back in the order they were loaded.
+	scanned[0] = 0;
+	assert(rtreeScan(tr, scanIterator, scanned));
+	assert(scanned[0]==n);
+	for (int i=0;i<n;i++){
+		assert(scanned[i+1]==(long)items[i]);
+	}
+
+	// the loaded tree can still be modified.
+	for (int i=0;i<n;i+=2){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], items[i]));
+	}
+	assert(rtreeCount(tr)==n/2);
+	assert(rtreeInsert(tr, 10, 10, 20, 20, (void*)(long)-2));
+	assert(rtreeCount(tr)==n/2+1);
+
+	assert(rtreeLoad(tr, 0, NULL, NULL));
+	assert(rtreeCount(tr)==0);
+	rtreeFree(tr);
+	free(rects);
+	free(items);
+	free(scanned);
+	return 1;
+}
+
+int test_RTreeMemory(){
+	int n = 10000;
+	double *rects = malloc(sizeof(double)*4*n);
+	rtree *tr = rtreeNew();
+	assert(tr);
+	size_t empty = rtreeMemory(tr);
+	assert(empty > 0);
+	for (int i=0;i<n;i++){
+		double x = randx(), y = randy();
+		rects[i*4+0] = x;
+		rects[i*4+1] = y;
+		rects[i*4+2] = x;
+		rects[i*4+3] = y;
+		assert(rtreeInsert(tr, x, y, x, y, (void*)(long)(i+1)));
+	}
+	size_t full = rtreeMemory(tr);
+	assert(full > empty);
+
+	// released nodes are reused before new slabs are allocated.
+	for (int round=0;round<5;round++){
+		for (int i=0;i<n;i+=2){
+			double *r = rects+i*4;
+			assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+		}
+		for (int i=0;i<n;i+=2){
+			double *r = rects+i*4;
+			assert(rtreeInsert(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+		}
+		assert(rtreeCount(tr)==n);
+		assert(rtreeMemory(tr) < full*2);
+	}
+
+	// empty slabs go away.
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	assert(rtreeCount(tr)==0);
+	assert(rtreeMemory(tr) < full/10);
+	rtreeRemoveAll(tr);
+	assert(rtreeMemory(tr) == empty);
+	rtreeFree(tr);
+	free(rects);
+	return 1;
+}
+
+static int collectCursor(rtreeCursor *rc, char *seen, int n){
+	double minX, minY, maxX, maxY;
+	void *item;
+	int count = 0;
+	while (rtreeCursorNext(rc, &minX, &minY, &maxX, &maxY, &item)){
+		long i = (long)item;
+		assert(i >= 1 && i <= n && !seen[i]);
+		seen[i] = 1;
+		count++;
+	}
+	return count;
+}
+
+int test_RTreeCursor(){
+	int n = 10000;
+	double *rects = malloc(sizeof(double)*4*n);
+	char *seen = calloc(n+1, 1);
+	rtree *tr = rtreeNew();
+	assert(tr);
+	for (int i=0;i<n;i++){
+		double x = randx(), y = randy();
+		rects[i*4+0] = x;
+		rects[i*4+1] = y;
+		rects[i*4+2] = x;
+		rects[i*4+3] = y;
+		assert(rtreeInsert(tr, x, y, x, y, (void*)(long)(i+1)));
+	}
+	int inside = rtreeSearch(tr, -90, -45, 90, 45, NULL, NULL);
+	rtreeCursor *all = rtreeCursorNew(tr, -180, -90, 180, 90);
+	rtreeCursor *some = rtreeCursorNew(tr, -90, -45, 90, 45);
+	assert(all && some);
+
+	// the cursors keep seeing the items as they were.
+	for (int i=0;i<n;i+=2){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	for (int i=0;i<n/2;i++){
+		assert(rtreeInsert(tr, 0, 0, 1, 1, (void*)(long)(n+i+1)));
+	}
+	assert(rtreeCount(tr)==n);
+	assert(rtreeSearch(tr, -180, -90, 180, 90, NULL, NULL)==n);
+	assert(collectCursor(all, seen, n)==n);
+	rtreeCursorFree(all);
+
+	// the tree can be reloaded, and even freed, under a cursor.
+	void **items = malloc(sizeof(void*)*n);
+	for (int i=0;i<n;i++){
+		items[i] = (void*)(long)(n+i+1);
+	}
+	assert(rtreeLoad(tr, n, rects, items));
+	free(items);
+	rtreeFree(tr);
+	memset(seen, 0, n+1);
+	assert(collectCursor(some, seen, n)==inside);
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		int in = r[0] >= -90 && r[0] <= 90 && r[1] >= -45 && r[1] <= 45;
+		assert(seen[i+1]==in);
+	}
+	rtreeCursorFree(some);
+
+	// without cursors the copies are gone.
+	tr = rtreeNew();
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		assert(rtreeInsert(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	size_t full = rtreeMemory(tr);
+	rtreeCursor *rc = rtreeCursorNew(tr, -180, -90, 180, 90);
+	for (int i=0;i<n;i++){
+		double *r = rects+i*4;
+		assert(rtreeRemove(tr, r[0], r[1], r[2], r[3], (void*)(long)(i+1)));
+	}
+	assert(rtreeMemory(tr) >= full);
+	rtreeCursorFree(rc);
+	assert(rtreeCount(tr)==0);
+	assert(rtreeMemory(tr) < full/10);
+	rtreeFree(tr);
+	free(rects);
+	free(seen);
+	return 1;
+}
+
+int test_RTreeStats(){
+	rtreeStats stats;
+	rtree *tr = rtreeNew();
+	assert(tr);
+	rtreeGetStats(tr, &stats);
+	assert(stats.count==0 && stats.height==0 && stats.nodes==0 && stats.fill==0);
+	assert(stats.bytes==rtreeMemory(tr));
+
+	int n = 10000;
+	double *rects = malloc(sizeof(double)*4*n);
+	void **items = malloc(sizeof(void*)*n);
+	// a 100x100 grid, row by row, which keeps the packed nodes apart.
+	for (int i=0;i<n;i++){
+		double x = (i%100)*3.6-179, y = (i/100)*1.8-89;
+		rects[i*4+0] = x;
+		rects[i*4+1] = y;
+		rects[i*4+2] = x;
+		rects[i*4+3] = y;
+		items[i] = (void*)(long)(i+1);
+	}
+	assert(rtreeLoad(tr, n, rects, items));
+	rtreeGetStats(tr, &stats);
+	assert(stats.count==n);
+	// a packed tree of 10000 items has 625+40+3+1 nodes in 4 levels.
+	assert(stats.height==4);
+	assert(stats.nodes==669);
+	assert(stats.fill > 0.9 && stats.fill <= 1);
+
+	// a full search visits every node, a small one only a few of them.
+	assert(stats.searches==0 && stats.visits==0);
+	rtreeSearch(tr, -180, -90, 180, 90, iterator, NULL);
+	rtreeGetStats(tr, &stats);
+	assert(stats.searches==1 && stats.visits==669);
+	rtreeSearch(tr, 1, 1, 1.0001, 1.0001, iterator, NULL);
+	rtreeGetStats(tr, &stats);
+	assert(stats.searches==2 && stats.visits > 669 && stats.visits < 669+10);
+
+	rtreeFree(tr);
+	free(rects);
+	free(items);
+	return 1;
+}
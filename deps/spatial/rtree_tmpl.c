@@ -53,6 +53,9 @@
 #ifndef MAX_NODES
 #   define MAX_NODES 16
 #endif
+#ifndef SLAB_NODES
+#   define SLAB_NODES 40
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -79,6 +82,8 @@ typedef struct listNodeT listNodeT;
 typedef struct partitionVarsT partitionVarsT;
 typedef struct stackT stackT;
 typedef struct iteratorT iteratorT;
+typedef struct slabT slabT;
+typedef struct arenaT arenaT;
 
 struct rectT {
     NUMBER min[NUM_DIMS];
@@ -94,9 +99,41 @@ struct branchT {
 struct nodeT {
     int     count;
     int     level;
+    int     total;  // number of items in the subtree.
+    int     refs;   // number of branches, roots and cursors pointing here.
+    slabT   *slab;  // the slab the node was carved from.
     branchT branch[MAX_NODES];
 };
 
+// The nodes of a tree are carved out of slabs that belong to the tree
+// alone. A node created by a split is taken from the slab of the node that
+// was split whenever there's room, so that siblings stay on the same few
+// pages, and an update that only touches a small area of the tree only
+// dirties those pages, which matters to the copy-on-write of a forked 
+// process. Slabs start small and grow with the tree, up to SLAB_NODES.
+struct slabT {
+    slabT *prev, *next;          // all the slabs of the arena.
+    slabT *prevAvail, *nextAvail; // slabs with room for more nodes.
+    nodeT *free;                 // released nodes, linked by branch[0].child.
+    int    size;                 // number of nodes of the slab.
+    int    used;                 // number of nodes handed out.
+    int    fresh;                // nodes never handed out start here.
+    nodeT  nodes[];
+};
+
+// An arena is shared by a tree and its cursors. The cursors pin a root,
+// and the nodes that it reaches can't be modified anymore: while the arena 
+// is shared, a write first copies the nodes that have more than one ref on
+// its path, the way a persistent tree does.
+struct arenaT {
+    int    refs;   // the tree and its cursors.
+    slabT *slabs;
+    slabT *avail;
+    int    nslabs;
+    int    nnodes;
+    size_t bytes;  // allocated by the slabs.
+};
+
 struct listNodeT {
     listNodeT *next;
     nodeT     *node;
@@ -116,9 +153,152 @@ struct partitionVarsT {
     NUMBER  coverSplitArea;
 };
 
-static int addBranch(branchT *branch, nodeT *node, nodeT **newNode);
+static int addBranch(arenaT *arena, branchT *branch, nodeT *node, nodeT **newNode);
 static int pickBranch(rectT rect, nodeT *node);
 
+static void linkAvail(arenaT *arena, slabT *slab) {
+    slab->prevAvail = NULL;
+    slab->nextAvail = arena->avail;
+    if (arena->avail) {
+        arena->avail->prevAvail = slab;
+    }
+    arena->avail = slab;
+}
+
+static void unlinkAvail(arenaT *arena, slabT *slab) {
+    if (slab->prevAvail) {
+        slab->prevAvail->nextAvail = slab->nextAvail;
+    } else {
+        arena->avail = slab->nextAvail;
+    }
+    if (slab->nextAvail) {
+        slab->nextAvail->prevAvail = slab->prevAvail;
+    }
+}
+
+// allocNode returns a zeroed node, preferably from the slab of 'near'.
+static nodeT *allocNode(arenaT *arena, nodeT *near) {
+    slabT *slab = NULL;
+    if (near && near->slab->used < near->slab->size) {
+        slab = near->slab;
+    } else if (arena->avail) {
+        slab = arena->avail;
+    } else {
+        int size = arena->nnodes < SLAB_NODES ? arena->nnodes+1 : SLAB_NODES;
+        slab = zmalloc(sizeof(slabT)+sizeof(nodeT)*size);
+        if (!slab) {
+            return NULL;
+        }
+        slab->free = NULL;
+        slab->size = size;
+        slab->used = 0;
+        slab->fresh = 0;
+        slab->prev = NULL;
+        slab->next = arena->slabs;
+        if (arena->slabs) {
+            arena->slabs->prev = slab;
+        }
+        arena->slabs = slab;
+        arena->nslabs++;
+        arena->bytes += sizeof(slabT)+sizeof(nodeT)*size;
+        linkAvail(arena, slab);
+    }
+    nodeT *node;
+    if (slab->free) {
+        node = slab->free;
+        slab->free = node->branch[0].child;
+    } else {
+        node = &slab->nodes[slab->fresh++];
+    }
+    if (++slab->used == slab->size) {
+        unlinkAvail(arena, slab);
+    }
+    arena->nnodes++;
+    memset(node, 0, sizeof(nodeT));
+    node->slab = slab;
+    node->refs = 1;
+    return node;
+}
+
+// releaseNode gives a single node back to its slab. The slab itself is 
+// freed once all of its nodes have been released.
+static void releaseNode(arenaT *arena, nodeT *node) {
+    slabT *slab = node->slab;
+    arena->nnodes--;
+    if (slab->used-- == slab->size) {
+        linkAvail(arena, slab);
+    }
+    if (slab->used == 0) {
+        unlinkAvail(arena, slab);
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            arena->slabs = slab->next;
+        }
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+        arena->nslabs--;
+        arena->bytes -= sizeof(slabT)+sizeof(nodeT)*slab->size;
+        zfree(slab);
+        return;
+    }
+    node->branch[0].child = slab->free;
+    slab->free = node;
+}
+
+// releaseAllNodes frees every node of the arena at once, without walking
+// the tree.
+static void releaseAllNodes(arenaT *arena) {
+    slabT *slab = arena->slabs;
+    while (slab) {
+        slabT *next = slab->next;
+        zfree(slab);
+        slab = next;
+    }
+    arena->slabs = NULL;
+    arena->avail = NULL;
+    arena->nslabs = 0;
+    arena->nnodes = 0;
+    arena->bytes = 0;
+}
+
+// unrefNode drops a reference to a node, which is released along with the
+// subtrees that nothing else points to once the last one is gone.
+static void unrefNode(arenaT *arena, nodeT *node) {
+    if (--node->refs > 0) {
+        return;
+    }
+    if (node->level > 0) {
+        for (int index = 0; index < node->count; index++) {
+            unrefNode(arena, node->branch[index].child);
+        }
+    }
+    releaseNode(arena, node);
+}
+
+// ownNode makes the node at 'slot' safe to modify. A node that is shared 
+// with a cursor is replaced by a copy, which takes a ref on the children.
+static nodeT *ownNode(arenaT *arena, nodeT **slot) {
+    nodeT *node = *slot;
+    if (node->refs == 1) {
+        return node;
+    }
+    nodeT *copy = allocNode(arena, node);
+    copy->count = node->count;
+    copy->level = node->level;
+    copy->total = node->total;
+    memcpy(copy->branch, node->branch, sizeof(branchT)*node->count);
+    if (copy->level > 0) {
+        for (int index = 0; index < copy->count; index++) {
+            copy->branch[index].child->refs++;
+        }
+    }
+    node->refs--;
+    *slot = copy;
+    return copy;
+}
+
 #if NUM_DIMS == 2
 static inline rectT makeRect(NUMBER minX, NUMBER minY, NUMBER maxX, NUMBER maxY) {
     rectT rect;
@@ -210,6 +390,18 @@ static void reinsert(nodeT *node, listNodeT **listNode) {
     *listNode = nlistNode;
 }
 
+static void updateTotal(nodeT *node) {
+    if (node->level == 0) {
+        node->total = node->count;
+        return;
+    }
+    int total = 0;
+    for (int index = 0; index < node->count; index++) {
+        total += node->branch[index].child->total;
+    }
+    node->total = total;
+}
+
 static void disconnectBranch(nodeT *node, int index) {
     node->branch[index] = node->branch[node->count-1];
     node->count--;
@@ -395,14 +587,14 @@ static void choosePartition(partitionVarsT *parVars, int minFill) {
 static void loadNodes(nodeT *nodeA, nodeT *nodeB, partitionVarsT *parVars) {
     for (int index = 0; index < parVars->total; index++) {
         if (parVars->partition[index] == 0) {
-            addBranch(&parVars->branchBuf[index], nodeA, NULL);
+            addBranch(NULL, &parVars->branchBuf[index], nodeA, NULL);
         } else if (parVars->partition[index] == 1) {
-            addBranch(&parVars->branchBuf[index], nodeB, NULL);
+            addBranch(NULL, &parVars->branchBuf[index], nodeB, NULL);
         }
     }
 }
 
-static void splitNode(nodeT *node, branchT *branch, nodeT **newNode) {
+static void splitNode(arenaT *arena, nodeT *node, branchT *branch, nodeT **newNode) {
     partitionVarsT localVars;
     memset(&localVars, 0, sizeof(partitionVarsT));
     partitionVarsT *parVars = &localVars;
@@ -410,82 +602,82 @@ static void splitNode(nodeT *node, branchT *branch, nodeT **newNode) {
     level = node->level;
     getBranches(node, branch, parVars);
     choosePartition(parVars, MIN_NODES);
-    *newNode = zmalloc(sizeof(nodeT));
-    memset(*newNode, 0, sizeof(nodeT));
+    *newNode = allocNode(arena, node);
     node->level = level;
     (*newNode)->level = node->level;
     loadNodes(node, *newNode, parVars);
+    updateTotal(node);
+    updateTotal(*newNode);
 }
 
-static int addBranch(branchT *branch, nodeT *node, nodeT **newNode) {
+static int addBranch(arenaT *arena, branchT *branch, nodeT *node, nodeT **newNode) {
     if (node->count < MAX_NODES) {
         node->branch[node->count] = *branch;
         node->count++;
+        updateTotal(node);
         return 0;
     }
-    splitNode(node, branch, newNode);
+    splitNode(arena, node, branch, newNode);
     return 1;
 }
 
-static void freeNode(nodeT *node){
-    if (!node){
-        return;
-    }
-    for (int i=0;i<node->count;i++){
-        if (node->branch[i].child){
-            freeNode(node->branch[i].child);
-        }
-    }
-    zfree(node);
-}
-
-static int insertRectRec(rectT rect, void *item, nodeT *node, nodeT **newNode, int level) {
+// insertBranchRec inserts a branch, which is either an item or a subtree,
+// into the nodes at 'level'.
+static int insertBranchRec(arenaT *arena, branchT *branch, nodeT *node, nodeT **newNode, int level) {
     int index = 0;
-    branchT branch;
-    memset(&branch, 0, sizeof(branchT));
+    branchT nbranch;
+    memset(&nbranch, 0, sizeof(branchT));
     nodeT *otherNode = NULL;
     if (node == NULL) {
         return 0;
     }
     if (node->level > level) {
-        index = pickBranch(rect, node);
-        if (!insertRectRec(rect, item, node->branch[index].child, &otherNode, level)) {
-            node->branch[index].rect = combineRect(rect, node->branch[index].rect);
+        index = pickBranch(branch->rect, node);
+        ownNode(arena, &node->branch[index].child);
+        if (!insertBranchRec(arena, branch, node->branch[index].child, &otherNode, level)) {
+            node->branch[index].rect = combineRect(branch->rect, node->branch[index].rect);
+            updateTotal(node);
             return 0;
         }
         node->branch[index].rect = nodeCover(node->branch[index].child);
-        branch.child = otherNode;
-        branch.rect = nodeCover(otherNode);
-        return addBranch(&branch, node, newNode);
+        nbranch.child = otherNode;
+        nbranch.rect = nodeCover(otherNode);
+        return addBranch(arena, &nbranch, node, newNode);
     } else if (node->level == level) {
-        branch.rect = rect;
-        branch.item = item;
-        return addBranch(&branch, node, newNode);
+        return addBranch(arena, branch, node, newNode);
     }
     return 0;
 }
 
-static int insertRect(rectT rect, void *item, nodeT **root, int level) {
+static int insertBranch(arenaT *arena, branchT *branch, nodeT **root, int level) {
     nodeT *newRoot = NULL;
     nodeT *newNode = NULL;
-    branchT branch;
-    memset(&branch, 0, sizeof(branchT));
-    if (insertRectRec(rect, item, *root, &newNode, level)) {
-        newRoot = zmalloc(sizeof(nodeT));
-        memset(newRoot, 0, sizeof(nodeT));
+    branchT nbranch;
+    memset(&nbranch, 0, sizeof(branchT));
+    ownNode(arena, root);
+    if (insertBranchRec(arena, branch, *root, &newNode, level)) {
+        newRoot = allocNode(arena, *root);
         newRoot->level = (*root)->level + 1;
-        branch.rect = nodeCover(*root);
-        branch.child = *root;
-        addBranch(&branch, newRoot, NULL);
-        branch.rect = nodeCover(newNode);
-        branch.child = newNode;
-        addBranch(&branch, newRoot, NULL);
+        nbranch.rect = nodeCover(*root);
+        nbranch.child = *root;
+        addBranch(arena, &nbranch, newRoot, NULL);
+        nbranch.rect = nodeCover(newNode);
+        nbranch.child = newNode;
+        addBranch(arena, &nbranch, newRoot, NULL);
         *root = newRoot;
         return 1;
     }
     return 0;
 }
 
+static int insertRect(arenaT *arena, rectT rect, void *item, nodeT **root, int level) {
+    branchT branch;
+    memset(&branch, 0, sizeof(branchT));
+    branch.rect = rect;
+    branch.item = item;
+    return insertBranch(arena, &branch, root, level);
+}
+
 static int pickBranch(rectT rect, nodeT *node) {
     int firstTime = 1;
     NUMBER increase = 0;
@@ -514,17 +706,6 @@ static int pickBranch(rectT rect, nodeT *node) {
     return best;
 }
 
-static int countRec(nodeT *node, int counter) {
-    if (node->level > 0) {
-        for (int index = 0; index < node->count; index++) {
-            counter = countRec(node->branch[index].child, counter);
-        }
-    } else {
-        counter += node->count;
-    }
-    return counter;
-}
-
 static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNode) {
     if (node == NULL) {
         return 1;
@@ -539,6 +720,7 @@ static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNo
                         reinsert(node->branch[index].child, listNode);
                         disconnectBranch(node, index); 
                     }
+                    updateTotal(node);
                     return 0;
                 }
             }
@@ -547,6 +729,7 @@ static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNo
         for (int index = 0; index < node->count; index++) { 
             if (node->branch[index].item == item) {
                 disconnectBranch(node, index);
+                updateTotal(node);
                 return 0;
             }
         }
@@ -554,25 +737,59 @@ static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNo
     return 1;
 }
 
-static int removeRect(rectT rect, void *item, nodeT **root) {
+// findPath stores in 'path' the branch indexes that lead to the item, in the
+// same order removeRectRec() looks for it, and returns the depth of the 
+// leaf, or -1 when the item is not found.
+static int findPath(rectT rect, void *item, nodeT *node, int *path, int depth) {
+    for (int index = 0; index < node->count; index++) {
+        if (node->level == 0) {
+            if (node->branch[index].item == item) {
+                return depth;
+            }
+        } else if (overlap(rect, node->branch[index].rect)) {
+            path[depth] = index;
+            int found = findPath(rect, item, node->branch[index].child, path, depth+1);
+            if (found >= 0) {
+                return found;
+            }
+        }
+    }
+    return -1;
+}
+
+static int removeRect(arenaT *arena, rectT rect, void *item, nodeT **root) {
     nodeT *tempNode = NULL;
     listNodeT *reinsertList = NULL;
+    if (arena->refs > 1) {
+        // the nodes on the path to the item are copied first if needed, 
+        // the removal only modifies those.
+        int path[64];
+        int depth = findPath(rect, item, *root, path, 0);
+        if (depth < 0) {
+            return 1;
+        }
+        nodeT **slot = root;
+        for (int i = 0; i < depth; i++) {
+            slot = &ownNode(arena, slot)->branch[path[i]].child;
+        }
+        ownNode(arena, slot);
+    }
     if (!removeRectRec(rect, item, *root, &reinsertList)) {
         while (reinsertList != NULL) {
+            // the branches of internal nodes are whole subtrees that are
+            // moved as is, thus only the node itself is freed.
             tempNode = reinsertList->node;
             for (int index = 0; index < tempNode->count; index++) {
-                insertRect(tempNode->branch[index].rect,
-                    tempNode->branch[index].item,
-                    root,
-                    tempNode->level);
+                insertBranch(arena, &tempNode->branch[index], root, tempNode->level);
             }
             listNodeT *prev = reinsertList;
             reinsertList = reinsertList->next;
-            freeNode(prev->node);
+            releaseNode(arena, prev->node);
             zfree(prev);
         }
         if ((*root)->count == 1 && (*root)->level > 0) {
             tempNode = (*root)->branch[0].child;
+            releaseNode(arena, *root);
             *root = tempNode;
         }
         return 0;
@@ -580,13 +797,27 @@ static int removeRect(rectT rect, void *item, nodeT **root) {
     return 1;
 }
 
-static int search(nodeT *node, rectT rect, int(*iterator)(rectT rect, void *item, void *userdata), void *userdata){
+// search calls iterator for each item overlapping rect. When nodeIterator
+// is provided it's first offered each overlapping subtree along with its
+// number of items, and when it returns true the items of the subtree are 
+// counted without being visited. The visited nodes are added to 'visits'.
+static int search(nodeT *node, rectT rect, 
+    int(*nodeIterator)(rectT rect, int count, void *userdata),
+    int(*iterator)(rectT rect, void *item, void *userdata), void *userdata,
+    unsigned long long *visits)
+{
     int counter = 0;
     if (node) {
+        (*visits)++;
         if (node->level > 0) {
             for (int index = 0; index < node->count; index++) {
                 if (overlap(rect, node->branch[index].rect)) {
-                    counter += search(node->branch[index].child, rect, iterator, userdata);
+                    nodeT *child = node->branch[index].child;
+                    if (nodeIterator && nodeIterator(node->branch[index].rect, child->total, userdata)) {
+                        counter += child->total;
+                        continue;
+                    }
+                    counter += search(child, rect, nodeIterator, iterator, userdata, visits);
                 }
             }
         } else {
@@ -605,4 +836,51 @@ static int search(nodeT *node, rectT rect, int(*iterator)(rectT rect, void *item
     return counter;
 }
 
+// bulkLoad builds a packed tree, bottom-up, from branches that are already
+// ordered so that neighbours are close together. Consecutive branches are
+// spread evenly over as few nodes as possible. The branches array is 
+// reused for each level. The nodes of a level are allocated one after 
+// another, so that siblings end up next to each other in the slabs.
+static nodeT *bulkLoad(arenaT *arena, branchT *branches, int count) {
+    int level = 0;
+    if (count == 0) {
+        return NULL;
+    }
+    do {
+        int nnodes = (count+MAX_NODES-1)/MAX_NODES;
+        int index = 0;
+        for (int n = 0; n < nnodes; n++) {
+            int fill = count/nnodes + (n < count%nnodes ? 1 : 0);
+            nodeT *node = allocNode(arena, NULL);
+            node->level = level;
+            for (int i = 0; i < fill; i++) {
+                node->branch[node->count++] = branches[index++];
+            }
+            updateTotal(node);
+            branches[n].rect = nodeCover(node);
+            branches[n].item = NULL;
+            branches[n].child = node;
+        }
+        count = nnodes;
+        level++;
+    } while (count > 1);
+    return branches[0].child;
+}
 
+// scan calls iterator for every item, in the order of the leaves.
+static int scan(nodeT *node, int(*iterator)(rectT rect, void *item, void *userdata), void *userdata) {
+    if (node->level > 0) {
+        for (int index = 0; index < node->count; index++) {
+            if (!scan(node->branch[index].child, iterator, userdata)) {
+                return 0;
+            }
+        }
+    } else {
+        for (int index = 0; index < node->count; index++) {
+            if (!iterator(node->branch[index].rect, node->branch[index].item, userdata)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
@@ -46,11 +46,21 @@ int test_GeomMultiPolygon();
 int test_GeomGeometryCollection();
 int test_GeomIterator();
 int test_GeomPolyMap();
+int test_GeomWritePoint();
+int test_GeomPacked();
 int test_RTreeInsert();
 int test_RTreeSearch();
 int test_RTreeRemove();
+int test_RTreeRemoveMany();
+int test_RTreeSearchNodes();
+int test_RTreeBounds();
+int test_RTreeLoad();
+int test_RTreeMemory();
+int test_RTreeCursor();
+int test_RTreeStats();
 int test_GeoUtilDistance();
 int test_GeoUtilDestination();
+int test_GeoUtilHilbert();
 int test_PolyRayInside();
 int test_PolyRayExteriorHoles();
 int test_PolyInsideShapes();
@@ -92,13 +102,23 @@ test tests[] = {
 	{ "geomGeometryCollection", test_GeomGeometryCollection },
 	{ "geomIterator", test_GeomIterator },
 	{ "geomPolyMap", test_GeomPolyMap },
+	{ "geomWritePoint", test_GeomWritePoint },
+	{ "geomPacked", test_GeomPacked },
 	
 	{ "rtreeInsert", test_RTreeInsert },
 	{ "rtreeSearch", test_RTreeSearch },
 	{ "rtreeRemove", test_RTreeRemove },
+	{ "rtreeRemoveMany", test_RTreeRemoveMany },
+	{ "rtreeSearchNodes", test_RTreeSearchNodes },
+	{ "rtreeBounds", test_RTreeBounds },
+	{ "rtreeLoad", test_RTreeLoad },
+	{ "rtreeMemory", test_RTreeMemory },
+	{ "rtreeCursor", test_RTreeCursor },
+	{ "rtreeStats", test_RTreeStats },
 
 	{ "geoutilDistance", test_GeoUtilDistance },
 	{ "geoutilDestination", test_GeoUtilDestination },
+	{ "geoutilHilbert", test_GeoUtilHilbert },
 
 	{ "polyRayInside", test_PolyRayInside },
 	{ "polyRayExteriorHoles", test_PolyRayExteriorHoles },
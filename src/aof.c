@@ -630,6 +630,10 @@ int loadAppendOnlyFile(char *filename) {
      * to the same file we're about to read. */
     server.aof_state = AOF_OFF;
 
+    /* Named fences are part of the dataset, the ones in the file replace
+     * the current ones. */
+    spatialReleaseNamedFences();
+
     fakeClient = createFakeClient();
     startLoading(fp);
 
@@ -692,6 +696,10 @@ int loadAppendOnlyFile(char *filename) {
             exit(1);
         }
 
+        /* A key rebuilt by GLOADFIELDS is complete once another command
+         * comes. */
+        if (cmd->proc != gloadfieldsCommand) spatialFlushPendingLoad();
+
         /* Run the command in the context of a fake client */
         cmd->proc(fakeClient);
 
@@ -711,6 +719,7 @@ int loadAppendOnlyFile(char *filename) {
     if (fakeClient->flags & CLIENT_MULTI) goto uxeof;
 
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
+    spatialFlushPendingLoad();
     fclose(fp);
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
@@ -983,34 +992,190 @@ int rewriteHashObject(rio *r, robj *key, robj *o) {
     return 1;
 }
 
-/* Emit the commands needed to rebuild a spatial object.
+/* Return true if a spatial field has an expire or attributes, in which case
+ * it can't be part of a GMSET. */
+static int spatialFieldNeedsGset(robj *o, sds field) {
+    long long stamp;
+    return spatialTypeGetExpire(o,field) != -1 ||
+           spatialTypeGetStamp(o,field,&stamp) ||
+           spatialTypeHasAttributes(o,field);
+}
+
+/* Emit a GSET for the spatial field at the current position of the hash
+ * iterator, with its expire as an absolute PXAT time, its IFNEWER 
+ * timestamp and its attributes.
+ * Returns 0 on error, 1 on success. */
+static int rewriteSpatialField(rio *r, robj *key, robj *o,
+                               hashTypeIterator *hi, sds field)
+{
+    long long when = spatialTypeGetExpire(o,field), stamp;
+    int stamped = spatialTypeGetStamp(o,field,&stamp);
+    int attrc, j, ok = 0;
+    sds *attrv = spatialTypeGetAttributesArgv(o,field,&attrc);
+
+    if (rioWriteBulkCount(r,'*',4+(when != -1 ? 2 : 0)+(stamped ? 2 : 0)+
+        (attrc ? 1+attrc : 0)) == 0) goto done;
+    if (rioWriteBulkString(r,"GSET",4) == 0) goto done;
+    if (rioWriteBulkObject(r,key) == 0) goto done;
+    if (rioWriteBulkString(r,field,sdslen(field)) == 0) goto done;
+    if (rioWriteHashIteratorCursor(r,hi,OBJ_HASH_VALUE) == 0) goto done;
+    if (when != -1) {
+        if (rioWriteBulkString(r,"PXAT",4) == 0) goto done;
+        if (rioWriteBulkLongLong(r,when) == 0) goto done;
+    }
+    if (stamped) {
+        if (rioWriteBulkString(r,"IFNEWER",7) == 0) goto done;
+        if (rioWriteBulkLongLong(r,stamp) == 0) goto done;
+    }
+    if (attrc) {
+        if (rioWriteBulkString(r,"FIELDS",6) == 0) goto done;
+        for (j = 0; j < attrc; j++)
+            if (rioWriteBulkString(r,attrv[j],sdslen(attrv[j])) == 0) goto done;
+    }
+    ok = 1;
+done:
+    if (attrv) sdsfreesplitres(attrv,attrc);
+    return ok;
+}
+
+/* Emit a GINDEX command restoring the index options of a spatial key, if
+ * they differ from the defaults. Returns 0 on error, 1 on success. */
+static int rewriteSpatialIndexOptions(rio *r, robj *key, robj *o) {
+    sds *argv;
+    int argc, j, ok = 1;
+
+    argv = spatialTypeGetIndexArgv(o,&argc);
+    if (argv == NULL) return 1;
+    if (rioWriteBulkCount(r,'*',2+argc) == 0 ||
+        rioWriteBulkString(r,"GINDEX",6) == 0 ||
+        rioWriteBulkObject(r,key) == 0) ok = 0;
+    for (j = 0; ok && j < argc; j++) {
+        if (rioWriteBulkString(r,argv[j],sdslen(argv[j])) == 0) ok = 0;
+    }
+    sdsfreesplitres(argv,argc);
+    return ok;
+}
+
+/* Context of rewriteSpatialIndexedField(). */
+typedef struct aofSpatialRewriteContext {
+    rio *r;
+    robj *key;
+    robj *o;
+    int plain;              /* No field needs a GSET. */
+    long long total;        /* Fields in GLOADFIELDS commands. */
+    long long count;        /* Fields in the current command. */
+    long long items;        /* Fields left to emit. */
+} aofSpatialRewriteContext;
+
+/* Append a field to the current GLOADFIELDS command, starting a new one
+ * every AOF_REWRITE_ITEMS_PER_CMD fields. The bounds are written as two or
+ * four little endian doubles, for points and other geometries.
+ * Returns 0 on error, 1 on success. */
+static int rewriteSpatialIndexedField(void *privdata, sds field,
+                                      unsigned char *value, size_t vlen,
+                                      double *rect)
+{
+    aofSpatialRewriteContext *ctx = privdata;
+    double buf[4];
+    int j, count;
+
+    if (!ctx->plain && spatialFieldNeedsGset(ctx->o,field)) return 1;
+    if (ctx->count == 0) {
+        int cmd_items = (ctx->items > AOF_REWRITE_ITEMS_PER_CMD) ?
+            AOF_REWRITE_ITEMS_PER_CMD : ctx->items;
+
+        if (rioWriteBulkCount(ctx->r,'*',3+cmd_items*3) == 0) return 0;
+        if (rioWriteBulkString(ctx->r,"GLOADFIELDS",11) == 0) return 0;
+        if (rioWriteBulkObject(ctx->r,ctx->key) == 0) return 0;
+        if (rioWriteBulkLongLong(ctx->r,ctx->total) == 0) return 0;
+    }
+    count = (rect[0] == rect[2] && rect[1] == rect[3]) ? 2 : 4;
+    for (j = 0; j < count; j++) {
+        buf[j] = rect[j];
+        memrev64ifbe(&buf[j]);
+    }
+    if (rioWriteBulkString(ctx->r,field,sdslen(field)) == 0) return 0;
+    if (rioWriteBulkString(ctx->r,(char*)value,vlen) == 0) return 0;
+    if (rioWriteBulkString(ctx->r,(char*)buf,sizeof(double)*count) == 0)
+        return 0;
+    if (++ctx->count == AOF_REWRITE_ITEMS_PER_CMD) ctx->count = 0;
+    ctx->items--;
+    return 1;
+}
+
+/* Emit the commands needed to rebuild a spatial object. The fields are
+ * emitted in index order with GLOADFIELDS, which is only accepted while
+ * loading the AOF and rebuilds the key as when loading an RDB file: the
+ * values are trusted, fences are not notified and the index is packed in
+ * one go. Fields with an expire, a timestamp or attributes are emitted one
+ * by one with GSET afterwards, and the index options are restored last
+ * with GINDEX.
  * The function returns 0 on error, 1 on success. */
 int rewriteSpatialObject(rio *r, robj *key, robj *o) {
-    o = robjSpatialGetHash(o);
+    aofSpatialRewriteContext ctx;
+    robj *h = robjSpatialGetHash(o);
     hashTypeIterator *hi;
-    long long count = 0, items = hashTypeLength(o);
-
-    hi = hashTypeInitIterator(o);
-    while (hashTypeNext(hi) != C_ERR) {
-        if (count == 0) {
-            int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
-                AOF_REWRITE_ITEMS_PER_CMD : items;
-
-            if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0) return 0;
-            if (rioWriteBulkString(r,"GMSET",5) == 0) return 0;
-            if (rioWriteBulkObject(r,key) == 0) return 0;
+    sds field;
+
+    ctx.r = r;
+    ctx.key = key;
+    ctx.o = o;
+    ctx.plain = spatialTypeVolatileLength(o) == 0 &&
+                spatialTypeStampsLength(o) == 0 &&
+                spatialTypeAttributesLength(o) == 0;
+    ctx.total = hashTypeLength(h);
+    ctx.count = 0;
+
+    /* Count the fields that go in GLOADFIELDS commands. */
+    if (!ctx.plain) {
+        hi = hashTypeInitIterator(h);
+        while (hashTypeNext(hi) != C_ERR) {
+            field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            if (spatialFieldNeedsGset(o,field)) ctx.total--;
+            sdsfree(field);
         }
-
-        if (rioWriteHashIteratorCursor(r, hi, OBJ_HASH_KEY) == 0) return 0;
-        if (rioWriteHashIteratorCursor(r, hi, OBJ_HASH_VALUE) == 0) return 0;
-        if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
-        items--;
+        hashTypeReleaseIterator(hi);
+    }
+    ctx.items = ctx.total;
+    if (ctx.total &&
+        spatialForEachIndexedField(o,rewriteSpatialIndexedField,&ctx) == 0)
+        return 0;
+
+    if (!ctx.plain) {
+        hi = hashTypeInitIterator(h);
+        while (hashTypeNext(hi) != C_ERR) {
+            field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            if (spatialFieldNeedsGset(o,field) &&
+                rewriteSpatialField(r,key,o,hi,field) == 0)
+            {
+                sdsfree(field);
+                hashTypeReleaseIterator(hi);
+                return 0;
+            }
+            sdsfree(field);
+        }
+        hashTypeReleaseIterator(hi);
     }
+    return rewriteSpatialIndexOptions(r,key,o);
+}
 
-    hashTypeReleaseIterator(hi);
+/* Emit the SELECT and GFENCE CREATE commands needed to rebuild a named
+ * fence. The function returns 0 on error, 1 on success. */
+static int rewriteNamedFence(void *privdata, int dbid, int argc, robj **argv) {
+    char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
+    rio *r = privdata;
+    int j;
 
+    if (rioWrite(r,selectcmd,sizeof(selectcmd)-1) == 0) return 0;
+    if (rioWriteBulkLongLong(r,dbid) == 0) return 0;
+    if (rioWriteBulkCount(r,'*',2+argc) == 0) return 0;
+    if (rioWriteBulkString(r,"GFENCE",6) == 0) return 0;
+    if (rioWriteBulkString(r,"CREATE",6) == 0) return 0;
+    for (j = 0; j < argc; j++)
+        if (rioWriteBulkObject(r,argv[j]) == 0) return 0;
     return 1;
 }
+
 /* This function is called by the child rewriting the AOF file to read
  * the difference accumulated from the parent into a buffer, that is
  * concatenated at the end of the rewrite. */
@@ -1057,6 +1222,7 @@ int rewriteAppendOnlyFile(char *filename) {
     rioInitWithFile(&aof,fp);
     if (server.aof_rewrite_incremental_fsync)
         rioSetAutoSync(&aof,AOF_AUTOSYNC_BYTES);
+    if (spatialForEachNamedFence(rewriteNamedFence,&aof) == 0) goto werr;
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
@@ -1302,8 +1468,10 @@ int rewriteAppendOnlyFileBackground(void) {
 
             if (private_dirty) {
                 serverLog(LL_NOTICE,
-                    "AOF rewrite: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
+                    "AOF rewrite: %zu MB of memory used by copy-on-write "
+                    "(%zu pages)",
+                    private_dirty/(1024*1024),
+                    private_dirty/sysconf(_SC_PAGESIZE));
             }
             exitFromChild(0);
         } else {
@@ -4496,7 +4496,9 @@ void createDumpPayload(rio *payload, robj *o) {
     uint64_t crc;
 
     /* Serialize the object in a RDB-like format. It consist of an object type
-     * byte followed by the serialized object. This is understood by RESTORE. */
+     * byte followed by the serialized object. This is understood by RESTORE.
+     * Spatial keys are in index order, so that RESTORE packs the index at 
+     * once. */
     rioInitWithBuffer(payload,sdsempty());
     serverAssert(rdbSaveObjectType(payload,o));
     serverAssert(rdbSaveObject(payload,o));
@@ -84,6 +84,8 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
         }
     }
     val = lookupKey(db,key);
+    if (val && val->type == OBJ_SPATIAL &&
+        spatialExpireFieldsIfNeeded(db,key,val)) val = NULL;
     if (val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -92,8 +94,13 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
+    robj *val;
+
     expireIfNeeded(db,key);
-    return lookupKey(db,key);
+    val = lookupKey(db,key);
+    if (val && val->type == OBJ_SPATIAL &&
+        spatialExpireFieldsIfNeeded(db,key,val)) val = NULL;
+    return val;
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
@@ -118,6 +125,10 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
+    if (val->type == OBJ_SPATIAL) {
+        spatialAttachFences(db, key, val);
+        spatialTrackExpires(db, key, val);
+    }
     if (server.cluster_enabled) slotToKeyAdd(key);
  }
 
@@ -131,6 +142,10 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
 
     serverAssertWithInfo(NULL,key,de != NULL);
     dictReplace(db->dict, key->ptr, val);
+    if (val->type == OBJ_SPATIAL) {
+        spatialAttachFences(db, key, val);
+        spatialTrackExpires(db, key, val);
+    }
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -1265,6 +1280,27 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
     return keys;
 }
 
+/* Helper function to extract keys from the GFENCE command.
+ *
+ * GFENCE CREATE <name> <key> ...
+ * GFENCE DROP <name> ... <name>
+ *
+ * Only CREATE refers to a key, the fence names are not keys. */
+int *gfenceGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int *keys;
+    UNUSED(cmd);
+
+    if (argc < 5 || strcasecmp(argv[1]->ptr,"create")) {
+        *numkeys = 0;
+        return NULL;
+    }
+
+    keys = zmalloc(sizeof(int));
+    keys[0] = 3;
+    *numkeys = 1;
+    return keys;
+}
+
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster. */
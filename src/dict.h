@@ -146,6 +146,12 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
+/* Keep lookups from performing rehashing steps, the same way a safe
+ * iterator does, so that a process walking a dict in random order, such as
+ * a saving child, doesn't write to the entries of the table. */
+#define dictPauseRehashing(d) ((d)->iterators++)
+#define dictResumeRehashing(d) ((d)->iterators--)
+
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
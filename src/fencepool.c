@@ -0,0 +1,235 @@
+/* Background fence evaluation for Redis spatial keys.
+ *
+ * Matching a written object against the fences of a key may involve
+ * expensive polygon math. When 'fence-threads' is greater than zero the
+ * geometric part of the work is handed to a pool of worker threads so that
+ * the latency of GSET and friends no longer depends on fence complexity.
+ *
+ * DESIGN
+ * ------
+ *
+ * A job is an opaque argument with two callbacks: 'eval', which runs in a
+ * worker thread and must only touch data owned by the job (immutable
+ * snapshots of the fences and the written object), and 'publish', which
+ * runs in the main thread and is allowed to call into the rest of Redis.
+ *
+ * Every job is appended both to the queue of work to perform and to the
+ * list of inflight jobs. Workers may finish jobs in any order, but the main
+ * thread only publishes from the head of the inflight list, so results are
+ * always published in submission order, which implies per-key write order.
+ *
+ * Workers wake up the main thread by writing a byte into a pipe that is
+ * registered with the event loop.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016, Josh Baker <joshbaker77@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "fencepool.h"
+
+static pthread_t *fencepool_threads;
+static int fencepool_numthreads;
+static pthread_mutex_t fencepool_mutex;
+static pthread_cond_t fencepool_newjob_cond;
+static list *fencepool_todo;      /* Jobs waiting for a worker. */
+static list *fencepool_inflight;  /* All the jobs in submission order. */
+static int fencepool_pipe[2];     /* Used by workers to wake up the loop. */
+
+/* This structure represents a fence job. It is only used locally to this
+ * file as the API does not expose the internals at all. */
+typedef struct fencepoolJob {
+    void *arg;
+    fencepoolProc eval;
+    fencepoolProc publish;
+    int done;   /* Set by the worker, protected by fencepool_mutex. */
+} fencepoolJob;
+
+void *fencepoolProcessJobs(void *arg);
+
+/* Make sure we have enough stack to perform the polygon math. */
+#define FENCEPOOL_THREAD_STACK_SIZE (1024*1024*4)
+
+/* Read handler for the notification pipe: drain it and publish whatever
+ * is ready at the head of the inflight list. */
+static void fencepoolReadPipe(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    fencepoolPublishCompleted();
+}
+
+/* Initialize the fence pool, spawning 'threads' workers. With zero threads
+ * the pool stays disabled and fences are evaluated inline. */
+void fencepoolInit(int threads) {
+    pthread_attr_t attr;
+    size_t stacksize;
+    char err[ANET_ERR_LEN];
+    int j;
+
+    fencepool_numthreads = 0;
+    if (threads <= 0) return;
+
+    pthread_mutex_init(&fencepool_mutex,NULL);
+    pthread_cond_init(&fencepool_newjob_cond,NULL);
+    fencepool_todo = listCreate();
+    fencepool_inflight = listCreate();
+
+    if (pipe(fencepool_pipe) == -1 ||
+        anetNonBlock(err,fencepool_pipe[0]) == ANET_ERR ||
+        anetNonBlock(err,fencepool_pipe[1]) == ANET_ERR)
+    {
+        serverLog(LL_WARNING,"Fatal: Can't create the fence pool pipe.");
+        exit(1);
+    }
+    if (aeCreateFileEvent(server.el,fencepool_pipe[0],AE_READABLE,
+        fencepoolReadPipe,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the fence pool file event.");
+    }
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < FENCEPOOL_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    fencepool_threads = zmalloc(sizeof(pthread_t)*threads);
+    for (j = 0; j < threads; j++) {
+        if (pthread_create(&fencepool_threads[j],&attr,
+            fencepoolProcessJobs,NULL) != 0)
+        {
+            serverLog(LL_WARNING,"Fatal: Can't initialize the fence pool.");
+            exit(1);
+        }
+    }
+    fencepool_numthreads = threads;
+}
+
+/* Queue a job. 'eval' is called from a worker thread, 'publish' is called
+ * later from the main thread, after the publish callbacks of every job that
+ * was submitted before this one. */
+void fencepoolSubmit(void *arg, fencepoolProc eval, fencepoolProc publish) {
+    fencepoolJob *job = zmalloc(sizeof(*job));
+
+    job->arg = arg;
+    job->eval = eval;
+    job->publish = publish;
+    job->done = (eval == NULL);
+    pthread_mutex_lock(&fencepool_mutex);
+    listAddNodeTail(fencepool_inflight,job);
+    if (!job->done) {
+        listAddNodeTail(fencepool_todo,job);
+        pthread_cond_signal(&fencepool_newjob_cond);
+    }
+    pthread_mutex_unlock(&fencepool_mutex);
+
+    /* A job without evaluation step may be ready right away, but only if
+     * nothing is queued in front of it. */
+    if (job->done) fencepoolPublishCompleted();
+}
+
+void *fencepoolProcessJobs(void *arg) {
+    fencepoolJob *job;
+    sigset_t sigset;
+    UNUSED(arg);
+
+    /* Make the thread killable at any time, like the bio threads. */
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in fence pool thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&fencepool_mutex);
+    while(1) {
+        listNode *ln;
+
+        if (listLength(fencepool_todo) == 0) {
+            pthread_cond_wait(&fencepool_newjob_cond,&fencepool_mutex);
+            continue;
+        }
+        ln = listFirst(fencepool_todo);
+        job = ln->value;
+        listDelNode(fencepool_todo,ln);
+        pthread_mutex_unlock(&fencepool_mutex);
+
+        job->eval(job->arg);
+
+        pthread_mutex_lock(&fencepool_mutex);
+        job->done = 1;
+        if (write(fencepool_pipe[1],"x",1) == -1) {
+            /* Pipe full: the main thread is already going to wake up. */
+        }
+    }
+}
+
+/* Publish the results of every completed job at the head of the inflight
+ * list. Must be called from the main thread. */
+void fencepoolPublishCompleted(void) {
+    list *ready = listCreate();
+    listNode *ln;
+
+    pthread_mutex_lock(&fencepool_mutex);
+    while ((ln = listFirst(fencepool_inflight)) != NULL) {
+        fencepoolJob *job = ln->value;
+        if (!job->done) break;
+        listAddNodeTail(ready,job);
+        listDelNode(fencepool_inflight,ln);
+    }
+    pthread_mutex_unlock(&fencepool_mutex);
+
+    while ((ln = listFirst(ready)) != NULL) {
+        fencepoolJob *job = ln->value;
+        job->publish(job->arg);
+        zfree(job);
+        listDelNode(ready,ln);
+    }
+    listRelease(ready);
+}
+
+/* Return the number of jobs not yet published. */
+unsigned long long fencepoolPendingJobs(void) {
+    unsigned long long pending;
+    if (fencepool_numthreads == 0) return 0;
+    pthread_mutex_lock(&fencepool_mutex);
+    pending = listLength(fencepool_inflight);
+    pthread_mutex_unlock(&fencepool_mutex);
+    return pending;
+}
@@ -127,7 +127,7 @@ client *createClient(int fd) {
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;
-    c->spatial_fence = NULL;
+    c->spatial_fences = NULL;
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     if (fd != -1) listAddNodeTail(server.clients,c);
@@ -798,7 +798,7 @@ void freeClient(client *c) {
     unwatchAllKeys(c);
     listRelease(c->watched_keys);
 
-    /* Free the spatial fence channel */
+    /* Release the spatial fences */
     spatialReleaseAllFences(c);
 
     /* Unsubscribe from all the pubsub channels */
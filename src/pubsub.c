@@ -109,6 +109,8 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
              * Redis PUBSUB creating millions of channels. */
             dictDelete(server.pubsub_channels,channel);
         }
+        /* Unsubscribing from a fence channel releases the fence. */
+        spatialUnsubscribeFence(c,channel);
     }
     /* Notify the client */
     if (notify) {
@@ -539,9 +539,9 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_SPATIAL:
         o = (robj*)robjSpatialGetHash(o);
         if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_SPATIAL_ZIPLIST);
+            return rdbSaveType(rdb,RDB_TYPE_SPATIAL_ZIPLIST_2);
         else if (o->encoding == OBJ_ENCODING_HT)
-            return rdbSaveType(rdb,RDB_TYPE_SPATIAL);
+            return rdbSaveType(rdb,RDB_TYPE_SPATIAL_RTREE);
         else
             serverPanic("Unknown spatial encoding");
     default:
@@ -559,6 +559,221 @@ int rdbLoadObjectType(rio *rdb) {
     return type;
 }
 
+/* The bounds of a spatial field are saved as little endian binary doubles,
+ * so that loading does not need to compute them again. A leading byte tells
+ * if it's a point, saved with two doubles, or a rect with four. */
+#define RDB_SPATIAL_POINT 0
+#define RDB_SPATIAL_RECT 1
+
+typedef struct rdbSpatialSaveContext {
+    rio *rdb;
+    ssize_t nwritten;
+} rdbSpatialSaveContext;
+
+static int rdbSaveSpatialField(void *privdata, sds field, unsigned char *value, size_t vlen, double *rect) {
+    rdbSpatialSaveContext *ctx = privdata;
+    unsigned char kind;
+    double buf[4];
+    ssize_t n;
+    int j, count;
+
+    if ((n = rdbSaveRawString(ctx->rdb,(unsigned char*)field,
+            sdslen(field))) == -1) return 0;
+    ctx->nwritten += n;
+    if ((n = rdbSaveRawString(ctx->rdb,value,vlen)) == -1) return 0;
+    ctx->nwritten += n;
+    if (rect[0] == rect[2] && rect[1] == rect[3]) {
+        kind = RDB_SPATIAL_POINT;
+        count = 2;
+    } else {
+        kind = RDB_SPATIAL_RECT;
+        count = 4;
+    }
+    for (j = 0; j < count; j++) {
+        buf[j] = rect[j];
+        memrev64ifbe(&buf[j]);
+    }
+    if ((n = rdbWriteRaw(ctx->rdb,&kind,1)) == -1) return 0;
+    ctx->nwritten += n;
+    if ((n = rdbWriteRaw(ctx->rdb,buf,sizeof(double)*count)) == -1) return 0;
+    ctx->nwritten += n;
+    return 1;
+}
+
+static int rdbLoadSpatialRect(rio *rdb, double *rect) {
+    unsigned char kind;
+    int j;
+
+    if (rioRead(rdb,&kind,1) == 0) return -1;
+    if (kind == RDB_SPATIAL_POINT) {
+        if (rioRead(rdb,rect,sizeof(double)*2) == 0) return -1;
+        memrev64ifbe(&rect[0]);
+        memrev64ifbe(&rect[1]);
+        rect[2] = rect[0];
+        rect[3] = rect[1];
+    } else if (kind == RDB_SPATIAL_RECT) {
+        if (rioRead(rdb,rect,sizeof(double)*4) == 0) return -1;
+        for (j = 0; j < 4; j++) memrev64ifbe(&rect[j]);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* The per field state and the index options of a spatial key follow its
+ * fields, in RDB files and DUMP payloads alike, as:
+ *
+ *   expires:    len (field ms-time)*
+ *   timestamps: len (field string)*
+ *   attributes: len (field len string*)*
+ *   index:      len string*
+ *
+ * where strings are saved with rdbSaveRawString(). */
+static int rdbSaveSpatialFieldExpire(void *privdata, sds field, long long when) {
+    rdbSpatialSaveContext *ctx = privdata;
+    ssize_t n;
+
+    if ((n = rdbSaveRawString(ctx->rdb,(unsigned char*)field,
+            sdslen(field))) == -1) return 0;
+    ctx->nwritten += n;
+    if ((n = rdbSaveMillisecondTime(ctx->rdb,when)) == -1) return 0;
+    ctx->nwritten += n;
+    return 1;
+}
+
+static int rdbSaveSpatialFieldStamp(void *privdata, sds field, long long stamp) {
+    rdbSpatialSaveContext *ctx = privdata;
+    ssize_t n;
+
+    if ((n = rdbSaveRawString(ctx->rdb,(unsigned char*)field,
+            sdslen(field))) == -1) return 0;
+    ctx->nwritten += n;
+    if ((n = rdbSaveLongLongAsStringObject(ctx->rdb,stamp)) == -1) return 0;
+    ctx->nwritten += n;
+    return 1;
+}
+
+static int rdbSaveSpatialStrings(rdbSpatialSaveContext *ctx, int argc, sds *argv) {
+    ssize_t n;
+    int j;
+
+    if ((n = rdbSaveLen(ctx->rdb,argc)) == -1) return 0;
+    ctx->nwritten += n;
+    for (j = 0; j < argc; j++) {
+        if ((n = rdbSaveRawString(ctx->rdb,(unsigned char*)argv[j],
+                sdslen(argv[j]))) == -1) return 0;
+        ctx->nwritten += n;
+    }
+    return 1;
+}
+
+static int rdbSaveSpatialFieldAttributes(void *privdata, sds field, int argc, sds *argv) {
+    rdbSpatialSaveContext *ctx = privdata;
+    ssize_t n;
+
+    if ((n = rdbSaveRawString(ctx->rdb,(unsigned char*)field,
+            sdslen(field))) == -1) return 0;
+    ctx->nwritten += n;
+    return rdbSaveSpatialStrings(ctx,argc,argv);
+}
+
+/* Save the per field state and the index options of a spatial key. 
+ * Returns -1 on error, number of bytes written on success. */
+static ssize_t rdbSaveSpatialMetadata(rio *rdb, robj *o) {
+    rdbSpatialSaveContext ctx = {rdb, 0};
+    sds *argv;
+    ssize_t n;
+    int argc, ok;
+
+    if ((n = rdbSaveLen(rdb,spatialTypeVolatileLength(o))) == -1) return -1;
+    ctx.nwritten += n;
+    if (!spatialForEachFieldExpire(o,rdbSaveSpatialFieldExpire,&ctx)) return -1;
+    if ((n = rdbSaveLen(rdb,spatialTypeStampsLength(o))) == -1) return -1;
+    ctx.nwritten += n;
+    if (!spatialForEachFieldStamp(o,rdbSaveSpatialFieldStamp,&ctx)) return -1;
+    if ((n = rdbSaveLen(rdb,spatialTypeAttributesLength(o))) == -1) return -1;
+    ctx.nwritten += n;
+    if (!spatialForEachFieldAttributes(o,rdbSaveSpatialFieldAttributes,&ctx))
+        return -1;
+    argv = spatialTypeGetIndexArgv(o,&argc);
+    ok = rdbSaveSpatialStrings(&ctx,argc,argv);
+    if (argv) sdsfreesplitres(argv,argc);
+    return ok ? ctx.nwritten : -1;
+}
+
+/* Load up to 'max' strings saved by rdbSaveSpatialStrings(). Returns NULL
+ * on error, otherwise the result must be freed with sdsfreesplitres(). */
+static sds *rdbLoadSpatialStrings(rio *rdb, int max, int *argc) {
+    uint32_t len, j;
+    sds *argv;
+
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR || len > (uint32_t)max)
+        return NULL;
+    argv = zmalloc(sizeof(sds)*(len ? len : 1));
+    for (j = 0; j < len; j++) {
+        if ((argv[j] = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL) {
+            sdsfreesplitres(argv,j);
+            return NULL;
+        }
+    }
+    *argc = len;
+    return argv;
+}
+
+/* Load the state saved by rdbSaveSpatialMetadata() into a spatial key.
+ * Returns -1 on error. */
+static int rdbLoadSpatialMetadata(rio *rdb, robj *o) {
+    uint32_t len, j;
+    sds field = NULL, *argv;
+    const char *err;
+    int argc, ok;
+
+    /* Expires */
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    for (j = 0; j < len; j++) {
+        long long when;
+        if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL ||
+            (when = rdbLoadMillisecondTime(rdb)) == -1) goto err;
+        if (spatialTypeExists(o,field)) spatialTypeSetExpire(o,field,when);
+        sdsfree(field);
+        field = NULL;
+    }
+    /* Timestamps */
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    for (j = 0; j < len; j++) {
+        long long stamp;
+        robj *s;
+        if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL ||
+            (s = rdbLoadStringObject(rdb)) == NULL) goto err;
+        ok = getLongLongFromObject(s,&stamp) == C_OK;
+        decrRefCount(s);
+        if (!ok) goto err;
+        if (spatialTypeExists(o,field)) spatialTypeSetStamp(o,field,stamp);
+        sdsfree(field);
+        field = NULL;
+    }
+    /* Attributes */
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    for (j = 0; j < len; j++) {
+        if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL ||
+            (argv = rdbLoadSpatialStrings(rdb,65536,&argc)) == NULL) goto err;
+        ok = spatialTypeSetAttributesArgv(o,field,argc,argv) == C_OK;
+        sdsfreesplitres(argv,argc);
+        if (!ok) goto err;
+        sdsfree(field);
+        field = NULL;
+    }
+    /* Index options */
+    if ((argv = rdbLoadSpatialStrings(rdb,16,&argc)) == NULL) return -1;
+    ok = spatialTypeSetIndexOptions(o,argc,argv,&err) == C_OK;
+    sdsfreesplitres(argv,argc);
+    return ok ? 0 : -1;
+
+err:
+    if (field) sdsfree(field);
+    return -1;
+}
+
 /* Save a Redis object. Returns -1 on error, number of bytes written on success. */
 ssize_t rdbSaveObject(rio *rdb, robj *o) {
     ssize_t n = 0, nwritten = 0;
@@ -644,10 +859,27 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         } else {
             serverPanic("Unknown sorted set encoding");
         }
+    } else if (o->type == OBJ_SPATIAL &&
+               ((robj*)robjSpatialGetHash(o))->encoding == OBJ_ENCODING_HT)
+    {
+        /* Save a large spatial value in index order */
+        rdbSpatialSaveContext ctx = {rdb, 0};
+
+        if ((n = rdbSaveLen(rdb,
+                hashTypeLength(robjSpatialGetHash(o)))) == -1) return -1;
+        nwritten += n;
+        if (!spatialForEachIndexedField(o,rdbSaveSpatialField,&ctx))
+            return -1;
+        nwritten += ctx.nwritten;
+        if ((n = rdbSaveSpatialMetadata(rdb,o)) == -1) return -1;
+        nwritten += n;
     } else if (o->type == OBJ_HASH ||
                o->type == OBJ_SPATIAL)
     {
+        robj *spatial = NULL;
+
         if (o->type == OBJ_SPATIAL){
+            spatial = o;
             o = (robj*)robjSpatialGetHash(o);
         }
         /* Save a hash value */
@@ -679,6 +911,10 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         } else {
             serverPanic("Unknown hash encoding");
         }
+        if (spatial) {
+            if ((n = rdbSaveSpatialMetadata(rdb,spatial)) == -1) return -1;
+            nwritten += n;
+        }
     } else {
         serverPanic("Unknown object type");
     }
@@ -750,6 +986,24 @@ int rdbSaveInfoAuxFields(rio *rdb) {
     return 1;
 }
 
+/* Save a named spatial fence as an AUX field. The value is the db followed
+ * by the GFENCE CREATE arguments, quoted so that it can be split back with
+ * sdssplitargs(). Returns 0 on error, as expected by
+ * spatialForEachNamedFence(). */
+static int rdbSaveNamedFence(void *privdata, int dbid, int argc, robj **argv) {
+    rio *rdb = privdata;
+    sds val = sdsfromlonglong(dbid);
+    int j, retval;
+
+    for (j = 0; j < argc; j++) {
+        val = sdscatlen(val," ",1);
+        val = sdscatrepr(val,argv[j]->ptr,sdslen(argv[j]->ptr));
+    }
+    retval = rdbSaveAuxField(rdb,"gfence",6,val,sdslen(val));
+    sdsfree(val);
+    return retval != -1;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -771,6 +1025,7 @@ int rdbSaveRio(rio *rdb, int *error) {
     snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb) == -1) goto werr;
+    if (spatialForEachNamedFence(rdbSaveNamedFence,rdb) == 0) goto werr;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -936,8 +1191,10 @@ int rdbSaveBackground(char *filename) {
 
             if (private_dirty) {
                 serverLog(LL_NOTICE,
-                    "RDB: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
+                    "RDB: %zu MB of memory used by copy-on-write "
+                    "(%zu pages)",
+                    private_dirty/(1024*1024),
+                    private_dirty/sysconf(_SC_PAGESIZE));
             }
         }
         exitFromChild((retval == C_OK) ? 0 : 1);
@@ -1069,7 +1326,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
                 zsetConvert(o,OBJ_ENCODING_ZIPLIST);
-    } else if (rdbtype == RDB_TYPE_HASH || rdbtype == RDB_TYPE_SPATIAL) {
+    } else if (rdbtype == RDB_TYPE_HASH) {
         size_t len;
         int ret;
         sds field, value;
@@ -1129,10 +1386,37 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
+    } else if (rdbtype == RDB_TYPE_SPATIAL ||
+               rdbtype == RDB_TYPE_SPATIAL_RTREE)
+    {
+        spatialLoader *sl;
+        sds field, value;
+        double rect[4];
 
-        /* Convert to spatial type if needed. */
-        if (rdbtype == RDB_TYPE_SPATIAL) {
-            o = robjSpatialNewHash(o);
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        sl = spatialLoaderNew(len);
+
+        /* Fields go straight to the spatial key. They come in index order
+         * with their bounds in the RTREE encoding, the R-tree is packed
+         * after sorting them otherwise. */
+        while (len--) {
+            if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL)
+                return NULL;
+            if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS)) == NULL)
+                return NULL;
+            if (rdbtype == RDB_TYPE_SPATIAL_RTREE) {
+                if (rdbLoadSpatialRect(rdb,rect) == -1) return NULL;
+            }
+            if (spatialLoaderAdd(sl,field,value,
+                    rdbtype == RDB_TYPE_SPATIAL_RTREE ? rect : NULL) == C_ERR)
+                rdbExitReportCorruptRDB("Duplicate keys detected");
+        }
+        o = spatialLoaderFinish(sl);
+        if (rdbtype == RDB_TYPE_SPATIAL_RTREE &&
+            rdbLoadSpatialMetadata(rdb,o) == -1)
+        {
+            decrRefCount(o);
+            return NULL;
         }
     } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1151,7 +1435,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                rdbtype == RDB_TYPE_ZSET_ZIPLIST    ||
                rdbtype == RDB_TYPE_HASH_ZIPLIST    ||
                rdbtype == RDB_TYPE_SPATIAL_ZIPMAP  ||
-               rdbtype == RDB_TYPE_SPATIAL_ZIPLIST)
+               rdbtype == RDB_TYPE_SPATIAL_ZIPLIST ||
+               rdbtype == RDB_TYPE_SPATIAL_ZIPLIST_2)
     {
         unsigned char *encoded = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN);
         if (encoded == NULL) return NULL;
@@ -1213,6 +1498,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
             case RDB_TYPE_SPATIAL_ZIPLIST:
+            case RDB_TYPE_SPATIAL_ZIPLIST_2:
                 o->type = OBJ_HASH;
                 o->encoding = OBJ_ENCODING_ZIPLIST;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
@@ -1225,10 +1511,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         /* Convert to spatial type if needed. */
         if (rdbtype == RDB_TYPE_SPATIAL_ZIPLIST ||
+            rdbtype == RDB_TYPE_SPATIAL_ZIPLIST_2 ||
             rdbtype == RDB_TYPE_SPATIAL_ZIPMAP)
         {
             o = robjSpatialNewHash(o);
         }
+        if (rdbtype == RDB_TYPE_SPATIAL_ZIPLIST_2 &&
+            rdbLoadSpatialMetadata(rdb,o) == -1)
+        {
+            decrRefCount(o);
+            return NULL;
+        }
     } else {
         rdbExitReportCorruptRDB("Unknown object type");
     }
@@ -1312,6 +1605,10 @@ int rdbLoad(char *filename) {
         return C_ERR;
     }
 
+    /* Named fences are part of the dataset, the ones in the file replace
+     * the current ones. */
+    spatialReleaseNamedFences();
+
     startLoading(fp);
     while(1) {
         robj *key, *val;
@@ -1381,6 +1678,12 @@ int rdbLoad(char *filename) {
                 serverLog(LL_NOTICE,"RDB '%s': %s",
                     (char*)auxkey->ptr,
                     (char*)auxval->ptr);
+            } else if (!strcasecmp(auxkey->ptr,"gfence")) {
+                if (spatialLoadNamedFence(auxval->ptr) == C_ERR) {
+                    serverLog(LL_WARNING,
+                        "Skipping invalid named fence in RDB: %s",
+                        (char*)auxval->ptr);
+                }
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -1652,8 +1955,10 @@ int rdbSaveToSlavesSockets(void) {
 
             if (private_dirty) {
                 serverLog(LL_NOTICE,
-                    "RDB: %zu MB of memory used by copy-on-write",
-                    private_dirty/(1024*1024));
+                    "RDB: %zu MB of memory used by copy-on-write "
+                    "(%zu pages)",
+                    private_dirty/(1024*1024),
+                    private_dirty/sysconf(_SC_PAGESIZE));
             }
 
             /* If we are returning OK, at least one slave was served
@@ -38,7 +38,7 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 7
+#define RDB_VERSION 8
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -86,10 +86,12 @@
 #define RDB_TYPE_LIST_QUICKLIST  14
 #define RDB_TYPE_SPATIAL_ZIPMAP  15
 #define RDB_TYPE_SPATIAL_ZIPLIST 16
+#define RDB_TYPE_SPATIAL_RTREE   17
+#define RDB_TYPE_SPATIAL_ZIPLIST_2 18
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 5) || (t >= 9 && t <= 16))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 5) || (t >= 9 && t <= 18))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_AUX        250
@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "94f5adfd"
+#define REDIS_GIT_DIRTY "769"
+#define REDIS_BUILD_ID "vm-1792319875"
@@ -31,6 +31,7 @@
 #include "cluster.h"
 #include "slowlog.h"
 #include "bio.h"
+#include "fencepool.h"
 #include "latency.h"
 
 #include <time.h>
@@ -295,10 +296,12 @@ struct redisCommand redisCommandTable[] = {
     {"pfmerge",pfmergeCommand,-2,"wm",0,NULL,1,-1,1,0,0},
     {"pfdebug",pfdebugCommand,-3,"w",0,NULL,0,0,0,0,0},
     {"latency",latencyCommand,-2,"arslt",0,NULL,0,0,0,0,0},
-    {"gset",gsetCommand,4,"wmF",0,NULL,1,1,1,0,0},
+    {"gset",gsetCommand,-4,"wmF",0,NULL,1,1,1,0,0},
     {"gsetnx",gsetnxCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"gget",ggetCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"gmset",gmsetCommand,-4,"wm",0,NULL,1,1,1,0,0},
+    {"gmsetpoints",gmsetpointsCommand,4,"wm",0,NULL,1,1,1,0,0},
+    {"gloadfields",gloadfieldsCommand,-6,"wm",0,NULL,1,1,1,0,0},
     {"gmget",gmgetCommand,-3,"r",0,NULL,1,1,1,0,0},
     {"gdel",gdelCommand,-3,"wF",0,NULL,1,1,1,0,0},
     {"glen",glenCommand,2,"rF",0,NULL,1,1,1,0,0},
@@ -307,8 +310,15 @@ struct redisCommand redisCommandTable[] = {
     {"gvals",gvalsCommand,2,"rS",0,NULL,1,1,1,0,0},
     {"ggetall",ggetallCommand,2,"r",0,NULL,1,1,1,0,0},
     {"gexists",gexistsCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"gttl",gttlCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"gfields",gfieldsCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"gindex",gindexCommand,-2,"w",0,NULL,1,1,1,0,0},
+    {"ginfo",ginfoCommand,-2,"r",0,NULL,1,1,1,0,0},
+    {"gpttl",gpttlCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"gscan",gscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
     {"gsearch",gsearchCommand,-3,"rR",0,NULL,1,1,1,0,0},
+    {"gfence",gfenceCommand,-3,"wm",0,gfenceGetKeys,0,0,0,0,0},
+    {"gfences",gfencesCommand,1,"r",0,NULL,0,0,0,0,0},
 };
 
 struct evictionPoolEntry *evictionPoolAlloc(void);
@@ -607,6 +617,17 @@ dictType keyptrDictType = {
     NULL                        /* val destructor */
 };
 
+/* Db->fences, keys are sds strings, vals are lists of fences. The fences
+ * are not owned by the lists. */
+dictType fenceKeyDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictListDestructor          /* val destructor */
+};
+
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -1048,8 +1069,13 @@ void clientsCron(void) {
 void databasesCron(void) {
     /* Expire keys by random sampling. Not required for slaves
      * as master will synthesize DELs for us. */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL) {
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
+        spatialActiveExpireCycle();
+    }
+
+    /* Release the spatial search cursors that were left behind. */
+    spatialSearchCursorsCron();
 
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
@@ -1362,6 +1388,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* Publish the fence notifications batched during this iteration. */
+    spatialFlushFenceBatches();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWrites();
 }
@@ -1547,6 +1576,8 @@ void initServerConfig(void) {
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.maxmemory_spatial_fields = CONFIG_DEFAULT_MAXMEMORY_SPATIAL_FIELDS;
+    server.fence_threads = CONFIG_DEFAULT_FENCE_THREADS;
 
     server.lruclock = getLRUClock();
     resetServerSaveParams();
@@ -1610,6 +1641,7 @@ void initServerConfig(void) {
     server.rpopCommand = lookupCommandByCString("rpop");
     server.sremCommand = lookupCommandByCString("srem");
     server.execCommand = lookupCommandByCString("exec");
+    server.gdelCommand = lookupCommandByCString("gdel");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -1847,6 +1879,8 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expiredfields = 0;
+    server.stat_evictedfields = 0;
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
@@ -1930,6 +1964,8 @@ void initServer(void) {
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].fences = dictCreate(&fenceKeyDictType,NULL);
+        server.db[j].gexpires = dictCreate(&setDictType,NULL);
         server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
@@ -1938,7 +1974,8 @@ void initServer(void) {
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
-    server.fences = dictCreate(&dbDictType,NULL);
+    server.fences = dictCreate(&keyptrDictType,NULL);
+    server.named_fences = dictCreate(&setDictType,NULL);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
@@ -2008,6 +2045,7 @@ void initServer(void) {
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    fencepoolInit(server.fence_threads);
 }
 
 /* Populates the Redis Command Table starting from the hard coded list
@@ -2484,9 +2522,11 @@ int processCommand(client *c) {
         return C_OK;
     }
 
-    /* Only allow SUBSCRIBE and UNSUBSCRIBE in the context of Pub/Sub */
+    /* Only allow SUBSCRIBE and UNSUBSCRIBE in the context of Pub/Sub. 
+     * GSEARCH is allowed as well in order to add fences. */
     if (c->flags & CLIENT_PUBSUB &&
         c->cmd->proc != pingCommand &&
+        c->cmd->proc != gsearchCommand &&
         c->cmd->proc != subscribeCommand &&
         c->cmd->proc != unsubscribeCommand &&
         c->cmd->proc != psubscribeCommand &&
@@ -3111,12 +3151,16 @@ sds genRedisInfoString(char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_fields:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_fields:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "fences:%ld\r\n"
+            "fence_pending_jobs:%llu\r\n"
+            "search_cursors:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
             "migrate_cached_sockets:%ld\r\n",
             server.stat_numconnections,
@@ -3131,12 +3175,16 @@ sds genRedisInfoString(char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expiredfields,
             server.stat_evictedkeys,
+            server.stat_evictedfields,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
             dictSize(server.fences),
+            fencepoolPendingJobs(),
+            spatialSearchCursorsLength(),
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets));
     }
@@ -3299,6 +3347,13 @@ sds genRedisInfoString(char *section) {
         server.cluster_enabled);
     }
 
+    /* Fences */
+    if (allsections || !strcasecmp(section,"fences")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Fences\r\n");
+        info = spatialGenFencesInfoString(info);
+    }
+
     /* Key space */
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3591,6 +3646,28 @@ int freeMemoryIfNeeded(void) {
                 }
             }
 
+            /* With maxmemory-spatial-fields a spatial key only loses its
+             * least recently written fields, as many as needed. */
+            if (bestkey && server.maxmemory_spatial_fields) {
+                robj *o = dictFetchValue(db->dict,bestkey);
+
+                if (o && o->type == OBJ_SPATIAL && spatialTypeLength(o)) {
+                    robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
+                    size_t freed;
+
+                    latencyStartMonitor(eviction_latency);
+                    spatialEvictFields(db,keyobj,o,mem_tofree-mem_freed,&freed);
+                    latencyEndMonitor(eviction_latency);
+                    latencyAddSampleIfNeeded("eviction-fields",eviction_latency);
+                    latencyRemoveNestedEvent(latency,eviction_latency);
+                    mem_freed += freed;
+                    decrRefCount(keyobj);
+                    keys_freed++;
+                    if (slaves) flushSlavesOutputBuffers();
+                    continue;
+                }
+            }
+
             /* Finally remove the selected key. */
             if (bestkey) {
                 robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
@@ -145,6 +145,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_MAXMEMORY_SPATIAL_FIELDS 0
+#define CONFIG_DEFAULT_FENCE_THREADS 0
+#define CONFIG_MAX_FENCE_THREADS 128
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -514,6 +517,8 @@ typedef struct redisDb {
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    dict *fences;               /* Keys watched by spatial fences */
+    dict *gexpires;             /* Spatial keys with volatile fields */
     struct evictionPoolEntry *eviction_pool;    /* Eviction pool of keys */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
@@ -615,7 +620,7 @@ typedef struct client {
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
     sds peerid;             /* Cached peer ID. */
-	sds spatial_fence;      /* spatial fence channel key */                                       
+    list *spatial_fences;   /* fences created with GSEARCH ... FENCE */
 
     /* Response buffer */
     int bufpos;
@@ -760,13 +765,16 @@ struct redisServer {
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
-                        *rpopCommand, *sremCommand, *execCommand;
+                        *rpopCommand, *sremCommand, *execCommand,
+                        *gdelCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expiredfields;   /* Number of expired spatial fields */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evictedfields;   /* Number of evicted spatial fields */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     size_t stat_peak_memory;        /* Max used memory record */
@@ -917,6 +925,7 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_spatial_fields;   /* Evict spatial fields, not keys */
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
@@ -991,7 +1000,9 @@ struct redisServer {
     /* System hardware info */
     size_t system_memory_size;  /* Total memory in system as reported by OS */
     /* Spatial */
-    dict *fences; /* A map of all of the fences */
+    dict *fences; /* Client fences, channel -> fence */
+    dict *named_fences; /* GFENCE name -> fence, persisted and replicated. */
+    int fence_threads; /* Number of background fence evaluation threads. */
 
 };
 
@@ -1092,6 +1103,7 @@ extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
+extern dictType fenceKeyDictType;
 
 
 /*-----------------------------------------------------------------------------
@@ -1424,6 +1436,59 @@ void freePubsubPattern(void *p);
 int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
 
+/* Spatial fences */
+typedef int (*spatialFenceProc)(void *privdata, int dbid, int argc, robj **argv);
+void spatialAttachFences(redisDb *db, robj *key, robj *o);
+void spatialUnsubscribeFence(client *c, robj *channel);
+sds spatialGenFencesInfoString(sds info);
+int spatialForEachNamedFence(spatialFenceProc proc, void *privdata);
+int spatialLoadNamedFence(sds repr);
+void spatialReleaseNamedFences(void);
+
+/* Spatial field expires */
+int spatialTypeExists(robj *o, sds field);
+unsigned long spatialTypeLength(robj *o);
+typedef int (*spatialFieldExpireProc)(void *privdata, sds field, long long when);
+void spatialTrackExpires(redisDb *db, robj *key, robj *o);
+int spatialExpireFieldsIfNeeded(redisDb *db, robj *key, robj *o);
+void spatialActiveExpireCycle(void);
+int spatialEvictFields(redisDb *db, robj *keyobj, robj *o, size_t tofree, size_t *freed);
+unsigned long spatialTypeVolatileLength(robj *o);
+long long spatialTypeGetExpire(robj *o, sds field);
+void spatialTypeSetExpire(robj *o, sds field, long long when);
+int spatialForEachFieldExpire(robj *o, spatialFieldExpireProc proc, void *privdata);
+
+/* Spatial field timestamps, see GSET IFNEWER */
+typedef int (*spatialFieldStampProc)(void *privdata, sds field, long long stamp);
+int spatialTypeGetStamp(robj *o, sds field, long long *stamp);
+void spatialTypeSetStamp(robj *o, sds field, long long stamp);
+unsigned long spatialTypeStampsLength(robj *o);
+int spatialForEachFieldStamp(robj *o, spatialFieldStampProc proc, void *privdata);
+
+/* Spatial field attributes */
+typedef int (*spatialFieldAttributesProc)(void *privdata, sds field, int argc, sds *argv);
+int spatialTypeHasAttributes(robj *o, sds field);
+unsigned long spatialTypeAttributesLength(robj *o);
+sds *spatialTypeGetAttributesArgv(robj *o, sds field, int *argc);
+int spatialTypeSetAttributesArgv(robj *o, sds field, int argc, sds *argv);
+int spatialForEachFieldAttributes(robj *o, spatialFieldAttributesProc proc, void *privdata);
+
+/* Spatial search cursors, see GSEARCH ... COUNT */
+void spatialSearchCursorsCron(void);
+void spatialReleaseAllSearchCursors(void);
+unsigned long spatialSearchCursorsLength(void);
+sds *spatialTypeGetIndexArgv(robj *o, int *argc);
+int spatialTypeSetIndexOptions(robj *o, int argc, sds *argv, const char **err);
+
+/* Spatial keys in index order, see RDB_TYPE_SPATIAL_RTREE */
+typedef struct spatialLoader spatialLoader;
+typedef int (*spatialFieldIndexProc)(void *privdata, sds field, unsigned char *value, size_t vlen, double *rect);
+int spatialForEachIndexedField(robj *o, spatialFieldIndexProc proc, void *privdata);
+spatialLoader *spatialLoaderNew(unsigned long len);
+int spatialLoaderAdd(spatialLoader *sl, sds field, sds value, double *rect);
+robj *spatialLoaderFinish(spatialLoader *sl);
+void spatialFlushPendingLoad(void);
+
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
 int keyspaceEventsStringToFlags(char *classes);
@@ -1485,6 +1550,7 @@ int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *num
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *gfenceGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
 /* Cluster */
 void clusterInit(void);
@@ -1699,8 +1765,15 @@ void gsetCommand(client *c);
 void gsetnxCommand(client *c);
 void ggetCommand(client *c);
 void gmsetCommand(client *c);
+void gmsetpointsCommand(client *c);
+void gloadfieldsCommand(client *c);
 void gmgetCommand(client *c);
 void gdelCommand(client *c);
+void gttlCommand(client *c);
+void gfieldsCommand(client *c);
+void gindexCommand(client *c);
+void ginfoCommand(client *c);
+void gpttlCommand(client *c);
 void glenCommand(client *c);
 void gstrlenCommand(client *c);
 void gkeysCommand(client *c);
@@ -1709,6 +1782,8 @@ void ggetallCommand(client *c);
 void gexistsCommand(client *c);
 void gscanCommand(client *c);
 void gsearchCommand(client *c);
+void gfenceCommand(client *c);
+void gfencesCommand(client *c);
 
 #if defined(__GNUC__)
 void *calloc(size_t count, size_t size) __attribute__ ((deprecated));
@@ -28,22 +28,31 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <ctype.h>
+#include <math.h>
 typedef struct siginfo_t siginfo_t;
 #include "server.h"
 #include "spatial.h"
 #include "rtree.h"
 #include "geoutil.h"
 #include "geom.h"
+#include "geohash.h"
 #include "hash.h"
 #include "bing.h"
+#include "fencepool.h"
+#include "grisu3.h"
 
 
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+#define HASH_SET_TAKE_FIELD (1<<0) /* see hashTypeSet() */
+#define HASH_SET_TAKE_VALUE (1<<1)
 sds hashTypeGetFromHashTable(robj *o, sds field);
 size_t hashTypeGetValueLength(robj *o, sds field);
 int pubsubSubscribeChannel(client *c, robj *channel);
-int pubsubUnsubscribePattern(client *c, robj *pattern, int notify);
+int pubsubUnsubscribeChannel(client *c, robj *channel, int notify);
+struct client *createFakeClient(void);
+void freeFakeClientArgv(struct client *c);
+void freeFakeClient(struct client *c);
 
 
 #define FENCE_ENTER    (1<<1)
@@ -66,6 +75,7 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify);
 #define RADIUS     1
 #define GEOMETRY   2
 #define BOUNDS     3
+#define NEARBY     4
 
 #define OUTPUT_COUNT    1
 #define OUTPUT_FIELD    2
@@ -77,7 +87,100 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify);
 #define OUTPUT_HASH     8
 #define OUTPUT_QUAD     9
 #define OUTPUT_TILE    10
+#define OUTPUT_GRID    11
+#define OUTPUT_HASHCOUNT 12
+
+
+#define SEARCH_CURSOR_COUNT_DEFAULT 10
+#define SEARCH_CURSOR_COUNT_MAX     1000000
+#define SEARCH_CURSOR_TIMEOUT       300000  // ms a cursor may be left idle.
+
+#define PATTERN_ALL      0
+#define PATTERN_EXACT    1
+#define PATTERN_PREFIX   2
+#define PATTERN_SUFFIX   3
+#define PATTERN_CONTAINS 4
+#define PATTERN_GLOB     5
+
+/* A MATCH pattern compiled once per search or fence. Most patterns are a
+ * literal with a leading and/or trailing '*', which are matched with a 
+ * plain memcmp(). Anything else goes to stringmatchlen(). */
+typedef struct fieldPattern {
+    int kind;
+    const char *pattern;    // the whole glob, not owned.
+    size_t plen;
+    const char *lit;        // the literal part, points into 'pattern'.
+    size_t llen;
+} fieldPattern;
+
+static int isGlobLiteral(const char *p, size_t len){
+    for (size_t i=0;i<len;i++){
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\'){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void compileFieldPattern(fieldPattern *m, const char *pattern, size_t plen){
+    size_t stars = 0;
+    while (stars < plen && pattern[stars] == '*'){
+        stars++;
+    }
+    m->pattern = pattern;
+    m->plen = plen;
+    m->lit = pattern;
+    m->llen = plen;
+    if (plen > 0 && stars == plen){
+        m->kind = PATTERN_ALL;
+    } else if (isGlobLiteral(pattern, plen)){
+        m->kind = PATTERN_EXACT;
+    } else if (pattern[plen-1] == '*' && isGlobLiteral(pattern, plen-1)){
+        m->kind = PATTERN_PREFIX;
+        m->llen = plen-1;
+    } else if (pattern[0] == '*' && isGlobLiteral(pattern+1, plen-1)){
+        m->kind = PATTERN_SUFFIX;
+        m->lit = pattern+1;
+        m->llen = plen-1;
+    } else if (plen > 2 && pattern[0] == '*' && pattern[plen-1] == '*' && 
+        isGlobLiteral(pattern+1, plen-2))
+    {
+        m->kind = PATTERN_CONTAINS;
+        m->lit = pattern+1;
+        m->llen = plen-2;
+    } else {
+        m->kind = PATTERN_GLOB;
+    }
+}
 
+static int matchFieldPattern(fieldPattern *m, const char *str, size_t len){
+    switch (m->kind){
+    case PATTERN_ALL:
+        return 1;
+    case PATTERN_EXACT:
+        return len == m->llen && !memcmp(str, m->lit, len);
+    case PATTERN_PREFIX:
+        return len >= m->llen && !memcmp(str, m->lit, m->llen);
+    case PATTERN_SUFFIX:
+        return len >= m->llen && !memcmp(str+len-m->llen, m->lit, m->llen);
+    case PATTERN_CONTAINS:{
+        const char *p = str, *end = str+len;
+        while ((size_t)(end-p) >= m->llen){
+            p = memchr(p, m->lit[0], end-p-m->llen+1);
+            if (!p){
+                return 0;
+            }
+            if (!memcmp(p, m->lit, m->llen)){
+                return 1;
+            }
+            p++;
+        }
+        return 0;
+    }
+    default:
+        return stringmatchlen(m->pattern, m->plen, str, len, 0);
+    }
+}
 
 typedef struct resultItem {
     char *field;
@@ -87,6 +190,11 @@ typedef struct resultItem {
 
 } resultItem;
 
+typedef struct whereClause {
+    sds name;       // attribute name, borrowed from the client argv.
+    double min, max;
+} whereClause;
+
 typedef struct searchContext {
     spatial *s;
     client *c;
@@ -97,13 +205,22 @@ typedef struct searchContext {
     int cap;
     resultItem *results;
     long long cursor;
+    long count;     // page size of a cursor search, zero without COUNT.
     sds pattern;
     int allfields;
+    fieldPattern matcher; // compiled 'pattern'.
     int output;
     int precision;
     int nofields;
     int fence;
+    int payload;
+    int batch;
     int releaseg;
+    int memberpos;  // argument index of MEMBER, or zero.
+    dict *cells;    // cell -> count, for the GRID and HASHCOUNT outputs.
+    whereClause *where;
+    int nwhere;
+    list *intfields; // fields read from ziplists as integers, see resultField.
 
     // bounds
     geomRect bounds;
@@ -112,6 +229,9 @@ typedef struct searchContext {
     geomCoord center;
     double meters;
 
+    // nearby
+    sds anchor;
+
     // geometry
     geom g;
     int sz;
@@ -121,9 +241,16 @@ typedef struct searchContext {
 
 
 typedef struct fence {
+    int refcount;   // the fences dict and each inflight fence job own a ref.
     robj *channel;
+    int dbid;       // the fence watches the key 'key' in db 'dbid'.
+    sds key;
+    listNode *regnode; // node in the fence registry of the key.
+    sds anchor;     // NEARBY fences move with this field of the key.
+    int anchored;   // the anchor exists and 'center' is its position.
     int allfields;
     sds pattern;
+    fieldPattern matcher; // compiled 'pattern', set at subscribe time.
     int targetType;
     geomCoord center;
     double meters;
@@ -131,19 +258,63 @@ typedef struct fence {
     geom g;
     int sz;
     geomPolyMap *m;
+
+    // notification options
+    int payload;    // messages carry the object, distance and time.
+    int output;     // output format of the object in payloads.
+    int precision;
+    int batch;      // messages are batched per event loop iteration.
+    sds batched;    // pending batch, or NULL.
+
+    // named fences keep the arguments they were created with, starting at
+    // the name, in order to be persisted and propagated.
+    int argc;
+    robj **argv;
 } fence;
 
+// fences with a pending batch, flushed from beforeSleep().
+static list *fenceBatches = NULL;
+
 void freeFence(fence *f){
     if (!f){
         return;
     }
     decrRefCount(f->channel);
+    sdsfree(f->key);
+    if (f->anchor) sdsfree(f->anchor);
+    for (int i=0;i<f->argc;i++){
+        decrRefCount(f->argv[i]);
+    }
+    zfree(f->argv);
     if (f->pattern) sdsfree(f->pattern);
     if (f->m) geomFreePolyMap(f->m);
-    if (f->g) geomFree(f->g);
+    if (f->g) zfree(f->g); // copied with zmalloc, not a geomDecode result.
+    if (f->batched) sdsfree(f->batched);
     zfree(f);
 }
 
+void retainFence(fence *f){
+    f->refcount++;
+}
+
+// releaseFence drops a reference and frees the fence when it was the last.
+void releaseFence(fence *f){
+    if (f && --f->refcount <= 0){
+        freeFence(f);
+    }
+}
+
+
+/* sdscpyhashvalue copies a value read from a hash into 's'. Ziplists store
+ * the strings that look like integers as integers, such as the field names
+ * of idxhash, so 'vstr' is NULL and the value is in 'vll'. */
+static sds sdscpyhashvalue(sds s, unsigned char *vstr, unsigned int vlen, long long vll){
+    if (vstr){
+        return sdscpylen(s, (char*)vstr, vlen);
+    }
+    sdsclear(s);
+    return sdscatfmt(s, "%I", vll);
+}
 
 // get an sds based on the key. 
 // return value must be freed by the caller.
@@ -152,17 +323,51 @@ static sds hashTypeGetNewSds(robj *o, sds key){
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
     if (hashTypeGetValue(o, key, &vstr, &vlen, &vll) == C_ERR) return NULL;
-    if (!vstr) return NULL;
-    return sdsnewlen(vstr, vlen);
+    return sdscpyhashvalue(sdsempty(), vstr, vlen, vll);
 }
 
-// returns a raw pointer to the value
-static void *hashTypeGetRaw(robj *o, sds key){
-    unsigned char *vstr = NULL;
-    unsigned int vlen = UINT_MAX;
-    long long vll = LLONG_MAX;
-    if (hashTypeGetValue(o, key, &vstr, &vlen, &vll) == C_ERR) return NULL;
-    return vstr;
+/* valueGeom returns the geometry of a stored value. Packed values are
+ * unpacked into 'scratch', which holds the result until the next call with
+ * the same buffer. Returns NULL if a packed value is corrupt. */
+static geom valueGeom(const void *vstr, size_t vlen, sds *scratch, int *sz){
+    int n;
+    if (!geomIsPacked(vstr, vlen)){
+        if (sz) *sz = vlen;
+        return (geom)vstr;
+    }
+    if (!*scratch){
+        *scratch = sdsempty();
+    }
+    n = geomUnpack(vstr, vlen, *scratch, sdsalloc(*scratch));
+    if (n == -1){
+        return NULL;
+    }
+    if (n > (int)sdsalloc(*scratch)){
+        sdsclear(*scratch);
+        *scratch = sdsMakeRoomFor(*scratch, n);
+        geomUnpack(vstr, vlen, *scratch, n);
+    }
+    sdssetlen(*scratch, n);
+    (*scratch)[n] = '\0';
+    if (sz) *sz = n;
+    return (geom)*scratch;
+}
+
+/* packValue returns the packed form of a WKB value, or NULL if it must be
+ * stored as is: the key stores WKB, the geometry can't be packed, or it's
+ * not smaller once packed. */
+static sds packValue(int precision, geom g, int sz){
+    void *packed;
+    int psz;
+    sds value;
+    if (precision == -1 || 
+        geomPack(g, sz, precision, &packed, &psz) != GEOM_ERR_NONE)
+    {
+        return NULL;
+    }
+    value = psz < sz ? sdsnewlen(packed, psz) : NULL;
+    geomFree(packed);
+    return value;
 }
 
 static void hashTypeIteratorValue(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
@@ -178,10 +383,11 @@ static void hashTypeIteratorValue(hashTypeIterator *hi, int what, unsigned char
 }
 
 int spatialTypeSet(robj *o, sds field, sds val, int notify);
-int spatialTypeDelete(robj *o, sds field, geomRect *rin, int notify);
+int spatialTypeDelete(robj *o, sds field, int notify);
 unsigned long spatialTypeLength(robj *o);
 size_t spatialTypeGetValueLength(robj *o, sds field);
 int spatialTypeExists(robj *o, sds field);
+static void releaseSpatialCursors(spatial *s);
 
 struct spatial {
     robj *h;        // main hash store that persists to RDB.
@@ -204,8 +410,289 @@ struct spatial {
     char *idx;     // pointer that acts as a private id for entries.
     robj *keyhash; // stores key -> idx
     robj *idxhash; // stores idx -> key
+
+    // Fields with an expire. Both are created with the first expire.
+    dict *expires;    // field -> expire time in unix ms.
+    zskiplist *ezsl;  // fields ordered by expire time.
+
+    // Numeric attributes, created with the first field that has some.
+    dict *attrs;      // field -> packed attributes, see attrsSet().
+
+    zskiplist *fzsl;  // field names in lexicographic order, see GINDEX.
+
+    dict *stamps;     // field -> timestamp of GSET IFNEWER.
+
+    // Values are packed with this number of decimals when the key is set to
+    // GINDEX ENCODING PACKED, see geom_packed.c. It's -1 for plain WKB.
+    int precision;
+    sds scratch;      // unpacked value, see valueGeom().
+
+    // Points go to a fixed level geohash grid instead of the R-tree when
+    // the key is set to GINDEX TYPE GRID. Anything else stays in the tree.
+    dict *grid;          // geohash cell -> gridCell.
+    int gridstep;        // geohash step of the cells.
+    unsigned long gridlen;
+    geomRect gridbounds; // grows with the points, never shrinks.
+
+    // Search cursors see the index as it was when they were opened, see
+    // GSEARCH ... COUNT. While there's one, a written field always gets a
+    // new idx and the removed fields are kept, so that every idx in the
+    // snapshot still resolves to the object it had then.
+    int ncursors;
+    dict *retired;       // idx -> retiredField.
+
+    // Last write of each field, for maxmemory-spatial-fields. The names are
+    // shared by both, like in a sorted set. Created by the first write with
+    // the option on, or by the first eviction.
+    dict *wtimes;        // field -> last write in unix ms.
+    zskiplist *wzsl;     // fields ordered by last write.
+};
+
+/* The grid is made of cells holding an array of points, so that moving a 
+ * point is a hash lookup and a swap instead of an R-tree update. The cells
+ * are keyed by their geohash bits, stored in the key pointer itself. */
+typedef struct gridEntry {
+    double x, y;
+    void *item;
+} gridEntry;
+
+typedef struct gridCell {
+    int len, cap;
+    gridEntry entries[];
+} gridCell;
+
+/* A field removed while the key has search cursors. The retired fields are
+ * keyed by idx, like the grid cells. */
+typedef struct retiredField {
+    sds field;
+    sds value;
+    sds attrs;  // NULL without attributes.
+} retiredField;
+
+static void retiredFieldDestructor(void *privdata, void *val){
+    DICT_NOTUSED(privdata);
+    retiredField *rf = val;
+    sdsfree(rf->field);
+    sdsfree(rf->value);
+    sdsfree(rf->attrs);
+    zfree(rf);
+}
+
+#define GRID_STEP_DEFAULT 12
+#define PACKED_PRECISION_DEFAULT 7
+
+static unsigned int gridHashKey(const void *key){
+    uint64_t bits = (uint64_t)key;
+    return dictGenHashFunction(&bits, sizeof(bits));
+}
+
+static void gridCellDestructor(void *privdata, void *val){
+    DICT_NOTUSED(privdata);
+    zfree(val);
+}
+
+static dictType gridDictType = {
+    gridHashKey,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    gridCellDestructor          /* val destructor */
 };
 
+static dictType retiredDictType = {
+    gridHashKey,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    retiredFieldDestructor      /* val destructor */
+};
+
+static double gridCellWidth(int step){
+    return (GEO_LONG_MAX-GEO_LONG_MIN)/(double)(1<<step);
+}
+
+static double gridCellHeight(int step){
+    return (GEO_LAT_MAX-GEO_LAT_MIN)/(double)(1<<step);
+}
+
+/* gridInsert adds a point to the grid. Returns 0 when the point is outside
+ * of the area covered by geohashes, it must go in the R-tree then. */
+static int gridInsert(spatial *s, double x, double y, void *item){
+    GeoHashBits hash;
+    dictEntry *de;
+    gridCell *cell;
+    if (!geohashEncodeType(x, y, s->gridstep, &hash)){
+        return 0;
+    }
+    de = dictFind(s->grid, (void*)hash.bits);
+    if (!de){
+        cell = zmalloc(sizeof(gridCell)+sizeof(gridEntry));
+        cell->len = 0;
+        cell->cap = 1;
+        dictAdd(s->grid, (void*)hash.bits, cell);
+    } else {
+        cell = dictGetVal(de);
+        if (cell->len == cell->cap){
+            cell->cap *= 2;
+            cell = zrealloc(cell, sizeof(gridCell)+sizeof(gridEntry)*cell->cap);
+            dictSetVal(s->grid, de, cell);
+        }
+    }
+    cell->entries[cell->len].x = x;
+    cell->entries[cell->len].y = y;
+    cell->entries[cell->len].item = item;
+    cell->len++;
+    if (s->gridlen++ == 0){
+        s->gridbounds.min.x = s->gridbounds.max.x = x;
+        s->gridbounds.min.y = s->gridbounds.max.y = y;
+    } else {
+        s->gridbounds.min.x = fmin(s->gridbounds.min.x, x);
+        s->gridbounds.min.y = fmin(s->gridbounds.min.y, y);
+        s->gridbounds.max.x = fmax(s->gridbounds.max.x, x);
+        s->gridbounds.max.y = fmax(s->gridbounds.max.y, y);
+    }
+    return 1;
+}
+
+/* gridRemove removes a point from the grid. Returns 0 if it's not there. */
+static int gridRemove(spatial *s, double x, double y, void *item){
+    GeoHashBits hash;
+    dictEntry *de;
+    gridCell *cell;
+    if (!geohashEncodeType(x, y, s->gridstep, &hash) ||
+        (de = dictFind(s->grid, (void*)hash.bits)) == NULL)
+    {
+        return 0;
+    }
+    cell = dictGetVal(de);
+    for (int i=0;i<cell->len;i++){
+        if (cell->entries[i].item == item){
+            cell->entries[i] = cell->entries[--cell->len];
+            if (cell->len == 0){
+                dictDelete(s->grid, (void*)hash.bits);
+            }
+            s->gridlen--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int gridSearchCell(gridCell *cell, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata){
+    for (int i=0;i<cell->len;i++){
+        gridEntry *e = &cell->entries[i];
+        if (e->x >= minX && e->x <= maxX && e->y >= minY && e->y <= maxY &&
+            !iterator(e->x, e->y, e->x, e->y, e->item, userdata))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* gridSearch calls 'iterator' for every point in the rect, like 
+ * rtreeSearch(). The cells covering the rect are looked up one by one, 
+ * unless there are more of them than cells in the grid. Returns 0 if the
+ * iterator asked to stop. */
+static int gridSearch(spatial *s, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata){
+    double w = gridCellWidth(s->gridstep), h = gridCellHeight(s->gridstep);
+    long long last = (1<<s->gridstep)-1;
+    if (s->gridlen == 0){
+        return 1;
+    }
+    // one more cell on each side, the edges may round either way.
+    long long x0 = floor((fmax(minX, GEO_LONG_MIN)-GEO_LONG_MIN)/w)-1;
+    long long x1 = floor((fmin(maxX, GEO_LONG_MAX)-GEO_LONG_MIN)/w)+1;
+    long long y0 = floor((fmax(minY, GEO_LAT_MIN)-GEO_LAT_MIN)/h)-1;
+    long long y1 = floor((fmin(maxY, GEO_LAT_MAX)-GEO_LAT_MIN)/h)+1;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > last) x1 = last;
+    if (y1 > last) y1 = last;
+    if (x1 < x0 || y1 < y0){
+        return 1;
+    }
+    if ((double)(x1-x0+1)*(double)(y1-y0+1) > dictSize(s->grid)){
+        dictIterator *di = dictGetIterator(s->grid);
+        dictEntry *de;
+        int res = 1;
+        while (res && (de = dictNext(di)) != NULL){
+            res = gridSearchCell(dictGetVal(de), minX, minY, maxX, maxY, iterator, userdata);
+        }
+        dictReleaseIterator(di);
+        return res;
+    }
+    for (long long y=y0;y<=y1;y++){
+        for (long long x=x0;x<=x1;x++){
+            GeoHashBits hash;
+            dictEntry *de;
+            if (!geohashEncodeType(GEO_LONG_MIN+(x+0.5)*w, GEO_LAT_MIN+(y+0.5)*h, s->gridstep, &hash) ||
+                (de = dictFind(s->grid, (void*)hash.bits)) == NULL)
+            {
+                continue;
+            }
+            if (!gridSearchCell(dictGetVal(de), minX, minY, maxX, maxY, iterator, userdata)){
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* The index functions dispatch an entry to the grid or the R-tree. */
+static void indexInsert(spatial *s, geomRect r, void *item){
+    if (s->grid && r.min.x == r.max.x && r.min.y == r.max.y &&
+        gridInsert(s, r.min.x, r.min.y, item))
+    {
+        return;
+    }
+    rtreeInsert(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, item);
+}
+
+static void indexRemove(spatial *s, geomRect r, void *item){
+    if (s->grid && r.min.x == r.max.x && r.min.y == r.max.y &&
+        gridRemove(s, r.min.x, r.min.y, item))
+    {
+        return;
+    }
+    rtreeRemove(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, item);
+}
+
+/* indexSearch searches the grid and the R-tree. The node iterator, when
+ * not NULL, only applies to the R-tree, see rtreeSearchNodes(). */
+static void indexSearch(spatial *s, geomRect r, rtreeNodeFunc nodeIterator, rtreeSearchFunc iterator, void *userdata){
+    if (s->grid && !gridSearch(s, r.min.x, r.min.y, r.max.x, r.max.y, iterator, userdata)){
+        return;
+    }
+    if (nodeIterator){
+        rtreeSearchNodes(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, nodeIterator, iterator, userdata);
+    } else {
+        rtreeSearch(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, iterator, userdata);
+    }
+}
+
+static unsigned long indexCount(spatial *s){
+    return rtreeCount(s->tr)+(s->grid ? s->gridlen : 0);
+}
+
+static int indexBounds(spatial *s, geomRect *r){
+    int ok = rtreeBounds(s->tr, &r->min.x, &r->min.y, &r->max.x, &r->max.y);
+    if (!s->grid || s->gridlen == 0){
+        return ok;
+    }
+    if (!ok){
+        *r = s->gridbounds;
+        return 1;
+    }
+    r->min.x = fmin(r->min.x, s->gridbounds.min.x);
+    r->min.y = fmin(r->min.y, s->gridbounds.min.y);
+    r->max.x = fmax(r->max.x, s->gridbounds.max.x);
+    r->max.y = fmax(r->max.y, s->gridbounds.max.y);
+    return 1;
+}
+
 static robj *spatialGetHash(robj *o){
     return ((spatial*)o->ptr)->h;
 }
@@ -222,6 +709,7 @@ spatial *spatialNew(){
     s->h = createHashObject();
     s->keyhash = createHashObject();
     s->idxhash = createHashObject();
+    s->precision = -1;
     s->tr = rtreeNew();
     if (!s->tr){
         goto err;
@@ -234,44 +722,42 @@ err:
 
 
 /* robjSpatialNewHash creates a new spatial object with an existing hash.
- * This is is called from rdbLoad(). */
+ * This is is called from rdbLoad() for the encodings that are loaded as a
+ * hash first. The strings of a hash table move to the new key, only the 
+ * fields of a ziplist are copied. */
 void *robjSpatialNewHash(void *o) {
-    robj *so;
-    hashTypeIterator *hi;
-    so = createSpatialObject();
-
-    // iterator through the rdb hash and insert items into 
-    // spatial one by one. This is important because rdb values may
-    // come from systems that have a different endianess. we also
-    // want the opportunity to check for wkb corruption.
-    hi = hashTypeInitIterator(o);
-    while (hashTypeNext(hi) != C_ERR) {
-        unsigned char *vstr = NULL;
-        unsigned int vlen = UINT_MAX;
-        long long vll = LLONG_MAX;
-        sds field;
-        sds value;
-        hashTypeIteratorValue(hi, OBJ_HASH_KEY, &vstr, &vlen, &vll);
-        if (!vstr){
-            continue;
+    robj *h = o;
+    spatialLoader *sl = spatialLoaderNew(hashTypeLength(h));
+    if (h->encoding == OBJ_ENCODING_HT){
+        dictIterator *di = dictGetIterator(h->ptr);
+        dictEntry *de;
+        while ((de = dictNext(di)) != NULL){
+            sds field = dictGetKey(de);
+            sds value = dictGetVal(de);
+            // leave nothing for freeHashObject() to free.
+            de->key = NULL;
+            de->v.val = NULL;
+            spatialLoaderAdd(sl, field, value, NULL);
         }
-        field = sdsnewlen(vstr, vlen);
-        hashTypeIteratorValue(hi, OBJ_HASH_VALUE, &vstr, &vlen, &vll);
-        if (!vstr){
-            sdsfree(field);
-            continue;
+        dictReleaseIterator(di);
+    } else {
+        hashTypeIterator *hi = hashTypeInitIterator(h);
+        while (hashTypeNext(hi) != C_ERR) {
+            sds field = hashTypeCurrentObjectNewSds(hi, OBJ_HASH_KEY);
+            sds value = hashTypeCurrentObjectNewSds(hi, OBJ_HASH_VALUE);
+            spatialLoaderAdd(sl, field, value, NULL);
         }
-        value = sdsnewlen(vstr, vlen);
-        spatialTypeSet(so, field, value, 0);
-        sdsfree(value);
-        sdsfree(field);
+        hashTypeReleaseIterator(hi);
     }
-    freeHashObject(o); // free the old hash
-    return so;
+    freeHashObject(h); // free the old hash
+    return spatialLoaderFinish(sl);
 }
 
 void spatialFree(spatial *s){
     if (s){
+        if (s->ncursors){
+            releaseSpatialCursors(s);
+        }
         if (s->h){
             freeHashObject(s->h);
         }
@@ -284,10 +770,31 @@ void spatialFree(spatial *s){
         if (s->tr){
             rtreeFree(s->tr);   
         }
+        if (s->grid){
+            dictRelease(s->grid);
+        }
         if (s->fences){
             // do not free the fence object, only the array.
             zfree(s->fences);
         }
+        if (s->expires){
+            dictRelease(s->expires);
+            zslFree(s->ezsl);
+        }
+        if (s->attrs){
+            dictRelease(s->attrs);
+        }
+        if (s->fzsl){
+            zslFree(s->fzsl);
+        }
+        if (s->stamps){
+            dictRelease(s->stamps);
+        }
+        if (s->wtimes){
+            dictRelease(s->wtimes);
+            zslFree(s->wzsl);
+        }
+        sdsfree(s->scratch);
         zfree(s);
     }
 }
@@ -304,16 +811,22 @@ void pushFence(spatial *s, fence *f){
     s->flen++;
 }
 
-int matchSearch(
+// The single threaded variant of the poly map uses a shared static map for
+// simple geometries, thus only the main thread may pass singleThreaded.
+static int matchSearchBase(
     geom g, geomPolyMap *targetMap,
     int targetType, int searchType, 
-    geomCoord center, double meters
+    geomCoord center, double meters,
+    int singleThreaded
 ){
     int match = 0;
-    if (geomIsSimplePoint(g) && targetType == RADIUS){
+    if (targetType == NEARBY){
+        match = geomCoordWithinRadius(geomCenter(g), center, meters);
+    } else if (geomIsSimplePoint(g) && targetType == RADIUS){
         match = geomCoordWithinRadius(geomCenter(g), center, meters);
     } else {
-        geomPolyMap *m = geomNewPolyMapSingleThreaded(g);
+        geomPolyMap *m = singleThreaded ? 
+            geomNewPolyMapSingleThreaded(g) : geomNewPolyMap(g);
         if (!m){
             return 0;
         }
@@ -327,235 +840,1769 @@ int matchSearch(
     return match;
 }
 
+int matchSearch(
+    geom g, geomPolyMap *targetMap,
+    int targetType, int searchType, 
+    geomCoord center, double meters
+){
+    return matchSearchBase(g, targetMap, targetType, searchType, 
+        center, meters, 1);
+}
+
 
-static robj *extractFenceKey(client *c){
-    if (!c->spatial_fence){
+// returns the spatial object watched by the fence, or NULL.
+static spatial *fenceTarget(fence *f){
+    dictEntry *de = dictFind(server.db[f->dbid].dict, f->key);
+    if (!de){
         return NULL;
     }
-    if (!strncmp(c->spatial_fence, "fence$", 6)){
-        char *p = c->spatial_fence+6;
-        while (*p){
-            if (*p=='$'){
-                return createStringObject(p+1, sdslen(c->spatial_fence)-(p-c->spatial_fence)-1);
-            }
-            p++;
-        }
+    robj *o = dictGetVal(de);
+    if (o->type != OBJ_SPATIAL){
+        return NULL;
     }
-    return NULL;
+    return o->ptr;
 }
 
-static int fenceChannelMatchesKey(sds channel, sds key){
-    if (!strncmp(channel, "fence$", 6)){
-        char *p = channel+6;
-        while (*p){
-            if (*p=='$'){
-                p++;
-                int i = p-channel;
-                if (sdslen(channel)-i == sdslen(key)){
-                    int l = sdslen(key);
-                    for (int j=0;j<l;j++,i++){
-                        if (channel[i]!=key[j]){
-                            return 0;
-                        }
-                    }
-                    return 1;
-                }
-                break;
-            }
-            p++;
-        }
+// anchorFence places a NEARBY fence at the current position of its anchor.
+static void anchorFence(spatial *s, fence *f){
+    unsigned char *vstr = NULL;
+    unsigned int vlen = UINT_MAX;
+    long long vll = LLONG_MAX;
+    if (!f->anchor){
+        return;
+    }
+    f->anchored = hashTypeGetValue(s->h, f->anchor, &vstr, &vlen, &vll) == C_OK && vstr;
+    if (f->anchored){
+        geom g = valueGeom(vstr, vlen, &s->scratch, NULL);
+        f->anchored = g != NULL;
+        if (g) f->center = geomCenter(g);
     }
-    return 0;
 }
 
-void attachFences(spatial *s, sds key){
-    dictIterator *di = dictGetIterator(server.fences);
-    dictEntry *de;
-
-    while((de = dictNext(di)) != NULL) {
-        sds channel = dictGetKey(de);
-        if (fenceChannelMatchesKey(channel, key)){
-            robj *sidx = dictGetVal(de);
-            uint64_t nidx = *((uint64_t*)(sidx->ptr));
-            fence *f = (fence*)nidx;
-            pushFence(s, f);
-        }
+static void attachFence(fence *f){
+    spatial *s = fenceTarget(f);
+    if (s){
+        pushFence(s, f);
+        anchorFence(s, f);
     }
 }
 
-/* spatialReleaseAllFences is called from networking.c when the client disconnects */
-void spatialReleaseAllFences(client *c){
-    if (!c->spatial_fence){
+static void detachFence(fence *f){
+    spatial *s = fenceTarget(f);
+    if (!s){
         return;
     }
+    for (int i=0;i<s->flen;i++){
+        if (s->fences[i] == f){
+            s->fences[i] = s->fences[s->flen-1];
+            s->flen--;
+            break;
+        }
+    }
+}
 
-    fence *f = NULL;
-
-    // remove it from the server dict
-    dictEntry *de = dictFind(server.fences,c->spatial_fence);
+/* The fence registry maps each key of a db to the list of the client and
+ * named fences watching it, so that a spatial object stored at a key picks
+ * up its fences without looking at the fences of other keys. The list is 
+ * dropped along with the last fence of the key. */
+static void registerFence(fence *f){
+    dict *d = server.db[f->dbid].fences;
+    dictEntry *de = dictFind(d, f->key);
+    list *l;
     if (de){
-        robj *sidx = dictGetVal(de);
-        uint64_t nidx = *((uint64_t*)(sidx->ptr));
-        f = (fence*)nidx;
-        dictDeleteNoFree(server.fences,c->spatial_fence);
-        decrRefCount(sidx);
-    }
-
-    // remove it from the spatial index
-    robj *key = extractFenceKey(c);
-    if (key){
-        robj *o = lookupKeyRead(c->db, key);
-        if (o != NULL && o->type == OBJ_SPATIAL) {
-            spatial *s = o->ptr;
-            for (int i=0;i<s->flen;i++){
-                fence *nf = s->fences[i];
-                if (!sdscmp(nf->channel->ptr, c->spatial_fence)){
-                    s->fences[i] = s->fences[s->flen-1];
-                    s->flen--;
-                    break;
-                }
-            }
-        }
-        decrRefCount(key);
+        l = dictGetVal(de);
+    } else {
+        l = listCreate();
+        dictAdd(d, sdsdup(f->key), l);
     }
+    listAddNodeTail(l, f);
+    f->regnode = listLast(l);
+    attachFence(f);
+}
 
-    // free the fence
-    if (f){
-        freeFence(f);
+static void unregisterFence(fence *f){
+    dict *d = server.db[f->dbid].fences;
+    dictEntry *de = dictFind(d, f->key);
+    detachFence(f);
+    if (de){
+        list *l = dictGetVal(de);
+        listDelNode(l, f->regnode);
+        if (listLength(l) == 0){
+            dictDelete(d, f->key);
+        }
     }
+    f->regnode = NULL;
+}
 
-    // finally unsubscribe from the channel
-    robj *pchan = createStringObject(c->spatial_fence, sdslen(c->spatial_fence));
-    pubsubUnsubscribePattern(c,pchan,0);
-    decrRefCount(pchan);
-    sdsfree(c->spatial_fence);
-    c->spatial_fence = NULL;
+/* spatialAttachFences is called from dbAdd() when a spatial object is
+ * stored at a key. The key may be new, loaded from disk, restored or 
+ * renamed, so the object forgets about the fences of its old key before
+ * picking up the client and named fences watching the new one. */
+void spatialAttachFences(redisDb *db, robj *key, robj *o){
+    spatial *s = o->ptr;
+    dictEntry *de;
+    listIter li;
+    listNode *ln;
 
+    s->flen = 0;
+    de = dictFind(db->fences, key->ptr);
+    if (!de){
+        return;
+    }
+    listRewind(dictGetVal(de), &li);
+    while((ln = listNext(&li)) != NULL){
+        pushFence(s, ln->value);
+        anchorFence(s, ln->value);
+    }
 }
 
+// releaseClientFence unregisters a GSEARCH FENCE and drops the reference
+// held by the client. 'ln' is the node of the fence in the client list.
+static void releaseClientFence(client *c, listNode *ln){
+    fence *f = ln->value;
+    dictDelete(server.fences,f->channel->ptr);
+    listDelNode(c->spatial_fences, ln);
+    unregisterFence(f);
 
-static robj *newinoutmsg(char *prefix, sds field){
-    int l = strlen(prefix);
-    char *str = zmalloc(l+sdslen(field));
-    memcpy(str, prefix, l);
-    memcpy(str+l, field, sdslen(field));
-    return createStringObject(str, sdslen(field)+l);
+    // inflight fence jobs may still hold a reference.
+    releaseFence(f);
 }
 
-void processFences(spatial *s, sds field, geom g, int fenceNotify){
-    robj *imsg = NULL;
-    robj *omsg = NULL;
-    if (fenceNotify == FENCE_NOTIFY_DEL){
-        for (int i=0;i<s->flen;i++){
-            fence *f = s->fences[i];
-            if (f->allfields || 
-                stringmatchlen(f->pattern,sdslen(f->pattern),(const char*)field,sdslen(field),0)
-            ) {
-                if (!imsg) imsg = newinoutmsg("outside:", field);
-                pubsubPublishMessage(f->channel, imsg);
-            }
-        }
-    } else {
-        for (int i=0;i<s->flen;i++){
-            fence *f = s->fences[i];
-            if (f->allfields || 
-                stringmatchlen(f->pattern,sdslen(f->pattern),(const char*)field,sdslen(field),0)
-            ) {
-                if (matchSearch(g, f->m, f->targetType, f->searchType, f->center, f->meters)){
-                    if (!imsg) imsg = newinoutmsg("inside:", field);
-                    pubsubPublishMessage(f->channel, imsg);
-                } else {
-                    if (!omsg) omsg = newinoutmsg("outside:", field);
-                    pubsubPublishMessage(f->channel, omsg);
-                }
-            }
+/* spatialUnsubscribeFence is called from pubsub.c when a client 
+ * unsubscribes from a channel. When the channel belongs to one of the
+ * fences of the client, that fence is released. */
+void spatialUnsubscribeFence(client *c, robj *channel){
+    listIter li;
+    listNode *ln;
+    if (!c->spatial_fences){
+        return;
+    }
+    listRewind(c->spatial_fences,&li);
+    while((ln = listNext(&li)) != NULL){
+        fence *f = ln->value;
+        if (equalStringObjects(f->channel, channel)){
+            releaseClientFence(c, ln);
+            return;
         }
-    }    
-    if (imsg) decrRefCount(imsg);
-    if (omsg) decrRefCount(omsg);
+    }
 }
 
-// notify is used to broadcast fence notifications
-int spatialTypeDelete(robj *o, sds field, geomRect *rin, int notify) {
-    geomRect r;
-    sds sidx;
-    char *idx;
-    spatial *s;
-    int res;
-
-    s = (spatial*)(o->ptr);
-
-    // get the idx
-    sidx = hashTypeGetNewSds(s->keyhash, field);
-    if (!sidx || sdslen(sidx) != 8) return 0;
-    idx = (char*)(*((uint64_t*)sidx));
-    sdsfree(sidx);
+/* spatialReleaseAllFences is called from networking.c when the client 
+ * disconnects, right before it's unsubscribed from all channels. */
+void spatialReleaseAllFences(client *c){
+    listNode *ln;
+    if (!c->spatial_fences){
+        return;
+    }
+    while ((ln = listFirst(c->spatial_fences)) != NULL){
+        releaseClientFence(c, ln);
+    }
+    listRelease(c->spatial_fences);
+    c->spatial_fences = NULL;
+}
 
 
-    geom g = NULL;
-    if (rin) {
-        r = *rin;
-    } else {
-        void *raw = hashTypeGetRaw(s->h, field);
-        if (!raw) return 0;
-        g = (geom)raw;
-        r = geomBounds(g);
+static int fenceMatchesField(fence *f, sds field){
+    if (f->anchor && !sdscmp(f->anchor, field)){
+        return 0; // the anchor is never near itself.
     }
-    res = hashTypeDelete(s->h, field);
-    rtreeRemove(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, idx);
+    return f->allfields || matchFieldPattern(&f->matcher, field, sdslen(field));
+}
 
-    if (notify){
-        processFences(s, field, g, FENCE_NOTIFY_DEL);
+// sdscatjson appends a quoted and escaped json string.
+static sds sdscatjson(sds s, const char *p, size_t len){
+    s = sdscatlen(s,"\"",1);
+    while (len--){
+        switch (*p){
+        case '\\':
+        case '"':
+            s = sdscatprintf(s,"\\%c",*p);
+            break;
+        case '\n': s = sdscatlen(s,"\\n",2); break;
+        case '\r': s = sdscatlen(s,"\\r",2); break;
+        case '\t': s = sdscatlen(s,"\\t",2); break;
+        default:
+            if ((unsigned char)*p < 0x20){
+                s = sdscatprintf(s,"\\u%04x",(unsigned char)*p);
+            } else {
+                s = sdscatlen(s,p,1);
+            }
+            break;
+        }
+        p++;
     }
-    return res;
+    return sdscatlen(s,"\"",1);
 }
 
-int spatialTypeSet(robj *o, sds field, sds val, int notify){
-
-    int updated;
-    geom g;
-    geomRect r;
-    sds sidx;
-    uint64_t nidx;
-    spatial *s;
-
-    s = (spatial*)(o->ptr);
+static sds sdscatdouble(sds s, double n){
+    char buf[32];
+    int len = dtoa_grisu3(n, buf);
+    return sdscatlen(s, buf, len);
+}
 
-    g = (geom)val;
-    r = geomBounds(g);
-    updated = spatialTypeDelete(o, field, &r, 0);
+/* sdscatfenceobject appends the object in the output format of the fence,
+ * encoded as a json value. 'sz' is the size of the wkb. */
+static sds sdscatfenceobject(sds s, fence *f, geom g, int sz){
+    char output[128];
+    switch (f->output){
+    default:
+    case OUTPUT_WKT:{
+        char *wkt = geomEncodeWKT(g, 0);
+        if (!wkt) return sdscat(s, "null");
+        s = sdscatjson(s, wkt, strlen(wkt));
+        geomFreeWKT(wkt);
+        return s;
+    }
+    case OUTPUT_JSON:{
+        char *json = geomEncodeJSON(g);
+        if (!json) return sdscat(s, "null");
+        s = sdscat(s, json);
+        geomFreeJSON(json);
+        return s;
+    }
+    case OUTPUT_WKB:{
+        // the raw wkb is hex encoded, just like the wkb of the input.
+        s = sdscatlen(s,"\"",1);
+        for (int i=0;i<sz;i++){
+            s = sdscatprintf(s,"%02X",(unsigned char)g[i]);
+        }
+        return sdscatlen(s,"\"",1);
+    }
+    case OUTPUT_POINT:{
+        geomCoord center = geomCenter(g);
+        s = sdscatdouble(sdscatlen(s,"[",1), center.x);
+        s = sdscatdouble(sdscatlen(s,",",1), center.y);
+        return sdscatlen(s,"]",1);
+    }
+    case OUTPUT_BOUNDS:{
+        geomRect bounds = geomBounds(g);
+        s = sdscatdouble(sdscatlen(s,"[",1), bounds.min.x);
+        s = sdscatdouble(sdscatlen(s,",",1), bounds.min.y);
+        s = sdscatdouble(sdscatlen(s,",",1), bounds.max.x);
+        s = sdscatdouble(sdscatlen(s,",",1), bounds.max.y);
+        return sdscatlen(s,"]",1);
+    }
+    case OUTPUT_HASH:{
+        geomCoord center = geomCenter(g);
+        hashEncode(center.y, center.x, f->precision, output);
+        return sdscatjson(s, output, strlen(output));
+    }
+    case OUTPUT_QUAD:{
+        geomCoord center = geomCenter(g);
+        bingLatLongToQuadKey(center.y, center.x, f->precision, output);
+        return sdscatjson(s, output, strlen(output));
+    }
+    case OUTPUT_TILE:{
+        geomCoord center = geomCenter(g);
+        int x, y;
+        bingLatLonToTileXY(center.y, center.x, f->precision, &x, &y);
+        return sdscatprintf(s, "[%d,%d]", x, y);
+    }
+    }
+}
+
+/* fenceEntry returns the notification of a field being inside or outside
+ * of a fence. Plain fences use "inside:field" or "outside:field", while
+ * fences with a payload use a json object such as:
+ *
+ *   {"detect":"inside","field":"truck1","time":1476719300123,
+ *    "distance":1430.25,"object":"POINT(-112 33)"}
+ *
+ * Where time is the unix time in milliseconds of the write, distance is 
+ * the distance in meters between the centers of the object and the fence,
+ * and object is encoded with the OUTPUT format of the fence. The geometry,
+ * of 'sz' bytes, is NULL for deleted fields, which omits the distance and
+ * object.
+ * This function is safe to call from the fence pool threads. */
+static sds fenceEntry(fence *f, sds field, geom g, int sz, int inside, long long when){
+    const char *detect = inside ? "inside" : "outside";
+    if (!f->payload){
+        return sdscatsds(sdscatfmt(sdsempty(), "%s:", detect), field);
+    }
+    sds s = sdscatfmt(sdsempty(), "{\"detect\":\"%s\",\"field\":", detect);
+    s = sdscatjson(s, field, sdslen(field));
+    s = sdscatfmt(s, ",\"time\":%I", when);
+    if (g){
+        geomCoord center = geomCenter(g);
+        s = sdscatdouble(sdscat(s, ",\"distance\":"), 
+            geoutilDistance(center.y, center.x, f->center.y, f->center.x));
+        if (f->output != OUTPUT_FIELD && f->output != OUTPUT_COUNT){
+            s = sdscatfenceobject(sdscat(s, ",\"object\":"), f, g, sz);
+        }
+    }
+    return sdscatlen(s, "}", 1);
+}
+
+/* fenceEmit publishes an entry to the fence channel, or appends it to the
+ * pending batch of the fence. Batches are newline separated entries that
+ * are published as a single message from beforeSleep(). BATCH requires
+ * PAYLOAD, so the entries are JSON objects that never hold a newline. The
+ * entry is consumed. */
+static void fenceEmit(fence *f, sds entry){
+    if (f->batch){
+        if (!f->batched){
+            if (!fenceBatches) fenceBatches = listCreate();
+            listAddNodeTail(fenceBatches, f);
+            retainFence(f);
+            f->batched = entry;
+        } else {
+            f->batched = sdscatlen(f->batched, "\n", 1);
+            f->batched = sdscatsds(f->batched, entry);
+            sdsfree(entry);
+        }
+        return;
+    }
+    robj *msg = createObject(OBJ_STRING, entry);
+    pubsubPublishMessage(f->channel, msg);
+    decrRefCount(msg);
+}
+
+/* spatialFlushFenceBatches publishes the batched notifications of all 
+ * fences. Called from beforeSleep(). */
+void spatialFlushFenceBatches(void){
+    listNode *ln;
+    if (!fenceBatches){
+        return;
+    }
+    while ((ln = listFirst(fenceBatches)) != NULL){
+        fence *f = ln->value;
+        robj *msg = createObject(OBJ_STRING, f->batched);
+        f->batched = NULL;
+        pubsubPublishMessage(f->channel, msg);
+        decrRefCount(msg);
+        listDelNode(fenceBatches, ln);
+        releaseFence(f);
+    }
+}
+
+/* A fenceJob is a snapshot of a single write that is evaluated by the
+ * fence pool. It owns a copy of the field and geometry, and a reference to
+ * each of the fences, so it stays valid if the key is modified or deleted,
+ * or if the client holding the fence disconnects, while it's inflight. */
+typedef struct fenceJob {
+    int fenceNotify;
+    long long when;    // unix time in milliseconds of the write.
+    sds field;
+    geom g;            // copy of the written geometry, NULL for deletes.
+    int count;
+    fence **fences;
+    sds *entries;      // the notification for each fence.
+} fenceJob;
+
+static void freeFenceJob(fenceJob *job){
+    for (int i=0;i<job->count;i++){
+        if (job->entries[i]) sdsfree(job->entries[i]);
+        releaseFence(job->fences[i]);
+    }
+    zfree(job->fences);
+    zfree(job->entries);
+    if (job->g) sdsfree(job->g);
+    sdsfree(job->field);
+    zfree(job);
+}
+
+// fenceContains returns true when the geometry is inside of the fence.
+static int fenceContains(fence *f, geom g, int singleThreaded){
+    if (f->targetType == NEARBY && !f->anchored){
+        return 0;
+    }
+    return matchSearchBase(g, f->m, f->targetType, f->searchType, 
+        f->center, f->meters, singleThreaded);
+}
+
+// evalFenceJob is called from a fence pool thread.
+static void evalFenceJob(void *arg){
+    fenceJob *job = arg;
+    for (int i=0;i<job->count;i++){
+        if (job->entries[i]){
+            continue; // already evaluated by the main thread.
+        }
+        fence *f = job->fences[i];
+        int inside = fenceContains(f, job->g, 0);
+        job->entries[i] = fenceEntry(f, job->field, job->g, sdslen(job->g), 
+            inside, job->when);
+    }
+}
+
+// publishFenceJob is called from the main thread, in submission order.
+static void publishFenceJob(void *arg){
+    fenceJob *job = arg;
+    for (int i=0;i<job->count;i++){
+        sds entry = job->entries[i];
+        if (!entry){
+            // deletes are not evaluated, the field is always outside.
+            entry = fenceEntry(job->fences[i], job->field, NULL, 0, 0, job->when);
+        }
+        job->entries[i] = NULL;
+        fenceEmit(job->fences[i], entry);
+    }
+    freeFenceJob(job);
+}
+
+/* emitFenceEntry publishes an entry computed by the main thread. When the
+ * fence pool is enabled the entry is queued behind the pending jobs so 
+ * that notifications stay in write order. */
+static void emitFenceEntry(fence *f, sds entry){
+    if (server.fence_threads == 0){
+        fenceEmit(f, entry);
+        return;
+    }
+    fenceJob *job = zcalloc(sizeof(fenceJob));
+    job->field = sdsempty();
+    job->fences = zmalloc(sizeof(fence*));
+    job->entries = zmalloc(sizeof(sds));
+    retainFence(f);
+    job->fences[0] = f;
+    job->entries[0] = entry;
+    job->count = 1;
+    fencepoolSubmit(job, NULL, publishFenceJob);
+}
+
+/* submitFences hands the evaluation of the fences over to the fence pool.
+ * Only the cheap field pattern matching is performed inline, along with
+ * NEARBY fences, as their position is updated by the main thread. */
+static void submitFences(spatial *s, sds field, geom g, int sz, 
+    int fenceNotify, long long when)
+{
+    fenceJob *job = NULL;
+    int evaluate = 0;
+    for (int i=0;i<s->flen;i++){
+        fence *f = s->fences[i];
+        if (!fenceMatchesField(f, field)){
+            continue;
+        }
+        if (!job){
+            job = zcalloc(sizeof(fenceJob));
+            job->fenceNotify = fenceNotify;
+            job->when = when;
+            job->field = sdsdup(field);
+            job->fences = zmalloc(s->flen*sizeof(fence*));
+            job->entries = zcalloc(s->flen*sizeof(sds));
+        }
+        if (fenceNotify != FENCE_NOTIFY_DEL){
+            if (f->targetType == NEARBY){
+                job->entries[job->count] = fenceEntry(f, field, g, sz, 
+                    fenceContains(f, g, 1), when);
+            } else {
+                evaluate = 1;
+            }
+        }
+        retainFence(f);
+        job->fences[job->count++] = f;
+    }
+    if (!job){
+        return;
+    }
+    if (!evaluate){
+        // nothing to evaluate, deleted fields are always outside.
+        fencepoolSubmit(job, NULL, publishFenceJob);
+    } else {
+        // the geometry may point into the main hash or the scratch buffer
+        // of the key, both of which change before the job runs.
+        job->g = sdsnewlen(g, sz);
+        fencepoolSubmit(job, evalFenceJob, publishFenceJob);
+    }
+}
+
+typedef struct roamContext {
+    spatial *s;
+    fence *f;
+    long long when;
+    sds scratch;
+    int wasAnchored;     // the fence had a position before the move.
+    geomCoord oldCenter;
+    int skip;            // skip the items that overlap 'visited'.
+    geomRect visited;
+} roamContext;
+
+static int roamIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+    roamContext *ctx = userdata;
+    unsigned char *vstr = NULL;
+    unsigned int vlen = UINT_MAX;
+    long long vll = LLONG_MAX;
+
+    // the items of the old area were already visited by the first probe.
+    if (ctx->skip && !(maxX < ctx->visited.min.x || minX > ctx->visited.max.x ||
+        maxY < ctx->visited.min.y || minY > ctx->visited.max.y))
+    {
+        return 1;
+    }
+    uint64_t nidx = (uint64_t)item;
+    sds sidx = sdsnewlen(&nidx, 8);
+    int res = hashTypeGetValue(ctx->s->idxhash, sidx, &vstr, &vlen, &vll);
+    sdsfree(sidx);
+    if (res == C_ERR){
+        return 1;
+    }
+    sds field = sdscpyhashvalue(sdsempty(), vstr, vlen, vll);
+    if (fenceMatchesField(ctx->f, field) &&
+        hashTypeGetValue(ctx->s->h, field, &vstr, &vlen, &vll) == C_OK)
+    {
+        int sz = 0;
+        geom g = valueGeom(vstr, vlen, &ctx->scratch, &sz);
+        if (g){
+            geomCoord center = geomCenter(g);
+            int was = ctx->wasAnchored && 
+                geomCoordWithinRadius(center, ctx->oldCenter, ctx->f->meters);
+            int now = ctx->f->anchored && fenceContains(ctx->f, g, 1);
+            if (was != now){
+                emitFenceEntry(ctx->f, fenceEntry(ctx->f, field, g, sz, now, ctx->when));
+            }
+        }
+    }
+    sdsfree(field);
+    return 1;
+}
+
+/* moveFence is called when the anchor of a NEARBY fence is written or
+ * deleted. The fence follows the anchor, and the objects that crossed its
+ * edge because of the move are notified: inside for those that are near
+ * the new position only, outside for those that were near the old one
+ * only. Both areas are probed, the second one skipping what the first one
+ * already visited. Deleting the anchor moves every object outside. */
+static void moveFence(spatial *s, fence *f, geom g, long long when){
+    roamContext ctx;
+    geomRect r;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.s = s;
+    ctx.f = f;
+    ctx.when = when;
+    ctx.wasAnchored = f->anchored;
+    ctx.oldCenter = f->center;
+
+    if (g){
+        f->anchored = 1;
+        f->center = geomCenter(g);
+    } else {
+        f->anchored = 0;
+    }
+    if (ctx.wasAnchored){
+        ctx.visited = geoutilBoundsFromLatLon(ctx.oldCenter.y, ctx.oldCenter.x, f->meters);
+        indexSearch(s, ctx.visited, NULL, roamIterator, &ctx);
+        ctx.skip = 1;
+    }
+    if (f->anchored){
+        r = geoutilBoundsFromLatLon(f->center.y, f->center.x, f->meters);
+        indexSearch(s, r, NULL, roamIterator, &ctx);
+    }
+    sdsfree(ctx.scratch);
+}
+
+void processFences(spatial *s, sds field, geom g, int sz, int fenceNotify){
+    long long when;
+    if (s->flen == 0){
+        return;
+    }
+    when = mstime();
+    for (int i=0;i<s->flen;i++){
+        fence *f = s->fences[i];
+        if (f->anchor && !sdscmp(f->anchor, field)){
+            moveFence(s, f, fenceNotify == FENCE_NOTIFY_DEL ? NULL : g, when);
+        }
+    }
+    if (server.fence_threads > 0){
+        submitFences(s, field, g, sz, fenceNotify, when);
+        return;
+    }
+    for (int i=0;i<s->flen;i++){
+        fence *f = s->fences[i];
+        if (!fenceMatchesField(f, field)){
+            continue;
+        }
+        if (fenceNotify == FENCE_NOTIFY_DEL){
+            fenceEmit(f, fenceEntry(f, field, NULL, 0, 0, when));
+        } else {
+            fenceEmit(f, fenceEntry(f, field, g, sz, fenceContains(f, g, 1), when));
+        }
+    }
+}
+
+static void removeFieldExpire(spatial *s, sds field){
+    dictEntry *de = dictFind(s->expires, field);
+    if (!de){
+        return;
+    }
+    zslDelete(s->ezsl, (double)dictGetSignedIntegerVal(de), field, NULL);
+    dictDelete(s->expires, field);
+}
+
+/* trackFieldWrites starts the write order of a key. Only the fields written
+ * from now on are tracked, the fields the key already has were written at
+ * an unknown time and are taken as the oldest ones, see untrackedField. */
+static void trackFieldWrites(spatial *s){
+    s->wtimes = dictCreate(&zsetDictType, NULL);
+    s->wzsl = zslCreate();
+}
+
+static void untrackFieldWrites(spatial *s){
+    dictRelease(s->wtimes);
+    zslFree(s->wzsl);
+    s->wtimes = NULL;
+    s->wzsl = NULL;
+}
+
+static void removeFieldWrite(spatial *s, sds field){
+    dictEntry *de = dictFind(s->wtimes, field);
+    double score;
+    if (!de){
+        return;
+    }
+    score = (double)dictGetSignedIntegerVal(de);
+    // the skiplist owns the name.
+    dictDelete(s->wtimes, field);
+    zslDelete(s->wzsl, score, field, NULL);
+}
+
+/* touchField records a write of an existing field. */
+static void touchField(spatial *s, sds field){
+    long long now = mstime();
+    sds ele;
+    if (!s->wtimes){
+        trackFieldWrites(s);
+    }
+    removeFieldWrite(s, field);
+    ele = sdsdup(field);
+    zslInsert(s->wzsl, (double)now, ele);
+    dictSetSignedIntegerVal(dictAddRaw(s->wtimes, ele), now);
+}
+
+/* retireField keeps a copy of a field that is about to be removed for the
+ * search cursors, as they may still find its idx. The copies are released
+ * with the last cursor of the key. */
+static void retireField(spatial *s, void *idx, sds field, unsigned char *vstr, unsigned int vlen){
+    sds attrs = s->attrs ? dictFetchValue(s->attrs, field) : NULL;
+    retiredField *rf = zmalloc(sizeof(retiredField));
+    rf->field = sdsdup(field);
+    rf->value = sdsnewlen(vstr, vlen);
+    rf->attrs = attrs ? sdsdup(attrs) : NULL;
+    if (!s->retired){
+        s->retired = dictCreate(&retiredDictType, NULL);
+    }
+    if (dictAdd(s->retired, idx, rf) != DICT_OK){
+        retiredFieldDestructor(NULL, rf);
+    }
+}
+
+// notify is used to broadcast fence notifications. An update keeps the
+// field in the sorted field index as it's set again right away.
+static int removeField(robj *o, sds field, int notify, int update) {
+    geomRect r;
+    sds sidx;
+    char *idx;
+    spatial *s;
+    int res;
+
+    s = (spatial*)(o->ptr);
+
+    // get the idx
+    sidx = hashTypeGetNewSds(s->keyhash, field);
+    if (!sidx || sdslen(sidx) != 8){
+        if (sidx) sdsfree(sidx);
+        return 0;
+    }
+    idx = (char*)(*((uint64_t*)sidx));
+
+    // the rtree entry must be removed with the bounds of the stored 
+    // geometry, the entry is not found otherwise.
+    geom g = NULL;
+    int sz = 0;
+    unsigned char *vstr = NULL;
+    unsigned int vlen = UINT_MAX;
+    long long vll = LLONG_MAX;
+    if (hashTypeGetValue(s->h, field, &vstr, &vlen, &vll) == C_ERR || !vstr){
+        sdsfree(sidx);
+        return 0;
+    }
+    g = valueGeom(vstr, vlen, &s->scratch, &sz);
+    if (g){
+        r = geomBounds(g);
+        indexRemove(s, r, idx);
+    }
+    if (s->ncursors){
+        retireField(s, idx, field, vstr, vlen);
+    }
+    res = hashTypeDelete(s->h, field);
+    hashTypeDelete(s->idxhash, sidx);
+    hashTypeDelete(s->keyhash, field);
+    sdsfree(sidx);
+    if (s->expires){
+        removeFieldExpire(s, field);
+    }
+    if (s->attrs){
+        dictDelete(s->attrs, field);
+    }
+    if (s->fzsl && !update){
+        zslDelete(s->fzsl, 0, field, NULL);
+    }
+    if (s->stamps){
+        dictDelete(s->stamps, field);
+    }
+    if (s->wtimes){
+        removeFieldWrite(s, field);
+    }
+
+    if (notify){
+        processFences(s, field, g, sz, FENCE_NOTIFY_DEL);
+    }
+    return res;
+}
+
+int spatialTypeDelete(robj *o, sds field, int notify) {
+    return removeField(o, field, notify, 0);
+}
+
+/* updateField overwrites the value of a field that already is in a large
+ * key. The field keeps its idx and its hash entries, and the value is
+ * rewritten in place when it fits, so that moving an object doesn't move
+ * its strings elsewhere in the heap and only dirties the pages it has to,
+ * which is what a forked child pays for in copy-on-write. Returns 0 when
+ * the field must go through removeField() instead. It must not be used
+ * while the key has search cursors. */
+static int updateField(spatial *s, sds field, sds val, geomRect r){
+    dictEntry *de, *ide;
+    sds old;
+    geom g;
+    void *idx;
+
+    if (s->h->encoding != OBJ_ENCODING_HT ||
+        s->keyhash->encoding != OBJ_ENCODING_HT){
+        return 0;
+    }
+    if ((de = dictFind(s->h->ptr, field)) == NULL ||
+        (ide = dictFind(s->keyhash->ptr, field)) == NULL ||
+        sdslen(dictGetVal(ide)) != 8){
+        return 0;
+    }
+    idx = (void*)(*((uint64_t*)dictGetVal(ide)));
+    old = dictGetVal(de);
+    g = valueGeom(old, sdslen(old), &s->scratch, NULL);
+    if (g){
+        indexRemove(s, geomBounds(g), idx);
+    }
+    if (sdslen(val) <= sdsalloc(old) && sdslen(val) >= sdsalloc(old)/2){
+        memcpy(old, val, sdslen(val));
+        sdssetlen(old, sdslen(val));
+        old[sdslen(val)] = '\0';
+    } else {
+        dictGetVal(de) = sdsdup(val);
+        sdsfree(old);
+    }
+    if (s->expires){
+        removeFieldExpire(s, field);
+    }
+    if (s->attrs){
+        dictDelete(s->attrs, field);
+    }
+    if (s->stamps){
+        dictDelete(s->stamps, field);
+    }
+    indexInsert(s, r, idx);
+    return 1;
+}
+
+int spatialTypeSet(robj *o, sds field, sds val, int notify){
+
+    int updated, sz = 0;
+    geom g;
+    geomRect r;
+    sds sidx, packed, scratch = NULL;
+    uint64_t nidx;
+    spatial *s;
+
+    s = (spatial*)(o->ptr);
+
+    // a packed value is indexed with its rounded coordinates.
+    packed = packValue(s->precision, (geom)val, sdslen(val));
+    if (packed){
+        val = packed;
+    }
+    g = valueGeom(val, sdslen(val), &scratch, &sz);
+    if (!g){
+        return 0;
+    }
+    r = geomBounds(g);
+    if (!s->ncursors && updateField(s, field, val, r)){
+        updated = 1;
+    } else {
+        updated = removeField(o, field, 0, 1);
+        if (!updated && s->fzsl){
+            zslInsert(s->fzsl, 0, sdsdup(field));
+        }
+
+        // create a new idx/field entry
+        s->idx++;
+        nidx = (uint64_t)s->idx;
+        sidx = sdsnewlen(&nidx,8);
+        hashTypeSet(s->idxhash,sidx,field,0);
+        hashTypeSet(s->keyhash,field,sidx,0);
+        sdsfree(sidx);
+        
+        // update the underlying hash
+        hashTypeSet(s->h,field,val,0);
+
+        // update the index
+        indexInsert(s, r, s->idx);
+    }
+    if (server.maxmemory_spatial_fields){
+        touchField(s, field);
+    } else if (s->wtimes){
+        untrackFieldWrites(s);
+    }
+
+    if (notify){
+        processFences(s, field, g, sz, FENCE_NOTIFY_SET);
+    }
+    sdsfree(packed);
+    sdsfree(scratch);
+
+    return updated;
+}
+
+unsigned long spatialTypeLength(robj *o){
+    return hashTypeLength(((spatial*)(o->ptr))->h);
+}
+
+size_t spatialTypeGetValueLength(robj *o, sds field){
+    return hashTypeGetValueLength(((spatial*)(o->ptr))->h, field);   
+}
+
+int spatialTypeExists(robj *o, sds field){
+    return hashTypeExists(((spatial*)(o->ptr))->h, field);
+}
+
+/* ====================================================================
+ * Index order persistence
+ * ==================================================================== */
+
+/* The RDB stores large keys in the order of the leaves of the R-tree, each
+ * field with the bounds it's indexed with. Loading is then a linear read 
+ * that packs the tree again with rtreeLoad(), neither the geometries nor 
+ * the tree splits are computed again. */
+typedef struct indexScanContext {
+    spatial *s;
+    sds sidx;       // reused idx lookup key.
+    sds field;      // reused field buffer.
+    spatialFieldIndexProc proc;
+    void *privdata;
+} indexScanContext;
+
+static int indexScanIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+    indexScanContext *ctx = userdata;
+    unsigned char *vstr = NULL;
+    unsigned int vlen = UINT_MAX;
+    long long vll = LLONG_MAX;
+    double rect[4] = {minX, minY, maxX, maxY};
+    uint64_t nidx = (uint64_t)item;
+    memcpy(ctx->sidx, &nidx, 8);
+    if (hashTypeGetValue(ctx->s->idxhash, ctx->sidx, &vstr, &vlen, &vll) == C_ERR){
+        return 1;
+    }
+    ctx->field = sdscpyhashvalue(ctx->field, vstr, vlen, vll);
+    if (hashTypeGetValue(ctx->s->h, ctx->field, &vstr, &vlen, &vll) == C_ERR || !vstr){
+        return 1;
+    }
+    return ctx->proc(ctx->privdata, ctx->field, vstr, vlen, rect);
+}
+
+/* spatialForEachIndexedField calls 'proc' for every field of the key, in
+ * index order, along with its value and indexed bounds. Grid entries come
+ * after the R-tree, cell by cell. Returns 0 if 'proc' asked to stop. */
+int spatialForEachIndexedField(robj *o, spatialFieldIndexProc proc, void *privdata){
+    indexScanContext ctx;
+    int res;
+    ctx.s = o->ptr;
+    ctx.sidx = sdsnewlen(NULL, 8);
+    ctx.field = sdsempty();
+    ctx.proc = proc;
+    ctx.privdata = privdata;
+    /* The scan looks up every field, which would otherwise move forward a
+     * pending rehash and touch every page of the hashes in a saving child. */
+    if (ctx.s->h->encoding == OBJ_ENCODING_HT)
+        dictPauseRehashing((dict*)ctx.s->h->ptr);
+    if (ctx.s->idxhash->encoding == OBJ_ENCODING_HT)
+        dictPauseRehashing((dict*)ctx.s->idxhash->ptr);
+    res = rtreeScan(ctx.s->tr, indexScanIterator, &ctx);
+    if (res && ctx.s->grid){
+        dictIterator *di = dictGetIterator(ctx.s->grid);
+        dictEntry *de;
+        while (res && (de = dictNext(di)) != NULL){
+            gridCell *cell = dictGetVal(de);
+            for (int i=0;res && i<cell->len;i++){
+                gridEntry *e = &cell->entries[i];
+                res = indexScanIterator(e->x, e->y, e->x, e->y, e->item, &ctx);
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    if (ctx.s->h->encoding == OBJ_ENCODING_HT)
+        dictResumeRehashing((dict*)ctx.s->h->ptr);
+    if (ctx.s->idxhash->encoding == OBJ_ENCODING_HT)
+        dictResumeRehashing((dict*)ctx.s->idxhash->ptr);
+    sdsfree(ctx.sidx);
+    sdsfree(ctx.field);
+    return res;
+}
+
+/* A spatialLoader builds a key from the fields of an RDB, without going
+ * through spatialTypeSet(): the hashes take the loaded strings and the 
+ * R-tree is packed once all the fields are in. */
+struct spatialLoader {
+    robj *o;
+    int len, cap;
+    double *rects;  // minX, minY, maxX, maxY of each item.
+    void **items;
+    int unordered;  // some fields came without their index bounds.
+};
+
+spatialLoader *spatialLoaderNew(unsigned long len){
+    spatialLoader *sl = zcalloc(sizeof(spatialLoader));
+    spatial *s;
+    sl->o = createSpatialObject();
+    s = sl->o->ptr;
+    if (len > server.hash_max_ziplist_entries){
+        hashTypeConvert(s->h, OBJ_ENCODING_HT);
+        hashTypeConvert(s->keyhash, OBJ_ENCODING_HT);
+        hashTypeConvert(s->idxhash, OBJ_ENCODING_HT);
+        dictExpand(s->h->ptr, len);
+        dictExpand(s->keyhash->ptr, len);
+        dictExpand(s->idxhash->ptr, len);
+    }
+    return sl;
+}
+
+/* spatialLoaderAdd adds a field, taking the ownership of 'field' and 
+ * 'value'. The bounds are read from 'rect' or, when NULL, from the value.
+ * Returns C_ERR if the field was already added or the value is corrupt. */
+int spatialLoaderAdd(spatialLoader *sl, sds field, sds value, double *rect){
+    spatial *s = sl->o->ptr;
+    uint64_t nidx;
+    sds sidx;
+    int ht = s->h->encoding == OBJ_ENCODING_HT &&
+             s->keyhash->encoding == OBJ_ENCODING_HT &&
+             s->idxhash->encoding == OBJ_ENCODING_HT;
+    if (ht ? dictAdd(s->h->ptr, field, value) != DICT_OK : 
+             hashTypeExists(s->h, field))
+    {
+        sdsfree(field);
+        sdsfree(value);
+        return C_ERR;
+    }
+    if (sl->len == sl->cap){
+        sl->cap = sl->cap ? sl->cap*2 : 64;
+        sl->rects = zrealloc(sl->rects, sizeof(double)*4*sl->cap);
+        sl->items = zrealloc(sl->items, sizeof(void*)*sl->cap);
+    }
+    if (rect){
+        memcpy(sl->rects+sl->len*4, rect, sizeof(double)*4);
+    } else {
+        geom g = valueGeom(value, sdslen(value), &s->scratch, NULL);
+        geomRect r;
+        if (!g){
+            if (ht){
+                dictDelete(s->h->ptr, field);
+            } else {
+                sdsfree(field);
+                sdsfree(value);
+            }
+            return C_ERR;
+        }
+        r = geomBounds(g);
+        sl->unordered = 1;
+        sl->rects[sl->len*4+0] = r.min.x;
+        sl->rects[sl->len*4+1] = r.min.y;
+        sl->rects[sl->len*4+2] = r.max.x;
+        sl->rects[sl->len*4+3] = r.max.y;
+    }
+    s->idx++;
+    sl->items[sl->len++] = s->idx;
+    nidx = (uint64_t)s->idx;
+    sidx = sdsnewlen(&nidx,8);
+    if (ht){
+        // the field is new, so the other hashes don't need a lookup either.
+        dictAdd(s->keyhash->ptr, sdsdup(field), sdsdup(sidx));
+        dictAdd(s->idxhash->ptr, sidx, sdsdup(field));
+        return C_OK;
+    }
+    hashTypeSet(s->keyhash,field,sidx,0);
+    hashTypeSet(s->idxhash,sidx,field,HASH_SET_TAKE_FIELD);
+    hashTypeSet(s->h,field,value,HASH_SET_TAKE_FIELD|HASH_SET_TAKE_VALUE);
+    return C_OK;
+}
+
+typedef struct loaderOrder {
+    uint64_t hilbert;
+    int pos;
+} loaderOrder;
+
+static int loaderOrderCompare(const void *a, const void *b){
+    const loaderOrder *o1 = a, *o2 = b;
+    if (o1->hilbert != o2->hilbert){
+        return o1->hilbert < o2->hilbert ? -1 : 1;
+    }
+    return o1->pos < o2->pos ? -1 : o1->pos > o2->pos;
+}
+
+/* sortLoader puts the items of a loader in Hilbert order, as the fields of
+ * a hash come in no particular order and the tree is packed as is. */
+static void sortLoader(spatialLoader *sl){
+    loaderOrder *order = zmalloc(sizeof(loaderOrder)*sl->len);
+    double *rects = zmalloc(sizeof(double)*4*sl->len);
+    void **items = zmalloc(sizeof(void*)*sl->len);
+    for (int i=0;i<sl->len;i++){
+        double *r = sl->rects+i*4;
+        order[i].hilbert = geoutilHilbert((r[1]+r[3])/2, (r[0]+r[2])/2);
+        order[i].pos = i;
+    }
+    qsort(order, sl->len, sizeof(loaderOrder), loaderOrderCompare);
+    for (int i=0;i<sl->len;i++){
+        memcpy(rects+i*4, sl->rects+order[i].pos*4, sizeof(double)*4);
+        items[i] = sl->items[order[i].pos];
+    }
+    zfree(order);
+    zfree(sl->rects);
+    zfree(sl->items);
+    sl->rects = rects;
+    sl->items = items;
+}
+
+/* spatialLoaderFinish packs the R-tree and returns the new key. */
+robj *spatialLoaderFinish(spatialLoader *sl){
+    robj *o = sl->o;
+    if (sl->unordered){
+        sortLoader(sl);
+    }
+    rtreeLoad(((spatial*)o->ptr)->tr, sl->len, sl->rects, sl->items);
+    zfree(sl->rects);
+    zfree(sl->items);
+    zfree(sl);
+    return o;
+}
+
+/* ====================================================================
+ * Field expires
+ * ==================================================================== */
+
+/* spatialTypeSetExpire sets the expire time of an existing field, in unix
+ * time milliseconds. Writing the field again clears the expire. */
+void spatialTypeSetExpire(robj *o, sds field, long long when){
+    spatial *s = o->ptr;
+    if (!s->expires){
+        s->expires = dictCreate(&setDictType, NULL);
+        s->ezsl = zslCreate();
+    }
+    removeFieldExpire(s, field);
+    dictEntry *de = dictAddRaw(s->expires, sdsdup(field));
+    dictSetSignedIntegerVal(de, when);
+    zslInsert(s->ezsl, (double)when, sdsdup(field));
+}
+
+/* spatialTypeGetExpire returns the expire time of a field, or -1. */
+long long spatialTypeGetExpire(robj *o, sds field){
+    spatial *s = o->ptr;
+    dictEntry *de;
+    if (!s->expires || (de = dictFind(s->expires, field)) == NULL){
+        return -1;
+    }
+    return dictGetSignedIntegerVal(de);
+}
 
-    // create a new idx/field entry
-    s->idx++;
-    nidx = (uint64_t)s->idx;
-    sidx = sdsnewlen(&nidx,8);
-    hashTypeSet(s->idxhash,sidx,field,0);
-    hashTypeSet(s->keyhash,field,sidx,0);
-    sdsfree(sidx);
-    
-    // update the underlying hash
-    hashTypeSet(s->h,field,val,0);
+/* spatialTypeVolatileLength returns the number of fields with an expire. */
+unsigned long spatialTypeVolatileLength(robj *o){
+    spatial *s = o->ptr;
+    return s->expires ? dictSize(s->expires) : 0;
+}
 
-    // update the rtree
-    rtreeInsert(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, s->idx);
+/* spatialForEachFieldExpire calls 'proc' for every field with an expire, 
+ * in expire order. Returns 0 as soon as 'proc' returns 0, otherwise 1. */
+int spatialForEachFieldExpire(robj *o, spatialFieldExpireProc proc, void *privdata){
+    spatial *s = o->ptr;
+    zskiplistNode *zn;
+    if (!s->expires){
+        return 1;
+    }
+    for (zn = s->ezsl->header->level[0].forward; zn; zn = zn->level[0].forward){
+        if (!proc(privdata, zn->ele, (long long)zn->score)){
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    if (notify){
-        processFences(s, field, g, FENCE_NOTIFY_SET);
+/* spatialTrackExpires registers a key holding volatile fields in the db, so
+ * that the active expire cycle finds it. It's called from dbAdd() and 
+ * dbOverwrite() and each time an expire is set. Keys that are gone or that
+ * have no more volatile fields are dropped lazily by the cycle. */
+void spatialTrackExpires(redisDb *db, robj *key, robj *o){
+    if (spatialTypeVolatileLength(o) == 0 || dictFind(db->gexpires, key->ptr)){
+        return;
     }
+    dictAdd(db->gexpires, sdsdup(key->ptr), NULL);
+}
 
-    return updated;
+/* spatialTypeSetStamp sets the timestamp of an existing field, which is 
+ * compared by GSET IFNEWER. Writing the field again drops it. */
+void spatialTypeSetStamp(robj *o, sds field, long long stamp){
+    spatial *s = o->ptr;
+    dictEntry *de;
+    if (!s->stamps){
+        s->stamps = dictCreate(&setDictType, NULL);
+    }
+    if ((de = dictFind(s->stamps, field)) == NULL){
+        de = dictAddRaw(s->stamps, sdsdup(field));
+    }
+    dictSetSignedIntegerVal(de, stamp);
 }
 
-unsigned long spatialTypeLength(robj *o){
-    return hashTypeLength(((spatial*)(o->ptr))->h);
+/* spatialTypeGetStamp retrieves the timestamp of a field. Returns 0 when 
+ * it has none. */
+int spatialTypeGetStamp(robj *o, sds field, long long *stamp){
+    spatial *s = o->ptr;
+    dictEntry *de;
+    if (!s->stamps || (de = dictFind(s->stamps, field)) == NULL){
+        return 0;
+    }
+    *stamp = dictGetSignedIntegerVal(de);
+    return 1;
 }
 
-size_t spatialTypeGetValueLength(robj *o, sds field){
-    return hashTypeGetValueLength(((spatial*)(o->ptr))->h, field);   
+/* spatialTypeStampsLength returns the number of fields with a timestamp. */
+unsigned long spatialTypeStampsLength(robj *o){
+    spatial *s = o->ptr;
+    return s->stamps ? dictSize(s->stamps) : 0;
 }
 
-int spatialTypeExists(robj *o, sds field){
-    return hashTypeExists(((spatial*)(o->ptr))->h, field);
+/* spatialForEachFieldStamp calls 'proc' for every field with a timestamp.
+ * Returns 0 as soon as 'proc' returns 0, otherwise 1. */
+int spatialForEachFieldStamp(robj *o, spatialFieldStampProc proc, void *privdata){
+    spatial *s = o->ptr;
+    dictIterator *di;
+    dictEntry *de;
+    int res = 1;
+    if (!s->stamps){
+        return 1;
+    }
+    di = dictGetIterator(s->stamps);
+    while (res && (de = dictNext(di)) != NULL){
+        res = proc(privdata, dictGetKey(de), dictGetSignedIntegerVal(de));
+    }
+    dictReleaseIterator(di);
+    return res;
+}
+
+/* dropField deletes a field like GDEL does, which notifies the fences of
+ * the key, and propagates the GDEL to the AOF and the slaves. Used for the
+ * fields that expire or that are evicted. Returns 1 if the key was removed
+ * because it has no more fields. */
+static int dropField(redisDb *db, robj *keyobj, robj *o, sds field, int type, char *event){
+    robj *argv[3];
+
+    argv[0] = createStringObject("GDEL",4);
+    argv[1] = keyobj;
+    argv[2] = createStringObject(field,sdslen(field));
+    propagate(server.gdelCommand,db->id,argv,3,PROPAGATE_AOF|PROPAGATE_REPL);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[2]);
+
+    spatialTypeDelete(o, field, 1);
+    signalModifiedKey(db,keyobj);
+    notifyKeyspaceEvent(type,event,keyobj,db->id);
+    if (spatialTypeLength(o) == 0){
+        dbDelete(db,keyobj);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",keyobj,db->id);
+        return 1;
+    }
+    return 0;
+}
+
+static int expireField(redisDb *db, robj *keyobj, robj *o, sds field){
+    server.stat_expiredfields++;
+    return dropField(db, keyobj, o, field, NOTIFY_EXPIRED, "gexpired");
+}
+
+static long long fieldExpireNow(void){
+    /* See expireIfNeeded(): time is frozen while a script runs. */
+    return server.lua_caller ? server.lua_time_start : mstime();
+}
+
+/* spatialExpireFieldsIfNeeded is the counterpart of expireIfNeeded() for 
+ * the fields of a spatial key. It's called by lookupKeyRead() and 
+ * lookupKeyWrite() so that commands never see a field that is past due 
+ * between two runs of the active expire cycle. Slaves don't delete fields 
+ * on their own but wait for the GDEL of the master, meanwhile the read 
+ * commands hide them, see fieldIsStale(). Returns 1 if the key was deleted
+ * along with its last field. */
+int spatialExpireFieldsIfNeeded(redisDb *db, robj *key, robj *o){
+    spatial *s = o->ptr;
+    zskiplistNode *zn;
+    long long now;
+    int removed = 0;
+
+    if (!s->expires || server.loading || server.masterhost != NULL){
+        return 0;
+    }
+    now = fieldExpireNow();
+    while (!removed && (zn = s->ezsl->header->level[0].forward) && zn->score < now){
+        sds field = sdsdup(zn->ele);
+        removed = expireField(db, key, o, field);
+        sdsfree(field);
+    }
+    return removed;
+}
+
+/* hidesStaleFields is true on a slave, unless the command comes from the
+ * master itself. */
+static int hidesStaleFields(void){
+    return server.masterhost != NULL && 
+        !(server.current_client && server.current_client == server.master);
+}
+
+/* fieldIsStale returns 1 for a field that is past due on a slave, which 
+ * keeps it until the master expires it. */
+static int fieldIsStale(spatial *s, sds field){
+    dictEntry *de;
+    if (!hidesStaleFields() || !s->expires || 
+        (de = dictFind(s->expires, field)) == NULL)
+    {
+        return 0;
+    }
+    return dictGetSignedIntegerVal(de) < fieldExpireNow();
+}
+
+/* staleLength returns the number of fields that are past due on a slave. */
+static unsigned long staleLength(spatial *s){
+    zskiplistNode *zn;
+    unsigned long count = 0;
+    long long now;
+    if (!hidesStaleFields() || !s->expires){
+        return 0;
+    }
+    now = fieldExpireNow();
+    for (zn = s->ezsl->header->level[0].forward; zn && zn->score < now; zn = zn->level[0].forward){
+        count++;
+    }
+    return count;
+}
+
+/* spatialActiveExpireCycle deletes the expired fields of spatial keys. It 
+ * is called from databasesCron() along with activeExpireCycle() and uses 
+ * the same time budget. As the fields of a key are ordered by expire time
+ * there is no sampling: only expired fields and one more per key are 
+ * visited. */
+void spatialActiveExpireCycle(void){
+    static unsigned int current_db = 0; /* Last DB tested. */
+    long long start = ustime(), now = mstime(), timelimit;
+    int j, iteration = 0;
+
+    timelimit = 1000000*ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+(current_db % server.dbnum);
+        dictIterator *di;
+        dictEntry *de;
+        int timeout = 0;
+
+        current_db++;
+        if (dictSize(db->gexpires) == 0) continue;
+        di = dictGetSafeIterator(db->gexpires);
+        while (!timeout && (de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+            robj *o = dictFetchValue(db->dict, key);
+            zskiplistNode *zn;
+            robj *keyobj;
+            int removed = 0;
+
+            if (!o || o->type != OBJ_SPATIAL || spatialTypeVolatileLength(o) == 0) {
+                dictDelete(db->gexpires, key);
+                continue;
+            }
+            keyobj = createStringObject(key, sdslen(key));
+            while (!removed &&
+                   (zn = ((spatial*)o->ptr)->ezsl->header->level[0].forward) &&
+                   zn->score < now)
+            {
+                sds field = sdsdup(zn->ele);
+                removed = expireField(db, keyobj, o, field);
+                sdsfree(field);
+                /* Check the time limit every 16 fields. */
+                if ((++iteration & 15) == 0 && ustime()-start > timelimit) {
+                    timeout = 1;
+                    break;
+                }
+            }
+            if (removed) dictDelete(db->gexpires, keyobj->ptr);
+            decrRefCount(keyobj);
+        }
+        dictReleaseIterator(di);
+        if (timeout) return;
+    }
+}
+
+/* ====================================================================
+ * Field eviction
+ * ==================================================================== */
+
+/* untrackedField returns a field that wasn't written since the write order
+ * of the key is tracked, or NULL. The fields of a large key are sampled, 
+ * like the keys in evictionPoolPopulate(), as building the write order of
+ * the whole key would take more memory right when it's needed the most. 
+ * The returned field must be freed by the caller. */
+static sds untrackedField(spatial *s){
+    unsigned long tracked = s->wtimes ? dictSize(s->wtimes) : 0;
+    hashTypeIterator *hi;
+    sds field = NULL;
+    int j;
+
+    if (hashTypeLength(s->h) <= tracked){
+        return NULL;
+    }
+    if (s->h->encoding == OBJ_ENCODING_HT){
+        for (j = 0; j < server.maxmemory_samples; j++){
+            sds sample = dictGetKey(dictGetRandomKey(s->h->ptr));
+            if (!tracked || !dictFind(s->wtimes, sample)){
+                return sdsdup(sample);
+            }
+        }
+        return NULL;
+    }
+    // ziplists are small enough to be scanned.
+    hi = hashTypeInitIterator(s->h);
+    while (!field && hashTypeNext(hi) != C_ERR) {
+        field = hashTypeCurrentObjectNewSds(hi, OBJ_HASH_KEY);
+        if (tracked && dictFind(s->wtimes, field)){
+            sdsfree(field);
+            field = NULL;
+        }
+    }
+    hashTypeReleaseIterator(hi);
+    return field;
+}
+
+/* spatialEvictFields is called by freeMemoryIfNeeded() in place of deleting
+ * a spatial key picked by the maxmemory policy, when maxmemory-spatial-fields
+ * is on. The least recently written fields of the key are deleted, one at a
+ * time, until 'tofree' bytes are reclaimed or SPATIAL_EVICT_FIELDS_MAX were
+ * deleted, so that eviction never takes more of a large key than it needs
+ * to. The key is deleted along with its last field. Returns the number of 
+ * evicted fields and sets 'freed' to the memory reclaimed. */
+#define SPATIAL_EVICT_FIELDS_MAX 64
+
+int spatialEvictFields(redisDb *db, robj *keyobj, robj *o, size_t tofree, size_t *freed){
+    spatial *s = o->ptr;
+    size_t start = zmalloc_used_memory(), used;
+    int evicted = 0, removed = 0;
+    zskiplistNode *zn;
+    sds field;
+
+    *freed = 0;
+    while (!removed && evicted < SPATIAL_EVICT_FIELDS_MAX && *freed < tofree){
+        // the untracked fields are older than any tracked one.
+        if ((field = untrackedField(s)) == NULL){
+            if (!s->wzsl || (zn = s->wzsl->header->level[0].forward) == NULL){
+                break;
+            }
+            field = sdsdup(zn->ele);
+        }
+        removed = dropField(db, keyobj, o, field, NOTIFY_EVICTED, "gevicted");
+        sdsfree(field);
+        server.stat_evictedfields++;
+        evicted++;
+        used = zmalloc_used_memory();
+        *freed = used < start ? start-used : 0;
+    }
+    return evicted;
+}
+
+/* ====================================================================
+ * Field attributes
+ * ==================================================================== */
+
+/* The numeric attributes of a field are packed in a single sds as a list
+ * of entries made of the name length (one byte), the name and the value
+ * as a native double. Objects have a handful of attributes so a linear 
+ * scan is cheaper than anything else. */
+#define ATTR_NAME_MAX 255
+
+static unsigned char *attrsFind(sds attrs, const char *name, size_t nlen){
+    unsigned char *p = (unsigned char*)attrs;
+    unsigned char *end = p+sdslen(attrs);
+    while (p < end){
+        size_t len = p[0];
+        if (len == nlen && !memcmp(p+1, name, nlen)){
+            return p;
+        }
+        p += 1+len+sizeof(double);
+    }
+    return NULL;
+}
+
+/* attrsGet retrieves an attribute. Returns 0 when it's not set. */
+static int attrsGet(sds attrs, const char *name, size_t nlen, double *value){
+    unsigned char *p = attrsFind(attrs, name, nlen);
+    if (!p){
+        return 0;
+    }
+    memcpy(value, p+1+nlen, sizeof(double));
+    return 1;
+}
+
+/* attrsSet sets an attribute and returns the possibly reallocated sds. The
+ * name must not be longer than ATTR_NAME_MAX. */
+static sds attrsSet(sds attrs, const char *name, size_t nlen, double value){
+    unsigned char *p = attrsFind(attrs, name, nlen);
+    if (p){
+        memcpy(p+1+nlen, &value, sizeof(double));
+        return attrs;
+    }
+    unsigned char len = (unsigned char)nlen;
+    attrs = sdscatlen(attrs, &len, 1);
+    attrs = sdscatlen(attrs, name, nlen);
+    return sdscatlen(attrs, &value, sizeof(double));
+}
+
+/* spatialTypeSetAttributes sets the attributes of an existing field, the
+ * attrs sds is owned by the object afterwards. Writing the field again 
+ * drops its attributes. */
+void spatialTypeSetAttributes(robj *o, sds field, sds attrs){
+    spatial *s = o->ptr;
+    if (!s->attrs){
+        s->attrs = dictCreate(&hashDictType, NULL);
+    }
+    dictReplace(s->attrs, sdsdup(field), attrs);
+}
+
+static sds spatialGetAttributes(spatial *s, sds field){
+    return s->attrs ? dictFetchValue(s->attrs, field) : NULL;
+}
+
+int spatialTypeHasAttributes(robj *o, sds field){
+    return spatialGetAttributes(o->ptr, field) != NULL;
+}
+
+/* spatialTypeAttributesLength returns the number of fields with attributes. */
+unsigned long spatialTypeAttributesLength(robj *o){
+    spatial *s = o->ptr;
+    return s->attrs ? dictSize(s->attrs) : 0;
+}
+
+/* attrsToArgv unpacks attributes into name and value strings. */
+static sds *attrsToArgv(sds attrs, int *argc){
+    unsigned char *p = (unsigned char*)attrs;
+    unsigned char *end = p+sdslen(attrs);
+    int n = 0;
+    while (p < end){
+        n++;
+        p += 1+p[0]+sizeof(double);
+    }
+    sds *argv = zmalloc(sizeof(sds)*n*2);
+    char buf[128];
+    for (p = (unsigned char*)attrs; p < end; p += 1+p[0]+sizeof(double)){
+        double value;
+        memcpy(&value, p+1+p[0], sizeof(double));
+        argv[(*argc)++] = sdsnewlen(p+1, p[0]);
+        argv[(*argc)++] = sdsnewlen(buf, d2string(buf,sizeof(buf),value));
+    }
+    return argv;
+}
+
+/* spatialTypeGetAttributesArgv returns the attributes of a field as name 
+ * and value strings, as expected by GSET ... FIELDS. Returns NULL if the
+ * field has no attributes, otherwise the result must be freed with 
+ * sdsfreesplitres(). */
+sds *spatialTypeGetAttributesArgv(robj *o, sds field, int *argc){
+    sds attrs = spatialGetAttributes(o->ptr, field);
+    *argc = 0;
+    if (!attrs){
+        return NULL;
+    }
+    return attrsToArgv(attrs, argc);
+}
+
+/* spatialForEachFieldAttributes calls 'proc' for every field with 
+ * attributes. Returns 0 as soon as 'proc' returns 0, otherwise 1. */
+int spatialForEachFieldAttributes(robj *o, spatialFieldAttributesProc proc, void *privdata){
+    spatial *s = o->ptr;
+    dictIterator *di;
+    dictEntry *de;
+    int res = 1;
+    if (!s->attrs){
+        return 1;
+    }
+    di = dictGetIterator(s->attrs);
+    while (res && (de = dictNext(di)) != NULL){
+        sds field = dictGetKey(de);
+        int argc = 0;
+        sds *argv = attrsToArgv(dictGetVal(de), &argc);
+        res = proc(privdata, field, argc, argv);
+        sdsfreesplitres(argv, argc);
+    }
+    dictReleaseIterator(di);
+    return res;
+}
+
+/* parseAttributesOrReply parses name/value pairs into packed attributes. 
+ * Returns NULL on error, after replying to the client. */
+static sds parseAttributesOrReply(client *c, int j){
+    if (j >= c->argc || (c->argc-j)%2 != 0){
+        addReplyError(c, "need field name and value pairs");
+        return NULL;
+    }
+    sds attrs = sdsempty();
+    for (;j<c->argc;j+=2){
+        sds name = c->argv[j]->ptr;
+        double value;
+        if (sdslen(name) == 0 || sdslen(name) > ATTR_NAME_MAX){
+            addReplyError(c, "invalid field name");
+            sdsfree(attrs);
+            return NULL;
+        }
+        if (getDoubleFromObjectOrReply(c, c->argv[j+1], &value, "need numeric field value") != C_OK){
+            sdsfree(attrs);
+            return NULL;
+        }
+        attrs = attrsSet(attrs, name, sdslen(name), value);
+    }
+    return attrs;
+}
+
+/* spatialTypeSetAttributesArgv sets the attributes of an existing field
+ * from name and value strings, as returned by 
+ * spatialTypeGetAttributesArgv(). Returns C_ERR if they are not valid. */
+int spatialTypeSetAttributesArgv(robj *o, sds field, int argc, sds *argv){
+    if (argc == 0 || argc%2 != 0){
+        return C_ERR;
+    }
+    sds attrs = sdsempty();
+    for (int j=0;j<argc;j+=2){
+        char *eptr;
+        double value = strtod(argv[j+1], &eptr);
+        if (sdslen(argv[j]) == 0 || sdslen(argv[j]) > ATTR_NAME_MAX || 
+            eptr[0] != '\0' || isnan(value))
+        {
+            sdsfree(attrs);
+            return C_ERR;
+        }
+        attrs = attrsSet(attrs, argv[j], sdslen(argv[j]), value);
+    }
+    if (!spatialTypeExists(o, field)){
+        sdsfree(attrs);
+        return C_OK;
+    }
+    spatialTypeSetAttributes(o, field, attrs);
+    return C_OK;
+}
+
+/* The sorted field index keeps the field names of a key in a skiplist so
+ * that a MATCH prefix can be answered by walking a range of names instead
+ * of the R-tree. It's off by default as it costs a copy of every name. */
+static void buildFieldIndex(spatial *s){
+    hashTypeIterator *hi;
+    s->fzsl = zslCreate();
+    hi = hashTypeInitIterator(s->h);
+    while (hashTypeNext(hi) != C_ERR) {
+        zslInsert(s->fzsl, 0, hashTypeCurrentObjectNewSds(hi, OBJ_HASH_KEY));
+    }
+    hashTypeReleaseIterator(hi);
+}
+
+/* rebuildIndex moves every entry to a new R-tree and grid. A zero step 
+ * turns the grid off. */
+static void rebuildIndex(spatial *s, int gridstep){
+    rtree *tr = s->tr;
+    dict *grid = s->grid;
+    hashTypeIterator *hi;
+
+    s->tr = rtreeNew();
+    s->grid = gridstep ? dictCreate(&gridDictType, NULL) : NULL;
+    s->gridstep = gridstep;
+    s->gridlen = 0;
+    hi = hashTypeInitIterator(s->h);
+    while (hashTypeNext(hi) != C_ERR) {
+        sds field = hashTypeCurrentObjectNewSds(hi, OBJ_HASH_KEY);
+        sds sidx = hashTypeGetNewSds(s->keyhash, field);
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+        hashTypeIteratorValue(hi, OBJ_HASH_VALUE, &vstr, &vlen, &vll);
+        geom g = vstr ? valueGeom(vstr, vlen, &s->scratch, NULL) : NULL;
+        if (sidx && sdslen(sidx) == 8 && g){
+            indexInsert(s, geomBounds(g), (char*)(*((uint64_t*)sidx)));
+        }
+        if (sidx){
+            sdsfree(sidx);
+        }
+        sdsfree(field);
+    }
+    hashTypeReleaseIterator(hi);
+    rtreeFree(tr);
+    if (grid){
+        dictRelease(grid);
+    }
+}
+
+/* encodeValues rewrites the values of a key with a new precision, or as 
+ * WKB when it's -1. Returns the number of changed values. */
+static long encodeValues(spatial *s, int precision){
+    hashTypeIterator *hi;
+    long len = 0, cap = 0;
+    sds *pairs = NULL;
+
+    hi = hashTypeInitIterator(s->h);
+    while (hashTypeNext(hi) != C_ERR) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+        sds value = NULL;
+        int sz;
+        hashTypeIteratorValue(hi, OBJ_HASH_VALUE, &vstr, &vlen, &vll);
+        if (!vstr){
+            continue;
+        }
+        int packed = geomIsPacked(vstr, vlen);
+        if (packed && geomPackedPrecision(vstr, vlen) == precision){
+            continue;
+        }
+        geom g = valueGeom(vstr, vlen, &s->scratch, &sz);
+        if (!g){
+            continue;
+        }
+        value = packValue(precision, g, sz);
+        if (!value && packed){
+            value = sdsnewlen(g, sz);
+        }
+        if (!value){
+            continue;
+        }
+        if (len == cap){
+            cap = cap ? cap*2 : 64;
+            pairs = zrealloc(pairs, sizeof(sds)*2*cap);
+        }
+        pairs[len*2+0] = hashTypeCurrentObjectNewSds(hi, OBJ_HASH_KEY);
+        pairs[len*2+1] = value;
+        len++;
+    }
+    hashTypeReleaseIterator(hi);
+    for (long i=0;i<len;i++){
+        hashTypeSet(s->h, pairs[i*2+0], pairs[i*2+1], 
+                    HASH_SET_TAKE_FIELD|HASH_SET_TAKE_VALUE);
+    }
+    zfree(pairs);
+    return len;
+}
+
+/* setIndexOptions applies GINDEX options. On error 'err' is set and no
+ * option is changed. */
+static int setIndexOptions(spatial *s, int argc, sds *argv, const char **err){
+    int fields = s->fzsl != NULL;
+    int gridstep = s->grid ? s->gridstep : 0;
+    int precision = s->precision;
+    for (int j=0;j<argc;j++){
+        if (!strcasecmp(argv[j], "type") && j+1 < argc){
+            long long step = GRID_STEP_DEFAULT;
+            if (!strcasecmp(argv[j+1], "rtree")){
+                gridstep = 0;
+            } else if (!strcasecmp(argv[j+1], "grid")){
+                if (j+2 < argc && string2ll(argv[j+2], sdslen(argv[j+2]), &step)){
+                    if (step < 1 || step > GEO_STEP_MAX){
+                        *err = "grid step must be between 1 and 26";
+                        return C_ERR;
+                    }
+                    j++;
+                }
+                gridstep = step;
+            } else {
+                *err = "TYPE must be RTREE or GRID";
+                return C_ERR;
+            }
+            j++;
+        } else if (!strcasecmp(argv[j], "fields") && j+1 < argc){
+            if (!strcasecmp(argv[j+1], "on")){
+                fields = 1;
+            } else if (!strcasecmp(argv[j+1], "off")){
+                fields = 0;
+            } else {
+                *err = "FIELDS must be ON or OFF";
+                return C_ERR;
+            }
+            j++;
+        } else if (!strcasecmp(argv[j], "encoding") && j+1 < argc){
+            long long prec = PACKED_PRECISION_DEFAULT;
+            if (!strcasecmp(argv[j+1], "wkb")){
+                prec = -1;
+            } else if (!strcasecmp(argv[j+1], "packed")){
+                if (j+2 < argc && string2ll(argv[j+2], sdslen(argv[j+2]), &prec)){
+                    if (prec < 0 || prec > GEOM_PACKED_MAX_PRECISION){
+                        *err = "precision must be between 0 and 15";
+                        return C_ERR;
+                    }
+                    j++;
+                }
+            } else {
+                *err = "ENCODING must be WKB or PACKED";
+                return C_ERR;
+            }
+            precision = prec;
+            j++;
+        } else {
+            *err = "syntax error";
+            return C_ERR;
+        }
+    }
+    if (precision != s->precision){
+        // the values are rewritten in place, which the cursors can't see.
+        if (s->ncursors){
+            releaseSpatialCursors(s);
+        }
+        s->precision = precision;
+        if (encodeValues(s, precision) > 0){
+            // the bounds of the rounded values may differ.
+            rebuildIndex(s, gridstep);
+        }
+    }
+    if (gridstep != (s->grid ? s->gridstep : 0)){
+        rebuildIndex(s, gridstep);
+    }
+    if (fields && !s->fzsl){
+        buildFieldIndex(s);
+    } else if (!fields && s->fzsl){
+        zslFree(s->fzsl);
+        s->fzsl = NULL;
+    }
+    return C_OK;
+}
+
+/* spatialTypeGetIndexArgv returns the index options of a key that differ 
+ * from the defaults, as expected by GINDEX. Returns NULL if there's none,
+ * otherwise the result must be freed with sdsfreesplitres(). */
+sds *spatialTypeGetIndexArgv(robj *o, int *argc){
+    spatial *s = o->ptr;
+    *argc = 0;
+    if (!s->fzsl && !s->grid && s->precision == -1){
+        return NULL;
+    }
+    sds *argv = zmalloc(sizeof(sds)*8);
+    if (s->grid){
+        argv[(*argc)++] = sdsnew("TYPE");
+        argv[(*argc)++] = sdsnew("GRID");
+        argv[(*argc)++] = sdsfromlonglong(s->gridstep);
+    }
+    if (s->fzsl){
+        argv[(*argc)++] = sdsnew("FIELDS");
+        argv[(*argc)++] = sdsnew("ON");
+    }
+    if (s->precision != -1){
+        argv[(*argc)++] = sdsnew("ENCODING");
+        argv[(*argc)++] = sdsnew("PACKED");
+        argv[(*argc)++] = sdsfromlonglong(s->precision);
+    }
+    return argv;
+}
+
+/* spatialTypeSetIndexOptions applies index options, as returned by
+ * spatialTypeGetIndexArgv(). On error 'err' is set. */
+int spatialTypeSetIndexOptions(robj *o, int argc, sds *argv, const char **err){
+    return setIndexOptions(o->ptr, argc, argv, err);
 }
 
 robj *spatialTypeLookupWriteOrCreate(client *c, robj *key) {
@@ -563,7 +2610,6 @@ robj *spatialTypeLookupWriteOrCreate(client *c, robj *key) {
     if (o == NULL) {
         o = createSpatialObject();
         dbAdd(c->db,key,o);
-        attachFences(o->ptr, key->ptr);
     } else {
         if (o->type != OBJ_SPATIAL) {
             addReply(c,shared.wrongtypeerr);
@@ -572,49 +2618,68 @@ robj *spatialTypeLookupWriteOrCreate(client *c, robj *key) {
     }
     return o;
 }
-int subscribeSearchContextFence(client *c, sds key, searchContext *ctx){
-    char rchan[19];
-    strcpy(rchan, "fence$");
-    getRandomHexChars(rchan+6, 18-6);
-    sds keych = sdscatfmt(sdsnewlen(rchan, 18), "$%S", key);
-    robj *channel = createStringObject(keych, sdslen(keych));
-    sdsfree(keych);
-    
-    
-    // copy stuff from context.
-    fence *f = zmalloc(sizeof(fence));
-    memset(f, 0, sizeof(fence));
+/* newFence creates a fence watching 'key' in db 'dbid' from a search
+ * context. Returns NULL when the search area cannot be indexed. */
+static fence *newFence(searchContext *ctx, robj *channel, int dbid, sds key){
+    fence *f = zcalloc(sizeof(fence));
     if (ctx->pattern){
         f->pattern = sdsdup(ctx->pattern);
+        compileFieldPattern(&f->matcher, f->pattern, sdslen(f->pattern));
     }
+    f->refcount = 1;
     f->allfields = ctx->allfields;
     f->channel = channel;
+    incrRefCount(channel);
+    f->dbid = dbid;
+    f->key = sdsdup(key);
+    f->targetType = ctx->targetType;
+    f->searchType = ctx->searchType;
+    f->center = ctx->center;
+    f->meters = ctx->meters;
+    if (ctx->anchor){
+        f->anchor = sdsdup(ctx->anchor);
+    }
+    f->payload = ctx->payload;
+    f->output = ctx->output;
+    f->precision = ctx->precision;
+    f->batch = ctx->batch;
     if (ctx->g){
         f->g = zmalloc(ctx->sz);
         memcpy(f->g, ctx->g, ctx->sz);
         f->sz = ctx->sz;
         f->m = geomNewPolyMap(f->g);
         if (!f->m){
-            decrRefCount(f->channel);
-            zfree(f->g);
-            if (f->pattern) sdsfree(f->pattern);
-            zfree(f);
-            return 0;
+            freeFence(f);
+            return NULL;
+        }
+        if (f->targetType != RADIUS){
+            // payloads report the distance to the center of the fence.
+            f->center = geomCenter(f->g);
         }
     }
+    return f;
+}
 
-    if (ctx->s){
-       pushFence(ctx->s, f);
-    }
-    
-    if (c->spatial_fence){
-        spatialReleaseAllFences(c);
+int subscribeSearchContextFence(client *c, sds key, searchContext *ctx){
+    char rchan[19];
+    strcpy(rchan, "fence$");
+    getRandomHexChars(rchan+6, 18-6);
+    sds keych = sdscatfmt(sdsnewlen(rchan, 18), "$%S", key);
+    robj *channel = createObject(OBJ_STRING, keych);
+    fence *f = newFence(ctx, channel, c->db->id, key);
+    decrRefCount(channel);
+    if (!f){
+        return 0;
     }
-    c->spatial_fence = sdsdup(keych);
 
-    uint64_t nidx = (uint64_t)f;
-    robj *sidx = createRawStringObject((char*)&nidx, 8);
-    dictAdd(server.fences,f->channel->ptr,sidx);
+    dictAdd(server.fences,f->channel->ptr,f);
+    registerFence(f);
+
+    // a client may hold any number of fences, each with its own channel.
+    if (!c->spatial_fences){
+        c->spatial_fences = listCreate();
+    }
+    listAddNodeTail(c->spatial_fences, f);
 
     pubsubSubscribeChannel(c,f->channel);
     
@@ -625,9 +2690,11 @@ int subscribeSearchContextFence(client *c, sds key, searchContext *ctx){
 
 
 /* Importing some stuff from t_hash.c but these should exist in server.h */
+static sds replyScratch = NULL;
+
 static void addGeomReplyBulkCBuffer(client *c, const void *p, size_t len) {
-    len = len-0; // noop for now.
-    char *wkt = geomEncodeWKT((geom)p, 0);
+    geom g = valueGeom(p, len, &replyScratch, NULL);
+    char *wkt = g ? geomEncodeWKT(g, 0) : NULL;
     if (!wkt){
         addReplyError(c, "failed to encode wkt");
         return;
@@ -649,7 +2716,8 @@ static void addGeomHashFieldToReply(client *c, robj *o, sds field) {
     unsigned char *vstr = NULL;
     unsigned int vlen = UINT_MAX;
     long long vll = LLONG_MAX;
-    if (hashTypeGetValue(((spatial*)(o->ptr))->h, field, &vstr, &vlen, &vll) == C_ERR){
+    if (fieldIsStale(o->ptr, field) ||
+        hashTypeGetValue(((spatial*)(o->ptr))->h, field, &vstr, &vlen, &vll) == C_ERR){
         addReply(c, shared.nullbulk);
         return;
     }
@@ -667,8 +2735,10 @@ static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int wh
     hashTypeIteratorValue(hi, what, &vstr, &vlen, &vll);
     if (what == OBJ_HASH_VALUE){
         addGeomReplyBulkCBuffer(c, vstr, vlen);
-    }else{
+    }else if (vstr){
         addReplyBulkCBuffer(c, vstr, vlen);
+    }else{
+        addReplyBulkLongLong(c, vll);
     }
 }
 
@@ -886,6 +2956,12 @@ cleanup:
     listRelease(keys);
 }
 
+/* validLonLat returns 1 when the pair is a finite longitude and latitude,
+ * NaN included in the rejected values. */
+static int validLonLat(double lon, double lat){
+    return lon >= -180 && lon <= 180 && lat >= -90 && lat <= 90;
+}
+
 static sds decodeSdsOrReply(client *c, sds value){
     geom g = NULL;
     int sz = 0;
@@ -894,27 +2970,173 @@ static sds decodeSdsOrReply(client *c, sds value){
         addReplyError(c,"invalid geometry");
         return NULL;
     }
+    if (geomIsSimplePoint(g)){
+        geomRect r = geomBounds(g);
+        if (!validLonLat(r.min.x, r.min.y)){
+            geomFree(g);
+            addReplyError(c,"invalid longitude/latitude pair");
+            return NULL;
+        }
+    }
     sds gvalue = sdsnewlen(g,sz);
     geomFree(g);
     return gvalue;
 }
 
+/* rewriteValueArgument replaces the geometry at argument 'j' with its
+ * decoded WKB, taking the ownership of 'value', so that the AOF and the 
+ * slaves don't parse WKT or GeoJSON again. */
+static void rewriteValueArgument(client *c, int j, sds value){
+    sds arg = c->argv[j]->ptr;
+    if (sdsEncodedObject(c->argv[j]) && sdslen(arg) == sdslen(value) &&
+        !memcmp(arg, value, sdslen(value)))
+    {
+        sdsfree(value);
+        return;
+    }
+    robj *wkb = createObject(OBJ_STRING, value);
+    rewriteClientCommandArgument(c, j, wkb);
+    decrRefCount(wkb);
+}
+
 /* ====================================================================
  * Commands
  * ==================================================================== */
 
+/* The options of GSET. */
+typedef struct gsetOptions {
+    long long when;     // expire as an absolute unix time in ms, or -1.
+    int expirepos;      // index of the expire argument, or 0.
+    int ifnewer;        // only write when 'stamp' is newer.
+    long long stamp;
+    int get;            // reply with the previous geometry.
+    sds attrs;          // packed attributes, or NULL.
+} gsetOptions;
+
+/* Parse the options of GSET starting at argument 'j'. */
+static int parseGsetOptionsOrReply(client *c, int j, gsetOptions *opts){
+    opts->when = -1;
+    opts->expirepos = 0;
+    opts->ifnewer = 0;
+    opts->stamp = 0;
+    opts->get = 0;
+    opts->attrs = NULL;
+    while (j < c->argc){
+        if (!strcasecmp(c->argv[j]->ptr,"fields")){
+            // FIELDS takes all the remaining arguments.
+            if ((opts->attrs = parseAttributesOrReply(c,j+1)) == NULL) return C_ERR;
+            return C_OK;
+        }
+        if (!strcasecmp(c->argv[j]->ptr,"get") && !opts->get){
+            opts->get = 1;
+            j++;
+            continue;
+        }
+        if (!strcasecmp(c->argv[j]->ptr,"ifnewer") && !opts->ifnewer && j+1 < c->argc){
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],&opts->stamp,NULL) != C_OK) return C_ERR;
+            opts->ifnewer = 1;
+            j += 2;
+            continue;
+        }
+        int ex = !strcasecmp(c->argv[j]->ptr,"ex");
+        int px = !strcasecmp(c->argv[j]->ptr,"px");
+        int pxat = !strcasecmp(c->argv[j]->ptr,"pxat");
+        long long n;
+        if ((!ex && !px && !pxat) || opts->expirepos || j+1 >= c->argc){
+            addReply(c,shared.syntaxerr);
+            return C_ERR;
+        }
+        if (getLongLongFromObjectOrReply(c,c->argv[j+1],&n,NULL) != C_OK) return C_ERR;
+        if (n <= 0){
+            addReplyError(c,"invalid expire time in gset");
+            return C_ERR;
+        }
+        opts->when = ex ? mstime()+n*1000 : px ? mstime()+n : n;
+        opts->expirepos = j;
+        j += 2;
+    }
+    return C_OK;
+}
+
+// GSET key field geometry [EX seconds|PX milliseconds|PXAT unix-time-ms]
+//   [IFNEWER timestamp] [GET] [FIELDS name value [name value ...]]
+//
+// The geometry is propagated to the AOF and the slaves as WKB, whatever 
+// the format it was given in.
+//
+// With an expire the field is deleted once the time is reached, like with
+// GDEL, so the fences of the key are notified. FIELDS attaches numeric 
+// attributes that GSEARCH can filter on with WHERE, it must be the last 
+// option. Writing the field again drops the expire, the timestamp and the
+// attributes that are not given again.
+//
+// IFNEWER only writes the field if it has no timestamp yet, or an older
+// one, so that out of order updates are dropped. The reply is then nil 
+// instead of 1 or 0. GET replies with an array of the usual reply and the
+// geometry the field had before the command, or nil.
 void gsetCommand(client *c) {
-    int update;
+    int update = 0, rejected;
     robj *o;
-    sds value;
-    if ((o = spatialTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
-    if ((value = decodeSdsOrReply(c,c->argv[3]->ptr)) == NULL) return;
-    update = spatialTypeSet(o,c->argv[2]->ptr,value, 1);
-    sdsfree(value);
-    addReply(c, update ? shared.czero : shared.cone);
-    signalModifiedKey(c->db,c->argv[1]);
-    notifyKeyspaceEvent(NOTIFY_HASH,"gset",c->argv[1],c->db->id);
-    server.dirty++;
+    sds value, prev = NULL;
+    long long stamp;
+    gsetOptions opts;
+    if (parseGsetOptionsOrReply(c,4,&opts) != C_OK) return;
+    if ((o = spatialTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) goto done;
+    if (opts.get){
+        prev = hashTypeGetNewSds(((spatial*)o->ptr)->h,c->argv[2]->ptr);
+    }
+    // the timestamp is checked before the geometry is even decoded.
+    rejected = opts.ifnewer && 
+        spatialTypeGetStamp(o,c->argv[2]->ptr,&stamp) && stamp >= opts.stamp;
+    if (!rejected){
+        if ((value = decodeSdsOrReply(c,c->argv[3]->ptr)) == NULL) {
+            // don't leave behind the empty key created above.
+            if (spatialTypeLength(o) == 0) dbDelete(c->db,c->argv[1]);
+            goto done;
+        }
+        update = spatialTypeSet(o,c->argv[2]->ptr,value, 1);
+        rewriteValueArgument(c,3,value);
+        if (opts.attrs){
+            spatialTypeSetAttributes(o,c->argv[2]->ptr,opts.attrs);
+            opts.attrs = NULL;
+        }
+        if (opts.ifnewer){
+            spatialTypeSetStamp(o,c->argv[2]->ptr,opts.stamp);
+        }
+        if (opts.when != -1){
+            spatialTypeSetExpire(o,c->argv[2]->ptr,opts.when);
+            spatialTrackExpires(c->db,c->argv[1],o);
+            /* Propagate the absolute time, so that the AOF and the slaves 
+             * expire the field at the same time. */
+            if (strcasecmp(c->argv[opts.expirepos]->ptr,"pxat")){
+                robj *pxat = createStringObject("PXAT",4);
+                robj *at = createStringObjectFromLongLong(opts.when);
+                rewriteClientCommandArgument(c,opts.expirepos,pxat);
+                rewriteClientCommandArgument(c,opts.expirepos+1,at);
+                decrRefCount(pxat);
+                decrRefCount(at);
+            }
+        }
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"gset",c->argv[1],c->db->id);
+        server.dirty++;
+    }
+    if (opts.get) addReplyMultiBulkLen(c,2);
+    if (rejected){
+        addReply(c,shared.nullbulk);
+    } else {
+        addReply(c,update ? shared.czero : shared.cone);
+    }
+    if (opts.get){
+        if (prev){
+            addGeomReplyBulkCBuffer(c,prev,sdslen(prev));
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+    }
+done:
+    if (prev) sdsfree(prev);
+    if (opts.attrs) sdsfree(opts.attrs);
 }
 
 void ggetCommand(client *c) {
@@ -946,7 +3168,7 @@ void gdelCommand(client *c) {
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_SPATIAL)) return;
     for (j = 2; j < c->argc; j++) {
-        if (spatialTypeDelete(o, c->argv[j]->ptr, NULL, 1)) {
+        if (spatialTypeDelete(o, c->argv[j]->ptr, 1)) {
             deleted++;
             if (spatialTypeLength(o) == 0) {
                 dbDelete(c->db,c->argv[1]);
@@ -966,11 +3188,299 @@ void gdelCommand(client *c) {
     addReplyLongLong(c,deleted);
 }
 
+// GFIELDS key field
+//
+// Returns the attributes of a field as a list of names and values.
+void gfieldsCommand(client *c) {
+    robj *o;
+    sds *argv;
+    int argc, j;
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
+        checkType(c,o,OBJ_SPATIAL)) return;
+    if (fieldIsStale(o->ptr,c->argv[2]->ptr)) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+    argv = spatialTypeGetAttributesArgv(o,c->argv[2]->ptr,&argc);
+    addReplyMultiBulkLen(c,argc);
+    for (j = 0; j < argc; j++) {
+        addReplyBulkCBuffer(c,argv[j],sdslen(argv[j]));
+    }
+    if (argv) sdsfreesplitres(argv,argc);
+}
+
+static void gttlGenericCommand(client *c, int output_ms) {
+    robj *o;
+    long long when, ttl;
+
+    o = lookupKeyRead(c->db,c->argv[1]);
+    if (o != NULL && o->type != OBJ_SPATIAL) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    if (o == NULL || !spatialTypeExists(o,c->argv[2]->ptr) ||
+        fieldIsStale(o->ptr,c->argv[2]->ptr)) {
+        addReplyLongLong(c,-2);
+        return;
+    }
+    when = spatialTypeGetExpire(o,c->argv[2]->ptr);
+    if (when == -1) {
+        addReplyLongLong(c,-1);
+        return;
+    }
+    ttl = when-mstime();
+    if (ttl < 0) ttl = 0;
+    addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+}
+
+// GINDEX key [TYPE RTREE|GRID [step]] [FIELDS ON|OFF] 
+//             [ENCODING WKB|PACKED [precision]]
+//
+// Sets the index options of a key. Without options returns the ones that
+// differ from the defaults.
+//
+// TYPE GRID keeps the points of the key in a geohash grid, with cells of
+// the given step (12 by default), which is cheaper to update than the 
+// R-tree for points that move all the time. Other geometries and points
+// beyond the geohash latitude limits stay in the R-tree. Changing the type
+// rebuilds the index.
+//
+// ENCODING PACKED stores the values as varint deltas of coordinates that
+// are rounded to the given number of decimals (7 by default, about 1cm in
+// degrees), which is often a few times smaller than WKB. Values that would
+// not be smaller stay in WKB. Changing the encoding rewrites the values.
+void gindexCommand(client *c) {
+    robj *o;
+    sds *argv;
+    const char *err;
+    int argc, j;
+
+    if (c->argc == 2) {
+        if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
+            checkType(c,o,OBJ_SPATIAL)) return;
+        argv = spatialTypeGetIndexArgv(o,&argc);
+        addReplyMultiBulkLen(c,argc);
+        for (j = 0; j < argc; j++) {
+            addReplyBulkCBuffer(c,argv[j],sdslen(argv[j]));
+        }
+        if (argv) sdsfreesplitres(argv,argc);
+        return;
+    }
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) == NULL) {
+        addReplyError(c,"no such key");
+        return;
+    }
+    if (checkType(c,o,OBJ_SPATIAL)) return;
+    argc = c->argc-2;
+    argv = zmalloc(sizeof(sds)*argc);
+    for (j = 0; j < argc; j++) {
+        argv[j] = c->argv[j+2]->ptr;
+    }
+    if (setIndexOptions(o->ptr,argc,argv,&err) != C_OK) {
+        addReplyError(c,err);
+    } else {
+        signalModifiedKey(c->db,c->argv[1]);
+        server.dirty++;
+        addReply(c,shared.ok);
+    }
+    zfree(argv);
+}
+
+/* ====================================================================
+ * Memory accounting, see GINFO
+ * ==================================================================== */
+
+#define GINFO_SAMPLES_DEFAULT 5
+
+typedef size_t (*entrySizeProc)(dictEntry *de);
+
+/* sharedKeySize is for the dicts whose keys are owned by a skiplist. */
+static size_t sharedKeySize(dictEntry *de){
+    UNUSED(de);
+    return 0;
+}
+
+static size_t sdsKeySize(dictEntry *de){
+    return sdsAllocSize(dictGetKey(de));
+}
+
+static size_t sdsKeyValSize(dictEntry *de){
+    return sdsAllocSize(dictGetKey(de))+sdsAllocSize(dictGetVal(de));
+}
+
+static size_t gridCellSize(dictEntry *de){
+    gridCell *cell = dictGetVal(de);
+    return sizeof(gridCell)+sizeof(gridEntry)*cell->cap;
+}
+
+static size_t retiredFieldSize(dictEntry *de){
+    retiredField *rf = dictGetVal(de);
+    return sizeof(retiredField)+sdsAllocSize(rf->field)+sdsAllocSize(rf->value)+
+        (rf->attrs ? sdsAllocSize(rf->attrs) : 0);
+}
+
+/* dictMemory estimates the bytes used by a dict from the average size of 
+ * its first 'samples' entries, or of all of them when it's zero, the way
+ * MEMORY USAGE does for the other types. */
+static size_t dictMemory(dict *d, long samples, entrySizeProc entrySize){
+    size_t bytes = sizeof(dict)+(d->ht[0].size+d->ht[1].size)*sizeof(dictEntry*);
+    size_t sampled = 0;
+    long n = 0;
+    dictIterator *di;
+    dictEntry *de;
+    if (dictSize(d) == 0){
+        return bytes;
+    }
+    di = dictGetIterator(d);
+    while ((samples == 0 || n < samples) && (de = dictNext(di)) != NULL){
+        sampled += sizeof(dictEntry)+entrySize(de);
+        n++;
+    }
+    dictReleaseIterator(di);
+    return bytes+(size_t)((double)sampled/n*dictSize(d));
+}
+
+static size_t hashMemory(robj *h, long samples){
+    if (h->encoding == OBJ_ENCODING_ZIPLIST){
+        return sizeof(robj)+ziplistBlobLen(h->ptr);
+    }
+    return sizeof(robj)+dictMemory(h->ptr, samples, sdsKeyValSize);
+}
+
+/* zslMemory estimates the bytes used by a skiplist that owns its elements.
+ * The nodes don't know their level, they are taken to have the average 
+ * level of 1/(1-ZSKIPLIST_P). */
+static size_t zslMemory(zskiplist *zsl, long samples){
+    size_t node = sizeof(zskiplistNode)+(size_t)(sizeof(struct zskiplistLevel)/(1-ZSKIPLIST_P));
+    size_t bytes = sizeof(zskiplist)+sizeof(zskiplistNode)+
+        sizeof(struct zskiplistLevel)*ZSKIPLIST_MAXLEVEL;
+    size_t sampled = 0;
+    long n = 0;
+    zskiplistNode *x;
+    if (zsl->length == 0){
+        return bytes;
+    }
+    for (x = zsl->header->level[0].forward; x && (samples == 0 || n < samples); x = x->level[0].forward){
+        sampled += node+sdsAllocSize(x->ele);
+        n++;
+    }
+    return bytes+(size_t)((double)sampled/n*zsl->length);
+}
+
+static size_t fencesMemory(spatial *s){
+    size_t bytes = sizeof(fence*)*s->fcap;
+    for (int i=0;i<s->flen;i++){
+        bytes += sizeof(fence)+s->fences[i]->sz;
+    }
+    return bytes;
+}
+
+static void addReplyInfoLong(client *c, long *count, const char *name, long long value){
+    addReplyBulkCString(c, name);
+    addReplyLongLong(c, value);
+    (*count)++;
+}
+
+static void addReplyInfoDouble(client *c, long *count, const char *name, double value){
+    addReplyBulkCString(c, name);
+    addReplyDouble(c, value);
+    (*count)++;
+}
+
+// GINFO key [SAMPLES count]
+//
+// GINFO reports the size of a key and of each of the structures it's made 
+// of, for capacity planning. The R-tree figures come from counters kept by
+// the tree. The bytes of the hashes and other dicts are estimated from 
+// 'count' of their entries, 5 by default, and all of them with zero.
+void ginfoCommand(client *c) {
+    long long samples = GINFO_SAMPLES_DEFAULT;
+    rtreeStats stats;
+    spatial *s;
+    robj *o;
+    const char *names[] = {
+        "hash_bytes", "keyhash_bytes", "idxhash_bytes", "rtree_bytes", 
+        "grid_bytes", "fences_bytes", "expires_bytes", "attributes_bytes", 
+        "fields_index_bytes", "stamps_bytes", "retired_bytes",
+        "write_times_bytes",
+    };
+    size_t bytes[sizeof(names)/sizeof(names[0])], total = 0;
+    void *replylen;
+    long count = 0;
+    size_t j;
+
+    if (c->argc == 4 && !strcasecmp(c->argv[2]->ptr,"samples")) {
+        if (getLongLongFromObjectOrReply(c,c->argv[3],&samples,NULL) != C_OK) return;
+        if (samples < 0) {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    } else if (c->argc != 2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
+        checkType(c,o,OBJ_SPATIAL)) return;
+    s = o->ptr;
+    rtreeGetStats(s->tr, &stats);
+
+    bytes[0] = hashMemory(s->h, samples);
+    bytes[1] = hashMemory(s->keyhash, samples);
+    bytes[2] = hashMemory(s->idxhash, samples);
+    bytes[3] = stats.bytes;
+    bytes[4] = s->grid ? dictMemory(s->grid, samples, gridCellSize) : 0;
+    bytes[5] = fencesMemory(s);
+    bytes[6] = s->expires ? dictMemory(s->expires, samples, sdsKeySize)+zslMemory(s->ezsl, samples) : 0;
+    bytes[7] = s->attrs ? dictMemory(s->attrs, samples, sdsKeyValSize) : 0;
+    bytes[8] = s->fzsl ? zslMemory(s->fzsl, samples) : 0;
+    bytes[9] = s->stamps ? dictMemory(s->stamps, samples, sdsKeySize) : 0;
+    bytes[10] = s->retired ? dictMemory(s->retired, samples, retiredFieldSize) : 0;
+    bytes[11] = s->wtimes ? dictMemory(s->wtimes, samples, sharedKeySize)+zslMemory(s->wzsl, samples) : 0;
+    total = sizeof(robj)+sizeof(spatial)+(s->scratch ? sdsAllocSize(s->scratch) : 0);
+    for (j = 0; j < sizeof(names)/sizeof(names[0]); j++) {
+        total += bytes[j];
+    }
+
+    replylen = addDeferredMultiBulkLength(c);
+    addReplyInfoLong(c,&count,"objects",hashTypeLength(s->h));
+    addReplyInfoLong(c,&count,"rtree_objects",stats.count);
+    addReplyInfoLong(c,&count,"grid_objects",s->grid ? s->gridlen : 0);
+    addReplyInfoLong(c,&count,"grid_cells",s->grid ? dictSize(s->grid) : 0);
+    addReplyInfoLong(c,&count,"rtree_height",stats.height);
+    addReplyInfoLong(c,&count,"rtree_nodes",stats.nodes);
+    addReplyInfoDouble(c,&count,"rtree_fill",stats.fill);
+    addReplyInfoLong(c,&count,"rtree_searches",stats.searches);
+    addReplyInfoDouble(c,&count,"rtree_avg_node_visits",
+        stats.searches ? (double)stats.visits/stats.searches : 0);
+    addReplyInfoLong(c,&count,"fences",s->flen);
+    addReplyInfoLong(c,&count,"volatile_fields",s->expires ? dictSize(s->expires) : 0);
+    addReplyInfoLong(c,&count,"fields_with_attributes",s->attrs ? dictSize(s->attrs) : 0);
+    addReplyInfoLong(c,&count,"search_cursors",s->ncursors);
+    addReplyInfoLong(c,&count,"retired_fields",s->retired ? dictSize(s->retired) : 0);
+    addReplyInfoLong(c,&count,"encoding_precision",s->precision);
+    addReplyInfoLong(c,&count,"total_bytes",total);
+    for (j = 0; j < sizeof(names)/sizeof(names[0]); j++) {
+        addReplyInfoLong(c,&count,names[j],bytes[j]);
+    }
+    setDeferredMultiBulkLength(c,replylen,count*2);
+}
+
+// GTTL key field
+void gttlCommand(client *c) {
+    gttlGenericCommand(c,0);
+}
+
+// GPTTL key field
+void gpttlCommand(client *c) {
+    gttlGenericCommand(c,1);
+}
+
 void glenCommand(client *c) {
     robj *o;
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_SPATIAL)) return;
-    addReplyLongLong(c,spatialTypeLength(o));
+    addReplyLongLong(c,spatialTypeLength(o)-staleLength(o->ptr));
 }
 
 void gstrlenCommand(client *c) {
@@ -978,6 +3488,10 @@ void gstrlenCommand(client *c) {
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_SPATIAL)) return;
+    if (fieldIsStale(o->ptr,c->argv[2]->ptr)) {
+        addReply(c,shared.czero);
+        return;
+    }
     addReplyLongLong(c,spatialTypeGetValueLength(o,c->argv[2]->ptr));
 }
 
@@ -1006,38 +3520,277 @@ void gsetnxCommand(client *c) {
     }
 }
 
+/* A field written by spatialTypeSetBatch(). */
+typedef struct batchItem {
+    uint64_t hilbert;
+    long pos;           // position in the command, the last write wins.
+    const char *field;
+    size_t flen;
+    const void *value;
+    size_t vlen;
+} batchItem;
+
+static int batchFieldCompare(const void *a, const void *b){
+    const batchItem *i1 = a, *i2 = b;
+    int cmp = memcmp(i1->field, i2->field, i1->flen < i2->flen ? i1->flen : i2->flen);
+    if (cmp == 0 && i1->flen != i2->flen){
+        cmp = i1->flen < i2->flen ? -1 : 1;
+    }
+    if (cmp == 0){
+        cmp = i1->pos < i2->pos ? -1 : 1;
+    }
+    return cmp;
+}
+
+static int batchHilbertCompare(const void *a, const void *b){
+    const batchItem *i1 = a, *i2 = b;
+    if (i1->hilbert != i2->hilbert){
+        return i1->hilbert < i2->hilbert ? -1 : 1;
+    }
+    return 0;
+}
+
+/* spatialTypeSetBatch writes many fields at once. They are written in the
+ * order of their position on a Hilbert curve, so that consecutive inserts
+ * go to the same R-tree nodes, and a field given more than once is only
+ * written with its last value. The values must be valid geometries. 
+ * Returns the number of new fields. */
+static long spatialTypeSetBatch(robj *o, batchItem *items, long n, int notify){
+    long i, j, added = 0;
+    for (i=0;i<n;i++){
+        geomCoord c = geomCenter((geom)items[i].value);
+        items[i].hilbert = geoutilHilbert(c.y, c.x);
+        items[i].pos = i;
+    }
+    qsort(items, n, sizeof(batchItem), batchFieldCompare);
+    for (i=0, j=0;i<n;i++){
+        if (i+1 < n && items[i].flen == items[i+1].flen &&
+            !memcmp(items[i].field, items[i+1].field, items[i].flen))
+        {
+            continue;
+        }
+        items[j++] = items[i];
+    }
+    n = j;
+    qsort(items, n, sizeof(batchItem), batchHilbertCompare);
+    sds field = sdsempty(), value = sdsempty();
+    for (i=0;i<n;i++){
+        field = sdscpylen(field, items[i].field, items[i].flen);
+        value = sdscpylen(value, items[i].value, items[i].vlen);
+        if (!spatialTypeSet(o, field, value, notify)){
+            added++;
+        }
+    }
+    sdsfree(field);
+    sdsfree(value);
+    return added;
+}
+
+// GMSET key field geometry [field geometry ...]
+//
+// All the geometries are decoded before anything is written, and written
+// with spatialTypeSetBatch(). Like with GSET they are propagated as WKB.
 void gmsetCommand(client *c) {
-    int i;
+    int i, n;
     robj *o;
     if ((c->argc % 2) == 1) {
         addReplyError(c,"wrong number of arguments for GMSET");
         return;
     }
-    if ((o = spatialTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
-    for (i = 2; i < c->argc; i += 2) {
-        geom g = NULL;
-        int sz = 0;
-        geomErr err = geomDecode(c->argv[i+1]->ptr, sdslen(c->argv[i+1]->ptr), 0, &g, &sz);
-        if (err!=GEOM_ERR_NONE){
-            addReplyError(c,"invalid geometry");
-            return;
-        }
-        sds value = sdsnewlen(g, sz);
-        geomFree(g);
-        spatialTypeSet(o,c->argv[i+0]->ptr,value,1);
-        sdsfree(value);
+    n = (c->argc-2)/2;
+    batchItem *items = zmalloc(sizeof(batchItem)*n);
+    sds *values = zcalloc(sizeof(sds)*n);
+    for (i = 0; i < n; i++) {
+        if ((values[i] = decodeSdsOrReply(c,c->argv[2+i*2+1]->ptr)) == NULL) goto done;
+        items[i].field = c->argv[2+i*2]->ptr;
+        items[i].flen = sdslen(c->argv[2+i*2]->ptr);
+        items[i].value = values[i];
+        items[i].vlen = sdslen(values[i]);
+    }
+    if ((o = spatialTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) goto done;
+    spatialTypeSetBatch(o,items,n,1);
+    for (i = 0; i < n; i++) {
+        rewriteValueArgument(c,2+i*2+1,values[i]);
+        values[i] = NULL;
     }
     addReply(c, shared.ok);
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_HASH,"gset",c->argv[1],c->db->id);
-    server.dirty++;
+    server.dirty += n;
+done:
+    for (i = 0; i < n; i++) {
+        if (values[i]) sdsfree(values[i]);
+    }
+    zfree(values);
+    zfree(items);
+}
+
+// GMSETPOINTS key BINARY records
+//
+// Writes points packed as consecutive records made of the field length as
+// a 32 bit unsigned integer, the field, and the longitude and latitude as
+// doubles, all little endian. This skips the parsing of the geometries, 
+// the points are written like with GMSET. Returns the number of new 
+// fields.
+void gmsetpointsCommand(client *c) {
+    robj *o;
+    long n = 0, cap = 0, added;
+    batchItem *items = NULL;
+    char *buf = NULL;
+
+    if (strcasecmp(c->argv[2]->ptr,"binary")) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    unsigned char *p = c->argv[3]->ptr;
+    unsigned char *end = p+sdslen(c->argv[3]->ptr);
+    // the WKB of the points are built in a single buffer, which is only 
+    // pointed to once it stopped moving.
+    while (p < end) {
+        uint32_t flen;
+        double xy[2];
+        if (end-p < 4) goto invalid;
+        memcpy(&flen,p,4);
+        memrev32ifbe(&flen);
+        if ((size_t)(end-p-4) < (size_t)flen+16) goto invalid;
+        memcpy(xy,p+4+flen,16);
+        memrev64ifbe(&xy[0]);
+        memrev64ifbe(&xy[1]);
+        if (!validLonLat(xy[0],xy[1])) goto invalid;
+        if (n == cap) {
+            cap = cap ? cap*2 : 64;
+            items = zrealloc(items,sizeof(batchItem)*cap);
+            buf = zrealloc(buf,GEOM_POINT_SIZE*cap);
+        }
+        geomCoord coord = { xy[0], xy[1], 0, 0 };
+        geomWritePoint(coord,buf+GEOM_POINT_SIZE*n);
+        items[n].field = (char*)p+4;
+        items[n].flen = flen;
+        items[n].vlen = GEOM_POINT_SIZE;
+        n++;
+        p += 4+flen+16;
+    }
+    if (n == 0) goto invalid;
+    for (long i = 0; i < n; i++) {
+        items[i].value = buf+GEOM_POINT_SIZE*i;
+    }
+    if ((o = spatialTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) goto done;
+    added = spatialTypeSetBatch(o,items,n,1);
+    addReplyLongLong(c,added);
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(NOTIFY_HASH,"gset",c->argv[1],c->db->id);
+    server.dirty += n;
+    goto done;
+invalid:
+    addReplyError(c,"invalid packed points");
+done:
+    zfree(items);
+    zfree(buf);
+}
+
+/* The key being rebuilt by GLOADFIELDS. It's added to the database once
+ * all its fields are in, or when another command is loaded. */
+static struct {
+    spatialLoader *sl;
+    redisDb *db;
+    sds key;
+    long long remaining;
+} pendingLoad;
+
+/* spatialFlushPendingLoad adds the key being rebuilt by GLOADFIELDS to its
+ * database. */
+void spatialFlushPendingLoad(void){
+    if (!pendingLoad.sl){
+        return;
+    }
+    robj *o = spatialLoaderFinish(pendingLoad.sl);
+    robj *key = createObject(OBJ_STRING, pendingLoad.key);
+    dbAdd(pendingLoad.db, key, o);
+    decrRefCount(key);
+    pendingLoad.sl = NULL;
+    pendingLoad.db = NULL;
+    pendingLoad.key = NULL;
+}
+
+/* gloadfieldsError aborts the loading of an AOF with a GLOADFIELDS that
+ * can't be applied. Replying to the AOF client would silently drop the
+ * rest of the key, so this is handled like any other corrupted AOF. */
+static void gloadfieldsError(const char *err) {
+    serverLog(LL_WARNING,"Bad GLOADFIELDS reading the append only file: %s. "
+        "Make a backup of your AOF file, then use ./redis-check-aof --fix "
+        "<filename>", err);
+    exit(1);
+}
+
+// GLOADFIELDS key total field value bounds [field value bounds ...]
+//
+// Rebuilds a key written by an AOF rewrite, with 'total' fields in one or 
+// more commands. The values are stored as they are and 'bounds' are the 
+// two or four little endian doubles of the index entry, so nothing is 
+// parsed, fences are not notified and the index is packed once all the 
+// fields are in. It's only valid while loading the AOF.
+void gloadfieldsCommand(client *c) {
+    long long total;
+    double rect[4];
+
+    if (!server.loading) {
+        addReplyError(c,"GLOADFIELDS is only valid when loading the AOF");
+        return;
+    }
+    if ((c->argc-3)%3 != 0) {
+        gloadfieldsError("wrong number of arguments");
+    }
+    if (getLongLongFromObject(c->argv[2],&total) != C_OK) {
+        gloadfieldsError("invalid number of fields");
+    }
+    if (pendingLoad.sl && (pendingLoad.db != c->db ||
+        sdscmp(pendingLoad.key,c->argv[1]->ptr)))
+    {
+        spatialFlushPendingLoad();
+    }
+    if (!pendingLoad.sl) {
+        if (lookupKeyWrite(c->db,c->argv[1]) != NULL) {
+            gloadfieldsError("target key already exists");
+        }
+        pendingLoad.sl = spatialLoaderNew(total > 0 ? total : 0);
+        pendingLoad.db = c->db;
+        pendingLoad.key = sdsdup(c->argv[1]->ptr);
+        pendingLoad.remaining = total;
+    }
+    for (int j = 3; j < c->argc; j += 3) {
+        sds bounds = c->argv[j+2]->ptr;
+        int n = sdslen(bounds)/sizeof(double);
+        if ((n != 2 && n != 4) || sdslen(bounds)%sizeof(double)) {
+            gloadfieldsError("invalid bounds");
+        }
+        memcpy(rect,bounds,sdslen(bounds));
+        for (int i = 0; i < n; i++) {
+            memrev64ifbe(&rect[i]);
+        }
+        if (n == 2) {
+            rect[2] = rect[0];
+            rect[3] = rect[1];
+        }
+        if (spatialLoaderAdd(pendingLoad.sl,sdsdup(c->argv[j]->ptr),
+                             sdsdup(c->argv[j+1]->ptr),rect) != C_OK)
+        {
+            gloadfieldsError("duplicate field");
+        }
+        pendingLoad.remaining--;
+    }
+    if (pendingLoad.remaining <= 0) {
+        spatialFlushPendingLoad();
+    }
+    server.dirty += (c->argc-3)/3;
+    addReply(c,shared.ok);
 }
 
 void genericGgetallCommand(client *c, int flags) {
     robj *o;
     hashTypeIterator *hi;
     int multiplier = 0;
-    int length, count = 0;
+    int length = 0, count = 0;
+    void *replylen = NULL;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL
         || checkType(c,o,OBJ_SPATIAL)) return;
@@ -1045,11 +3798,23 @@ void genericGgetallCommand(client *c, int flags) {
     if (flags & OBJ_HASH_KEY) multiplier++;
     if (flags & OBJ_HASH_VALUE) multiplier++;
 
-    length = spatialTypeLength(o) * multiplier;
-    addReplyMultiBulkLen(c, length);
+    /* A slave skips the fields that are past due, which may grow while
+     * replying, so the length is only known at the end. */
+    if (staleLength(o->ptr)) {
+        replylen = addDeferredMultiBulkLength(c);
+    } else {
+        length = spatialTypeLength(o) * multiplier;
+        addReplyMultiBulkLen(c, length);
+    }
 
     hi = hashTypeInitIterator(((spatial*)(o->ptr))->h);
     while (hashTypeNext(hi) != C_ERR) {
+        if (replylen) {
+            sds field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            int skip = fieldIsStale(o->ptr,field);
+            sdsfree(field);
+            if (skip) continue;
+        }
         if (flags & OBJ_HASH_KEY) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
             count++;
@@ -1060,7 +3825,11 @@ void genericGgetallCommand(client *c, int flags) {
         }
     }
     hashTypeReleaseIterator(hi);
-    serverAssert(count == length);
+    if (replylen) {
+        setDeferredMultiBulkLength(c, replylen, count);
+    } else {
+        serverAssert(count == length);
+    }
 }
 
 void gkeysCommand(client *c) {
@@ -1081,7 +3850,8 @@ void gexistsCommand(client *c) {
         checkType(c,o,OBJ_SPATIAL)) return;
     h = spatialGetHash(o);
 
-    addReply(c, hashTypeExists(h,c->argv[2]->ptr) ? shared.cone : shared.czero);
+    addReply(c, hashTypeExists(h,c->argv[2]->ptr) &&
+        !fieldIsStale(o->ptr,c->argv[2]->ptr) ? shared.cone : shared.czero);
 }
 
 void gscanCommand(client *c) {
@@ -1111,6 +3881,174 @@ static int strieq(const char *str1, const char *str2){
 
 
 
+/* searchCell returns the aggregation cell of a lon/lat position, which is
+ * either the tile x,y pair or the geohash depending on the output. */
+static sds searchCell(searchContext *ctx, double x, double y){
+    if (ctx->output == OUTPUT_GRID){
+        int32_t tile[2];
+        int tx, ty;
+        bingLatLonToTileXY(y, x, ctx->precision, &tx, &ty);
+        tile[0] = tx;
+        tile[1] = ty;
+        return sdsnewlen(tile, sizeof(tile));
+    }
+    char hash[32];
+    hashEncode(y, x, ctx->precision, hash);
+    return sdsnew(hash);
+}
+
+/* addSearchCell adds 'count' to a cell. The cell is owned by the function. */
+static void addSearchCell(searchContext *ctx, sds cell, uint64_t count){
+    dictEntry *de = dictFind(ctx->cells, cell);
+    if (de){
+        dictSetUnsignedIntegerVal(de, dictGetUnsignedIntegerVal(de)+count);
+        sdsfree(cell);
+        return;
+    }
+    de = dictAddRaw(ctx->cells, cell);
+    dictSetUnsignedIntegerVal(de, count);
+}
+
+/* searchNodeIterator is called for every R-tree node that intersects the
+ * search bounds. A node that is strictly inside of a BOUNDS area has all of
+ * its items matching, so its item count is added without visiting the 
+ * items. For GRID and HASHCOUNT the whole node rect must also fall in a 
+ * single cell. */
+static int searchNodeIterator(double minX, double minY, double maxX, double maxY, int count, void *userdata){
+    searchContext *ctx = userdata;
+    if (minX <= ctx->bounds.min.x || minY <= ctx->bounds.min.y ||
+        maxX >= ctx->bounds.max.x || maxY >= ctx->bounds.max.y){
+        return 0;
+    }
+    if (!ctx->cells){
+        ctx->len += count;
+        return 1;
+    }
+    sds min = searchCell(ctx, minX, minY);
+    sds max = searchCell(ctx, maxX, maxY);
+    if (sdscmp(min, max) != 0){
+        sdsfree(min);
+        sdsfree(max);
+        return 0;
+    }
+    sdsfree(max);
+    addSearchCell(ctx, min, count);
+    return 1;
+}
+
+/* matchWhere returns true when the attributes of a field are within the 
+ * ranges of all the WHERE clauses. Missing attributes never match. */
+static int matchWhere(searchContext *ctx, sds attrs){
+    if (!attrs){
+        return 0;
+    }
+    for (int i=0;i<ctx->nwhere;i++){
+        whereClause *w = &ctx->where[i];
+        double value;
+        if (!attrsGet(attrs, w->name, sdslen(w->name), &value) ||
+            value < w->min || value > w->max)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int searchField(searchContext *ctx, char *field, int fieldLen, int checkBounds);
+static int searchValue(searchContext *ctx, char *field, int fieldLen, char *value, int valueLen, int checkBounds);
+
+/* fieldIndexSeek returns the first node of the sorted field index that is
+ * not lower than 'str', in sdscmp() order. */
+static zskiplistNode *fieldIndexSeek(zskiplist *zsl, const char *str, size_t len){
+    zskiplistNode *x = zsl->header;
+    for (int i=zsl->level-1;i>=0;i--){
+        while (x->level[i].forward){
+            sds ele = x->level[i].forward->ele;
+            size_t elen = sdslen(ele);
+            int cmp = memcmp(ele, str, elen < len ? elen : len);
+            if (cmp > 0 || (cmp == 0 && elen >= len)){
+                break;
+            }
+            x = x->level[i].forward;
+        }
+    }
+    return x->level[0].forward;
+}
+
+/* searchFieldIndex answers the search from the field names when the MATCH
+ * pattern narrows them down better than the area does. An exact name is a
+ * single lookup, a prefix walks the sorted field index, when enabled, as 
+ * long as it's shorter than the R-tree estimate for the area, which assumes
+ * the objects are evenly spread over the bounds of the tree. Returns 0 when
+ * the R-tree must be searched instead. */
+static int searchFieldIndex(searchContext *ctx){
+    spatial *s = ctx->s;
+    if (ctx->cells || ctx->output == OUTPUT_COUNT || ctx->matcher.kind == PATTERN_ALL){
+        return 0;
+    }
+    if (ctx->matcher.kind == PATTERN_EXACT){
+        searchField(ctx, (char*)ctx->matcher.lit, ctx->matcher.llen, 1);
+        return 1;
+    }
+    if (ctx->matcher.kind != PATTERN_PREFIX || !s->fzsl){
+        return 0;
+    }
+    double ratio = 1;
+    geomRect tb;
+    if (!indexBounds(s, &tb)){
+        return 1;
+    }
+    double w = fmin(tb.max.x, ctx->bounds.max.x)-fmax(tb.min.x, ctx->bounds.min.x);
+    double h = fmin(tb.max.y, ctx->bounds.max.y)-fmax(tb.min.y, ctx->bounds.min.y);
+    if (w < 0 || h < 0){
+        return 1;
+    }
+    double area = (tb.max.x-tb.min.x)*(tb.max.y-tb.min.y);
+    if (area > 0){
+        ratio = (w*h)/area;
+    }
+    double estimate = ratio*indexCount(s);
+
+    const char *prefix = ctx->matcher.lit;
+    size_t plen = ctx->matcher.llen;
+    zskiplistNode *first = fieldIndexSeek(s->fzsl, prefix, plen), *zn;
+    double n = 0;
+    for (zn = first; zn && n < estimate; zn = zn->level[0].forward){
+        if (sdslen(zn->ele) < plen || memcmp(zn->ele, prefix, plen)){
+            break;
+        }
+        n++;
+    }
+    if (n >= estimate){
+        return 0;
+    }
+    for (zn = first; zn && !ctx->fail; zn = zn->level[0].forward){
+        if (sdslen(zn->ele) < plen || memcmp(zn->ele, prefix, plen)){
+            break;
+        }
+        searchField(ctx, zn->ele, sdslen(zn->ele), 1);
+    }
+    return 1;
+}
+
+/* resultField returns the field read from idxhash as a string that stays
+ * valid until the reply is sent. Ziplists return the fields that look 
+ * like integers as 'vll', which are formatted into the context. */
+static char *resultField(searchContext *ctx, unsigned char *vstr, unsigned int vlen, long long vll, int *fieldLen){
+    if (vstr){
+        *fieldLen = vlen;
+        return (char*)vstr;
+    }
+    if (!ctx->intfields){
+        ctx->intfields = listCreate();
+        listSetFreeMethod(ctx->intfields, (void (*)(void*))sdsfree);
+    }
+    sds field = sdsfromlonglong(vll);
+    listAddNodeTail(ctx->intfields, field);
+    *fieldLen = sdslen(field);
+    return field;
+}
+
 static int searchIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
     (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
 
@@ -1127,13 +4065,35 @@ static int searchIterator(double minX, double minY, double maxX, double maxY, vo
     if (res == C_ERR){
         return 1;
     }
-    if (!(ctx->allfields || 
-        stringmatchlen(ctx->pattern,sdslen(ctx->pattern),(const char*)vstr,vlen,0))) {
+    int fieldLen;
+    char *field = resultField(ctx, vstr, vlen, vll, &fieldLen);
+    if (!(ctx->allfields || matchFieldPattern(&ctx->matcher,field,fieldLen))) {
+        return 1;
+    }
+    return searchField(ctx, field, fieldLen, 0);
+}
+
+/* searchField matches a single field against the search and collects it.
+ * The field must stay valid until the reply is sent. Fields that do not
+ * come from the R-tree must be checked against the search bounds. */
+static int searchField(searchContext *ctx, char *field, int fieldLen, int checkBounds){
+    unsigned char *vstr = NULL;
+    unsigned int vlen = UINT_MAX;
+    long long vll = LLONG_MAX;
+    int res;
+
+    if (ctx->anchor && sdslen(ctx->anchor) == (size_t)fieldLen && 
+        !memcmp(ctx->anchor, field, fieldLen)) {
+        return 1;
+    }
+    sds sfield = sdsnewlen(field, fieldLen);
+
+    // the attributes are checked before the geometry is even retrieved.
+    if ((ctx->nwhere && !matchWhere(ctx, spatialGetAttributes(ctx->s, sfield))) ||
+        fieldIsStale(ctx->s, sfield)){
+        sdsfree(sfield);
         return 1;
     }
-    char *field = (char*)vstr;
-    int fieldLen = vlen;
-    sds sfield = sdsnewlen(field, fieldLen);
 
 
     // retreive the geom
@@ -1142,15 +4102,38 @@ static int searchIterator(double minX, double minY, double maxX, double maxY, vo
     if (res == C_ERR){
         return 1;
     }
-    char *value = (char*)vstr;
-    int valueLen = vlen;
+    return searchValue(ctx, field, fieldLen, (char*)vstr, vlen, checkBounds);
+}
 
-    geom g = (geom)value;
+/* searchValue matches the value of a field against the search and collects
+ * it. Both must stay valid until the reply is sent. */
+static int searchValue(searchContext *ctx, char *field, int fieldLen, char *value, int valueLen, int checkBounds){
+    geom g = valueGeom(value, valueLen, &ctx->s->scratch, NULL);
+    if (!g){
+        return 1;
+    }
 
+    if (checkBounds){
+        geomRect r = geomBounds(g);
+        if (r.min.x > ctx->bounds.max.x || r.max.x < ctx->bounds.min.x ||
+            r.min.y > ctx->bounds.max.y || r.max.y < ctx->bounds.min.y)
+        {
+            return 1;
+        }
+    }
     int match = matchSearch(g, ctx->m, ctx->targetType, ctx->searchType, ctx->center, ctx->meters);
     if (!match){
         return 1;
     }
+    if (ctx->cells){
+        geomCoord center = geomCenter(g);
+        addSearchCell(ctx, searchCell(ctx, center.x, center.y), 1);
+        return 1;
+    }
+    if (ctx->output == OUTPUT_COUNT){
+        ctx->len++;
+        return 1;
+    }
     // append item
     if (ctx->len == ctx->cap){
         int ncap = ctx->cap;
@@ -1183,51 +4166,63 @@ static void addInvalidSearchReplyError(client *c){
 #define CHECKON(which) \
     if ((which)){ \
         addInvalidSearchReplyError(c); \
-        goto done; \
+        return C_ERR; \
     } \
     (which) = 1;
 
-// GSEARCH key 
-//   [WITHIN|INTERSECTS] 
-//   [CURSOR cursor]
-//   [MATCH pattern]
-//   [FENCE]
-//   [OUTPUT COUNT|FIELD|WKT|WKB|JSON|POINT|BOUNDS|(HASH precision)|(QUAD level)|(TILE z)]
-//   (MEMBER key field)|
-//      (BOUNDS minlon minlat maxlon maxlat)|
-//      (GEOMETRY wkt|wkb|json)|
-//      (TILE x y z)|
-//      (QUAD key)|
-//      (HASH geohash)
-//      (RADIUS lon lat meters)
-void gsearchCommand(client *c){
-    robj *o;
-    searchContext ctx;
-    memset(&ctx, 0, sizeof(searchContext));
-    ctx.c = c;
-    ctx.releaseg = 1;
-    ctx.searchType = INTERSECTS;
-    ctx.cursor = -1;
-    ctx.allfields = 1;
-    ctx.output = OUTPUT_WKT;
-    int i = 2;
+static void initSearchContext(client *c, searchContext *ctx){
+    memset(ctx, 0, sizeof(searchContext));
+    ctx->c = c;
+    ctx->releaseg = 1;
+    ctx->searchType = INTERSECTS;
+    ctx->cursor = -1;
+    ctx->allfields = 1;
+    ctx->output = OUTPUT_WKT;
+}
+
+static void freeSearchContext(searchContext *ctx){
+    if (ctx->g&&ctx->releaseg){
+        geomFree(ctx->g);
+    }
+    if (ctx->m){
+        geomFreePolyMap(ctx->m);
+    }
+    if (ctx->results){
+        zfree(ctx->results);
+    }
+    if (ctx->cells){
+        dictRelease(ctx->cells);
+    }
+    if (ctx->where){
+        zfree(ctx->where);
+    }
+    if (ctx->intfields){
+        listRelease(ctx->intfields);
+    }
+}
 
+/* parseSearchArgs parses the search options of GSEARCH and GFENCE, 
+ * starting at argument 'i'. On error a reply is sent to the client and
+ * C_ERR is returned. Either way the context must be freed with
+ * freeSearchContext(). */
+static int parseSearchArgs(client *c, int i, searchContext *ctx){
     int typeon = 0;
     int cursoron = 0;
     int geomon = 0;
     int matchon = 0;
     int outputon = 0;
     int fenceon = 0;
+    int counton = 0;
     
     for (;i<c->argc;){
         /* TYPE */
         if (strieq(c->argv[i]->ptr, "within")){
             CHECKON(typeon);
-            ctx.searchType = WITHIN;
+            ctx->searchType = WITHIN;
             i++;
         } else if (strieq(c->argv[i]->ptr, "intersects")){
             CHECKON(typeon);
-            ctx.searchType = INTERSECTS;
+            ctx->searchType = INTERSECTS;
             i++;
         } 
         /* MATCH */
@@ -1235,92 +4230,137 @@ void gsearchCommand(client *c){
             CHECKON(matchon);
             if (i>=c->argc-1){
                 addReplyError(c, "need match pattern");
-                goto done;
+                return C_ERR;
             }
-            ctx.pattern = c->argv[i+1]->ptr;
-            ctx.allfields = (ctx.pattern[0] == '*' && ctx.pattern[1] == '\0');
+            ctx->pattern = c->argv[i+1]->ptr;
+            compileFieldPattern(&ctx->matcher, ctx->pattern, sdslen(ctx->pattern));
+            ctx->allfields = ctx->matcher.kind == PATTERN_ALL;
             i+=2;
         }
+        /* WHERE */
+        else if (strieq(c->argv[i]->ptr, "where")){
+            if (i>=c->argc-3){
+                addReplyError(c, "need where field, min, max");
+                return C_ERR;
+            }
+            whereClause w;
+            w.name = c->argv[i+1]->ptr;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &w.min, "need numeric min") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &w.max, "need numeric max") != C_OK) return C_ERR;
+            ctx->where = zrealloc(ctx->where, (ctx->nwhere+1)*sizeof(whereClause));
+            ctx->where[ctx->nwhere++] = w;
+            i+=4;
+        }
         /* FENCE */
         else if (strieq(c->argv[i]->ptr, "fence")){
             CHECKON(fenceon);
-            // if (i>=c->argc-1){
-            //     addReplyError(c, "need fence type");
-            //     goto done;
-            // }
-            // if (!strieq(c->argv[i+1]->ptr, "all")){
-            //     addReplyError(c, "fence type must be 'all'");
-            //     goto done;
-            // }
-            ctx.fence = FENCE_ALL;
+            ctx->fence = FENCE_ALL;
+            i+=1;
+        }
+        /* PAYLOAD */
+        else if (strieq(c->argv[i]->ptr, "payload")){
+            CHECKON(ctx->payload);
+            i+=1;
+        }
+        /* BATCH */
+        else if (strieq(c->argv[i]->ptr, "batch")){
+            CHECKON(ctx->batch);
             i+=1;
         }
         /* OUTPUT */
         else if (strieq(c->argv[i]->ptr, "output")){
             CHECKON(outputon);
             if (i>=c->argc-1){
-                addReplyError(c, "need output type (count,field,wkt,wkb,json,point,bounds,hash)");
-                goto done;
+                addReplyError(c, "need output type (count,field,wkt,wkb,json,point,bounds,hash,quad,tile,grid,hashcount)");
+                return C_ERR;
             }
             if (strieq(c->argv[i+1]->ptr, "count")){
-                ctx.output = OUTPUT_COUNT;
+                ctx->output = OUTPUT_COUNT;
             } else if (strieq(c->argv[i+1]->ptr, "field")){
-                ctx.output = OUTPUT_FIELD;
+                ctx->output = OUTPUT_FIELD;
             } else if (strieq(c->argv[i+1]->ptr, "wkt")){
-                ctx.output = OUTPUT_WKT;
+                ctx->output = OUTPUT_WKT;
             } else if (strieq(c->argv[i+1]->ptr, "wkb")){
-                ctx.output = OUTPUT_WKB;
+                ctx->output = OUTPUT_WKB;
             } else if (strieq(c->argv[i+1]->ptr, "json")){
-                ctx.output = OUTPUT_JSON;
+                ctx->output = OUTPUT_JSON;
             } else if (strieq(c->argv[i+1]->ptr, "point")){
-                ctx.output = OUTPUT_POINT;
+                ctx->output = OUTPUT_POINT;
             } else if (strieq(c->argv[i+1]->ptr, "bounds")){
-                ctx.output = OUTPUT_BOUNDS;
+                ctx->output = OUTPUT_BOUNDS;
             } else if (strieq(c->argv[i+1]->ptr, "hash")){
-                ctx.output = OUTPUT_HASH;
+                ctx->output = OUTPUT_HASH;
                 if (i>=c->argc-2){
                     addReplyError(c, "need hash precision");
-                    goto done;
+                    return C_ERR;
                 }
                 long precision = 0;
-                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric precision") != C_OK) return;
+                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric precision") != C_OK) return C_ERR;
                 if (precision < 1 || precision > 22){
                     addReplyError(c, "invalid hash precision");
-                    goto done;
+                    return C_ERR;
                 }
-                ctx.precision = (int)precision;
+                ctx->precision = (int)precision;
                 i++;
             } else if (strieq(c->argv[i+1]->ptr, "quad")){
-                ctx.output = OUTPUT_QUAD;
+                ctx->output = OUTPUT_QUAD;
                 if (i>=c->argc-2){
                     addReplyError(c, "need quad level");
-                    goto done;
+                    return C_ERR;
                 }
                 long precision = 0;
-                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric level") != C_OK) return;
+                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric level") != C_OK) return C_ERR;
                 if (precision < 1 || precision > 22){
                     addReplyError(c, "invalid quad level");
-                    goto done;
+                    return C_ERR;
                 }
-                ctx.precision = (int)precision;
+                ctx->precision = (int)precision;
                 i++;
             } else if (strieq(c->argv[i+1]->ptr, "tile")){
-                ctx.output = OUTPUT_TILE;
+                ctx->output = OUTPUT_TILE;
                 if (i>=c->argc-2){
                     addReplyError(c, "need tile z");
-                    goto done;
+                    return C_ERR;
+                }
+                long precision = 0;
+                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric z") != C_OK) return C_ERR;
+                if (precision < 1 || precision > 22){
+                    addReplyError(c, "invalid tile z");
+                    return C_ERR;
+                }
+                ctx->precision = (int)precision;
+                i++;
+            } else if (strieq(c->argv[i+1]->ptr, "grid")){
+                ctx->output = OUTPUT_GRID;
+                if (i>=c->argc-3 || !strieq(c->argv[i+2]->ptr, "tile")){
+                    addReplyError(c, "need grid tile z");
+                    return C_ERR;
                 }
                 long precision = 0;
-                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric z") != C_OK) return;
+                if (getLongFromObjectOrReply(c, c->argv[i+3], &precision, "need numeric z") != C_OK) return C_ERR;
                 if (precision < 1 || precision > 22){
                     addReplyError(c, "invalid tile z");
-                    goto done;
+                    return C_ERR;
+                }
+                ctx->precision = (int)precision;
+                i+=2;
+            } else if (strieq(c->argv[i+1]->ptr, "hashcount")){
+                ctx->output = OUTPUT_HASHCOUNT;
+                if (i>=c->argc-2){
+                    addReplyError(c, "need hash precision");
+                    return C_ERR;
+                }
+                long precision = 0;
+                if (getLongFromObjectOrReply(c, c->argv[i+2], &precision, "need numeric precision") != C_OK) return C_ERR;
+                if (precision < 1 || precision > 22){
+                    addReplyError(c, "invalid hash precision");
+                    return C_ERR;
                 }
-                ctx.precision = (int)precision;
+                ctx->precision = (int)precision;
                 i++;
             } else {
                 addInvalidSearchReplyError(c);
-                goto done;
+                return C_ERR;
             }
             i+=2;
         }
@@ -1329,149 +4369,502 @@ void gsearchCommand(client *c){
             CHECKON(cursoron);
             if (i>=c->argc-1){
                 addReplyError(c, "need cursor");
-                goto done;
+                return C_ERR;
             }
-            if (getLongLongFromObjectOrReply(c, c->argv[i+1], &ctx.cursor, "need numeric cursor") != C_OK) return;
-            if (ctx.cursor < 0){
+            if (getLongLongFromObjectOrReply(c, c->argv[i+1], &ctx->cursor, "need numeric cursor") != C_OK) return C_ERR;
+            if (ctx->cursor < 0){
                 addReplyError(c, "invalid cursor");
-                goto done;
+                return C_ERR;
             }
             i+=2;
         } 
+        /* COUNT */
+        else if (strieq(c->argv[i]->ptr, "count")){
+            CHECKON(counton);
+            if (i>=c->argc-1){
+                addReplyError(c, "need count");
+                return C_ERR;
+            }
+            long long count;
+            if (getLongLongFromObjectOrReply(c, c->argv[i+1], &count, "need numeric count") != C_OK) return C_ERR;
+            if (count < 1 || count > SEARCH_CURSOR_COUNT_MAX){
+                addReplyError(c, "invalid count");
+                return C_ERR;
+            }
+            ctx->count = count;
+            i+=2;
+        }
         /* GEOM */
         else if (strieq(c->argv[i]->ptr, "radius")){
             CHECKON(geomon);
             if (i>=c->argc-3){
                 addReplyError(c, "need longitude, latitude, meters");
-                goto done;
+                return C_ERR;
             }
-            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &ctx.center.x, "need numeric longitude") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &ctx.center.y, "need numeric latitude") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &ctx.meters, "need numeric meters") != C_OK) return;
-            if (ctx.center.x < -180 || ctx.center.x > 180 || ctx.center.y < -90 || ctx.center.y > 90){
+            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &ctx->center.x, "need numeric longitude") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &ctx->center.y, "need numeric latitude") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &ctx->meters, "need numeric meters") != C_OK) return C_ERR;
+            if (!validLonLat(ctx->center.x, ctx->center.y)){
                 addReplyError(c, "invalid longitude/latitude pair");
-                goto done;
+                return C_ERR;
             }
-            ctx.targetType = RADIUS;
-            ctx.bounds = geoutilBoundsFromLatLon(ctx.center.y, ctx.center.x, ctx.meters);
-            ctx.g = geomNewCirclePolygon(ctx.center, ctx.meters, 12, &ctx.sz);
+            ctx->targetType = RADIUS;
+            ctx->bounds = geoutilBoundsFromLatLon(ctx->center.y, ctx->center.x, ctx->meters);
+            ctx->g = geomNewCirclePolygon(ctx->center, ctx->meters, 12, &ctx->sz);
             i+=4;
         } else if (strieq(c->argv[i]->ptr, "geom") || strieq(c->argv[i]->ptr, "geometry")){
             CHECKON(geomon);
             if (i==c->argc-1){
                 addReplyError(c, "need geometry");
-                goto done; 
+                return C_ERR; 
             }
             geom g = NULL;
             int sz = 0;
             geomErr err = geomDecode(c->argv[i+1]->ptr, sdslen(c->argv[i+1]->ptr), 0, &g, &sz);
             if (err!=GEOM_ERR_NONE){
                 addReplyError(c, "invalid geometry");
-                goto done;
+                return C_ERR;
             }
-            ctx.g = g;
-            ctx.sz = sz;
-            ctx.targetType = GEOMETRY;
-            ctx.bounds = geomBounds(ctx.g);
+            ctx->g = g;
+            ctx->sz = sz;
+            ctx->targetType = GEOMETRY;
+            ctx->bounds = geomBounds(ctx->g);
             i+=2;
         } else if (strieq(c->argv[i]->ptr, "bounds")){
             CHECKON(geomon);
             if (i>=c->argc-4){
                 addReplyError(c, "need min longitude, min latitude, max longitude, max latitude");
-                goto done;
+                return C_ERR;
             }
-            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &ctx.bounds.min.x, "need numeric min longitude") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &ctx.bounds.min.y, "need numeric min latitude") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &ctx.bounds.max.x, "need numeric max longitude") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+4], &ctx.bounds.max.y, "need numeric max latitude") != C_OK) return;
-            if (ctx.bounds.min.x < -180 || ctx.bounds.min.x > 180 || ctx.bounds.min.y < -90 || ctx.bounds.min.y > 90 ||
-                ctx.bounds.max.x < -180 || ctx.bounds.max.x > 180 || ctx.bounds.max.y < -90 || ctx.bounds.max.y > 90 ||
-                ctx.bounds.min.x > ctx.bounds.max.x || ctx.bounds.min.y > ctx.bounds.max.y){
+            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &ctx->bounds.min.x, "need numeric min longitude") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &ctx->bounds.min.y, "need numeric min latitude") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &ctx->bounds.max.x, "need numeric max longitude") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+4], &ctx->bounds.max.y, "need numeric max latitude") != C_OK) return C_ERR;
+            if (ctx->bounds.min.x < -180 || ctx->bounds.min.x > 180 || ctx->bounds.min.y < -90 || ctx->bounds.min.y > 90 ||
+                ctx->bounds.max.x < -180 || ctx->bounds.max.x > 180 || ctx->bounds.max.y < -90 || ctx->bounds.max.y > 90 ||
+                ctx->bounds.min.x > ctx->bounds.max.x || ctx->bounds.min.y > ctx->bounds.max.y){
                 addReplyError(c, "invalid longitude/latitude pairs");
-                goto done;
+                return C_ERR;
             }
-            ctx.targetType = BOUNDS;
-            ctx.g = geomNewRectPolygon(ctx.bounds, &ctx.sz);
+            ctx->targetType = BOUNDS;
+            ctx->g = geomNewRectPolygon(ctx->bounds, &ctx->sz);
             i+=5;
         } else if (strieq(c->argv[i]->ptr, "tile")){
             CHECKON(geomon);
             if (i>=c->argc-3){
                 addReplyError(c, "need x,y,z");
-                goto done;
+                return C_ERR;
             }
             double x,y,z;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &x, "need numeric x") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &y, "need numeric y") != C_OK) return;
-            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &z, "need numeric z") != C_OK) return;
-            bingTileXYToBounds(x,y,z, &ctx.bounds.min.y, &ctx.bounds.min.x, &ctx.bounds.max.y, &ctx.bounds.max.x);
-            ctx.targetType = BOUNDS;
-            ctx.g = geomNewRectPolygon(ctx.bounds, &ctx.sz);
+            if (getDoubleFromObjectOrReply(c, c->argv[i+1], &x, "need numeric x") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &y, "need numeric y") != C_OK) return C_ERR;
+            if (getDoubleFromObjectOrReply(c, c->argv[i+3], &z, "need numeric z") != C_OK) return C_ERR;
+            bingTileXYToBounds(x,y,z, &ctx->bounds.min.y, &ctx->bounds.min.x, &ctx->bounds.max.y, &ctx->bounds.max.x);
+            ctx->targetType = BOUNDS;
+            ctx->g = geomNewRectPolygon(ctx->bounds, &ctx->sz);
             i+=4;
         } else if (strieq(c->argv[i]->ptr, "quad")){
             CHECKON(geomon);
             if (i>=c->argc-1){
                 addReplyError(c, "need key");
-                goto done;
+                return C_ERR;
             }
-            if (!bingQuadKeyToBounds(c->argv[i+1]->ptr, &ctx.bounds.min.y, &ctx.bounds.min.x, &ctx.bounds.max.y, &ctx.bounds.max.x)){
+            if (!bingQuadKeyToBounds(c->argv[i+1]->ptr, &ctx->bounds.min.y, &ctx->bounds.min.x, &ctx->bounds.max.y, &ctx->bounds.max.x)){
                 addReplyError(c, "invalid quad key");
-                goto done;
+                return C_ERR;
             }
-            ctx.targetType = BOUNDS;
-            ctx.g = geomNewRectPolygon(ctx.bounds, &ctx.sz);
+            ctx->targetType = BOUNDS;
+            ctx->g = geomNewRectPolygon(ctx->bounds, &ctx->sz);
             i+=2;
         } else if (strieq(c->argv[i]->ptr, "hash")){
             CHECKON(geomon);
             if (i>=c->argc-1){
                 addReplyError(c, "need hash");
-                goto done;
+                return C_ERR;
             }
             if (!hashBounds(c->argv[i+1]->ptr, 
-                    &ctx.bounds.min.y, &ctx.bounds.min.x, 
-                    &ctx.bounds.max.y, &ctx.bounds.max.x)
+                    &ctx->bounds.min.y, &ctx->bounds.min.x, 
+                    &ctx->bounds.max.y, &ctx->bounds.max.x)
             ){
                 addReplyError(c, "invalid hash");
-                goto done;   
+                return C_ERR;   
             }
-            ctx.targetType = BOUNDS;    
-            ctx.g = geomNewRectPolygon(ctx.bounds, &ctx.sz);
+            ctx->targetType = BOUNDS;    
+            ctx->g = geomNewRectPolygon(ctx->bounds, &ctx->sz);
             i+=2;
+        } else if (strieq(c->argv[i]->ptr, "nearby")){
+            CHECKON(geomon);
+            if (i>=c->argc-2){
+                addReplyError(c, "need field, meters");
+                return C_ERR;
+            }
+            if (getDoubleFromObjectOrReply(c, c->argv[i+2], &ctx->meters, "need numeric meters") != C_OK) return C_ERR;
+            if (ctx->meters < 0){
+                addReplyError(c, "invalid meters");
+                return C_ERR;
+            }
+            ctx->anchor = c->argv[i+1]->ptr;
+            ctx->targetType = NEARBY;
+            i+=3;
         } else if (strieq(c->argv[i]->ptr, "member")){
             CHECKON(geomon);
             if (i>=c->argc-2){
                 addReplyError(c, "need member key, field");
-                goto done;
+                return C_ERR;
             }
             robj *o2 = lookupKeyRead(c->db, c->argv[i+1]);
             if (o2 == NULL){
                 addReplyError(c, "member is not available in database");
-                goto done;
+                return C_ERR;
             }
             if (o2 != NULL && o2->type != OBJ_SPATIAL) {
                 addReplyError(c, "member key is holding the wrong kind of value");
-                goto done;
+                return C_ERR;
             }
             robj *h2 = spatialGetHash(o2);
-            sds value = hashTypeGetRaw(h2, c->argv[i+2]->ptr);
-            if (value==NULL){
+            unsigned char *vstr = NULL;
+            unsigned int vlen = UINT_MAX;
+            long long vll = LLONG_MAX;
+            // small hashes are ziplist encoded, the value is not an sds.
+            if (hashTypeGetValue(h2, c->argv[i+2]->ptr, &vstr, &vlen, &vll) == C_ERR || !vstr){
                 addReplyError(c, "member is not available in database");
-                goto done;
+                return C_ERR;
+            }
+            if (geomIsPacked(vstr, vlen)){
+                if (geomDecode(vstr, vlen, 0, &ctx->g, &ctx->sz) != GEOM_ERR_NONE){
+                    addReplyError(c, "member is not available in database");
+                    return C_ERR;
+                }
+            } else {
+                ctx->releaseg=0;
+                ctx->g = (geom)vstr;
+                ctx->sz = vlen;
             }
-            ctx.releaseg=0;
-            ctx.g = (geom)value;
-            ctx.sz = sdslen(value);
-            ctx.targetType = GEOMETRY;
-            ctx.bounds = geomBounds(ctx.g);
+            ctx->memberpos=i;
+            ctx->targetType = GEOMETRY;
+            ctx->bounds = geomBounds(ctx->g);
             i+=3;
         } else {
-            addReplyError(c, "invalid arguments for 'gsearch' command");
-            return;
+            addInvalidSearchReplyError(c);
+            return C_ERR;
+        }
+    }
+    if (ctx->fence){
+        if (ctx->output == OUTPUT_GRID || ctx->output == OUTPUT_HASHCOUNT){
+            addReplyError(c, "GRID and HASHCOUNT are not valid with FENCE");
+            return C_ERR;
+        }
+        if (ctx->nwhere){
+            addReplyError(c, "WHERE is not valid with FENCE");
+            return C_ERR;
+        }
+        // the entries of a batch are separated by newlines, which is only
+        // safe with the JSON of PAYLOAD as field names are binary.
+        if (ctx->batch && !ctx->payload){
+            addReplyError(c, "BATCH requires PAYLOAD");
+            return C_ERR;
+        }
+    }
+    if (ctx->count || ctx->cursor > 0){
+        if (ctx->fence || ctx->output == OUTPUT_COUNT || 
+            ctx->output == OUTPUT_GRID || ctx->output == OUTPUT_HASHCOUNT)
+        {
+            addReplyError(c, "CURSOR and COUNT are only valid with searches that list objects");
+            return C_ERR;
+        }
+        if (!ctx->count){
+            ctx->count = SEARCH_CURSOR_COUNT_DEFAULT;
         }
     }
+    return C_OK;
+}
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL) {
-        if (!ctx.fence){
-           goto done;
+/* A search cursor walks a snapshot of the index of a key, one page per
+ * GSEARCH call, while the key keeps being written. The R-tree nodes it can
+ * reach are copied by the tree before they change, see rtreeCursorNew(),
+ * and the grid points in the area are copied when it's opened. Cursors are
+ * released when they are exhausted, when the key goes away or after being
+ * left idle for SEARCH_CURSOR_TIMEOUT. */
+typedef struct searchCursor {
+    unsigned long long id;
+    spatial *s;
+    rtreeCursor *rc;
+    gridEntry *points;  // grid points in the area, NULL without a grid.
+    long npoints, pos;
+    geomRect bounds;    // the area, and the NEARBY center, when opened.
+    geomCoord center;
+    mstime_t atime;     // last time it was used.
+} searchCursor;
+
+/* The cursors are keyed by id, stored in the key pointer itself. */
+static dictType searchCursorDictType = {
+    gridHashKey,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static dict *searchCursors = NULL;
+static unsigned long long searchCursorsNextId = 1;
+
+static int collectGridPoint(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+    (void)(maxX);(void)(maxY); // unused vars.
+    searchCursor *cur = userdata;
+    if (cur->npoints == cur->pos){
+        cur->pos = cur->pos ? cur->pos*2 : 16;
+        cur->points = zrealloc(cur->points, sizeof(gridEntry)*cur->pos);
+    }
+    cur->points[cur->npoints].x = minX;
+    cur->points[cur->npoints].y = minY;
+    cur->points[cur->npoints].item = item;
+    cur->npoints++;
+    return 1;
+}
+
+static searchCursor *openSearchCursor(spatial *s, geomRect bounds, geomCoord center){
+    searchCursor *cur = zcalloc(sizeof(searchCursor));
+    cur->rc = rtreeCursorNew(s->tr, bounds.min.x, bounds.min.y, bounds.max.x, bounds.max.y);
+    if (!cur->rc){
+        zfree(cur);
+        return NULL;
+    }
+    if (s->grid){
+        // 'pos' holds the capacity of the array while collecting.
+        gridSearch(s, bounds.min.x, bounds.min.y, bounds.max.x, bounds.max.y, collectGridPoint, cur);
+        cur->pos = 0;
+    }
+    if (!searchCursors){
+        searchCursors = dictCreate(&searchCursorDictType, NULL);
+    }
+    cur->id = searchCursorsNextId++;
+    cur->s = s;
+    cur->bounds = bounds;
+    cur->center = center;
+    cur->atime = mstime();
+    dictAdd(searchCursors, (void*)cur->id, cur);
+    s->ncursors++;
+    return cur;
+}
+
+static searchCursor *lookupSearchCursor(unsigned long long id){
+    searchCursor *cur;
+    if (!searchCursors || (cur = dictFetchValue(searchCursors, (void*)id)) == NULL){
+        return NULL;
+    }
+    cur->atime = mstime();
+    return cur;
+}
+
+/* releaseSearchCursor frees a cursor, along with the removed fields of its
+ * key when it's the last one. */
+static void releaseSearchCursor(searchCursor *cur){
+    spatial *s = cur->s;
+    dictDelete(searchCursors, (void*)cur->id);
+    rtreeCursorFree(cur->rc);
+    zfree(cur->points);
+    zfree(cur);
+    if (--s->ncursors == 0 && s->retired){
+        dictRelease(s->retired);
+        s->retired = NULL;
+    }
+}
+
+static void releaseSpatialCursors(spatial *s){
+    dictIterator *di = dictGetSafeIterator(searchCursors);
+    dictEntry *de;
+    while (s->ncursors && (de = dictNext(di)) != NULL){
+        searchCursor *cur = dictGetVal(de);
+        if (cur->s == s){
+            releaseSearchCursor(cur);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/* spatialSearchCursorsCron releases the cursors left idle for too long. */
+void spatialSearchCursorsCron(void){
+    if (!searchCursors || dictSize(searchCursors) == 0){
+        return;
+    }
+    mstime_t now = mstime();
+    dictIterator *di = dictGetSafeIterator(searchCursors);
+    dictEntry *de;
+    while ((de = dictNext(di)) != NULL){
+        searchCursor *cur = dictGetVal(de);
+        if (now-cur->atime > SEARCH_CURSOR_TIMEOUT){
+            releaseSearchCursor(cur);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/* spatialReleaseAllSearchCursors is called before the keys are freed in 
+ * the background, as cursors can't be released from another thread. */
+void spatialReleaseAllSearchCursors(void){
+    dictIterator *di;
+    dictEntry *de;
+    if (!searchCursors){
+        return;
+    }
+    di = dictGetSafeIterator(searchCursors);
+    while ((de = dictNext(di)) != NULL){
+        releaseSearchCursor(dictGetVal(de));
+    }
+    dictReleaseIterator(di);
+}
+
+unsigned long spatialSearchCursorsLength(void){
+    return searchCursors ? dictSize(searchCursors) : 0;
+}
+
+/* searchCursorItem moves a cursor to the next object and resolves it to 
+ * the field, value and attributes it had when the cursor was opened. The
+ * results stay valid until the key is written or the cursor is released,
+ * or 'ctx' is freed for fields that look like integers. Returns 0 when 
+ * the cursor is exhausted. */
+static int searchCursorItem(searchContext *ctx, searchCursor *cur, char **field, int *fieldLen, char **value, int *valueLen, sds *attrs){
+    spatial *s = cur->s;
+    double minX, minY, maxX, maxY;
+    void *item;
+    for (;;){
+        if (cur->pos < cur->npoints){
+            item = cur->points[cur->pos++].item;
+        } else if (!rtreeCursorNext(cur->rc, &minX, &minY, &maxX, &maxY, &item)){
+            return 0;
+        }
+        uint64_t nidx = (uint64_t)item;
+        sds sidx = sdsnewlen(&nidx, 8);
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+        int res = hashTypeGetValue(s->idxhash, sidx, &vstr, &vlen, &vll);
+        sdsfree(sidx);
+        if (res == C_OK){
+            *field = resultField(ctx, vstr, vlen, vll, fieldLen);
+            sds sfield = sdsnewlen(*field, *fieldLen);
+            vstr = NULL;
+            res = hashTypeGetValue(s->h, sfield, &vstr, &vlen, &vll);
+            *attrs = spatialGetAttributes(s, sfield);
+            sdsfree(sfield);
+            if (res == C_ERR || !vstr){
+                continue;
+            }
+            *value = (char*)vstr;
+            *valueLen = vlen;
+            return 1;
+        }
+        retiredField *rf = s->retired ? dictFetchValue(s->retired, item) : NULL;
+        if (!rf){
+            continue;
+        }
+        *field = rf->field;
+        *fieldLen = sdslen(rf->field);
+        *value = rf->value;
+        *valueLen = sdslen(rf->value);
+        *attrs = rf->attrs;
+        return 1;
+    }
+}
+
+/* searchCursorPage collects the next page of a cursor search. Returns 0
+ * when the cursor is exhausted. */
+static int searchCursorPage(searchContext *ctx, searchCursor *cur){
+    char *field, *value;
+    int fieldLen, valueLen;
+    sds attrs;
+    int stale = ctx->s && staleLength(ctx->s);
+    while (ctx->len < ctx->count && !ctx->fail){
+        if (!searchCursorItem(ctx, cur, &field, &fieldLen, &value, &valueLen, &attrs)){
+            return 0;
+        }
+        if (!(ctx->allfields || matchFieldPattern(&ctx->matcher, field, fieldLen))){
+            continue;
+        }
+        if (ctx->anchor && sdslen(ctx->anchor) == (size_t)fieldLen && 
+            !memcmp(ctx->anchor, field, fieldLen)){
+            continue;
+        }
+        if (ctx->nwhere && !matchWhere(ctx, attrs)){
+            continue;
+        }
+        if (stale){
+            sds sfield = sdsnewlen(field, fieldLen);
+            int skip = fieldIsStale(ctx->s, sfield);
+            sdsfree(sfield);
+            if (skip) continue;
+        }
+        searchValue(ctx, field, fieldLen, value, valueLen, 0);
+    }
+    return 1;
+}
+
+// GSEARCH key 
+//   [WITHIN|INTERSECTS] 
+//   [CURSOR cursor [COUNT count]]
+//   [MATCH pattern]
+//   [WHERE field min max ...]
+//   [FENCE [PAYLOAD] [BATCH]]
+//   [OUTPUT COUNT|FIELD|WKT|WKB|JSON|POINT|BOUNDS|(HASH precision)|(QUAD level)|(TILE z)|
+//      (GRID TILE z)|(HASHCOUNT precision)]
+//   (MEMBER key field)|
+//      (BOUNDS minlon minlat maxlon maxlat)|
+//      (GEOMETRY wkt|wkb|json)|
+//      (TILE x y z)|
+//      (QUAD key)|
+//      (HASH geohash)
+//      (RADIUS lon lat meters)
+//      (NEARBY field meters)
+//
+// NEARBY searches around another field of the key, excluding that field.
+// With FENCE it's a roaming fence that follows the field: writes to other
+// fields are notified as with RADIUS, and each time the field itself moves
+// the fields that came within range are notified as inside and the fields
+// that are now out of range as outside.
+//
+// FENCE subscribes the client to notifications for the search area. With
+// PAYLOAD each notification carries the object in the OUTPUT format, the
+// distance to the fence center and the time of the write. With BATCH the 
+// notifications of an event loop iteration are published as one message,
+// one JSON entry per line. BATCH requires PAYLOAD.
+//
+// WHERE keeps the objects that have a numeric field, as set with GSET ... 
+// FIELDS, between min and max inclusive. It may be repeated.
+//
+// GRID and HASHCOUNT aggregate the matching objects by the tile or geohash 
+// of their center and reply with [x, y, count] or [hash, count] per cell.
+//
+// COUNT pages through the objects, at most count at a time, and replies
+// with the cursor to pass to the next call along with the page. The pages
+// are taken from the key as it was at the first call, no matter what is
+// written to it in the meantime. A zero cursor ends the iteration. The 
+// search options must be the same for all the calls.
+void gsearchCommand(client *c){
+    robj *o;
+    searchContext ctx;
+    searchCursor *cur = NULL;
+    long long next = 0;
+    int exhausted = 0;
+    initSearchContext(c, &ctx);
+    if (parseSearchArgs(c, 2, &ctx) != C_OK){
+        goto done;
+    }
+
+    if ((ctx.payload || ctx.batch) && !ctx.fence){
+        addReplyError(c, "PAYLOAD and BATCH are only valid with FENCE");
+        goto done;
+    }
+
+    if ((c->flags & CLIENT_PUBSUB) && !ctx.fence){
+        addReplyError(c, "only GSEARCH with FENCE is allowed in this context");
+        goto done;
+    }
+
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        if (!ctx.fence && ctx.cursor <= 0){
+            addReply(c,shared.emptymultibulk);
+            goto done;
         }
     } else if (o->type != OBJ_SPATIAL) {
         if (!ctx.fence){
@@ -1481,7 +4874,32 @@ void gsearchCommand(client *c){
     } else {
         ctx.s = o->ptr;
     }
-    
+
+    if (ctx.cursor > 0){
+        // the area is the one of the first call, a NEARBY field may have
+        // moved since.
+        if (!ctx.s || (cur = lookupSearchCursor(ctx.cursor)) == NULL || cur->s != ctx.s){
+            addReplyError(c, "invalid cursor");
+            goto done;
+        }
+        ctx.bounds = cur->bounds;
+        ctx.center = cur->center;
+    } else if (ctx.targetType == NEARBY && !ctx.fence){
+        // search around the current position of the anchor.
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+        geom g = NULL;
+        if (!ctx.s || fieldIsStale(ctx.s, ctx.anchor) ||
+            hashTypeGetValue(ctx.s->h, ctx.anchor, &vstr, &vlen, &vll) == C_ERR || !vstr ||
+            (g = valueGeom(vstr, vlen, &ctx.s->scratch, NULL)) == NULL)
+        {
+            addReplyError(c, "nearby field is not available in database");
+            goto done;
+        }
+        ctx.center = geomCenter(g);
+        ctx.bounds = geoutilBoundsFromLatLon(ctx.center.y, ctx.center.x, ctx.meters);
+    }
     if (ctx.g&&!ctx.fence){
         ctx.m = geomNewPolyMap(ctx.g);
         if (!ctx.m){
@@ -1500,15 +4918,54 @@ void gsearchCommand(client *c){
     
 
     char output[128];
-    if (!cursoron||ctx.cursor==0){ // ATM only zero cursor is allowed
-       rtreeSearch(ctx.s->tr, ctx.bounds.min.x, ctx.bounds.min.y, ctx.bounds.max.x, ctx.bounds.max.y, searchIterator, &ctx);
+    if (ctx.output == OUTPUT_GRID || ctx.output == OUTPUT_HASHCOUNT){
+        ctx.cells = dictCreate(&setDictType, NULL);
+    }
+    if (ctx.count){
+        if (!cur && (cur = openSearchCursor(ctx.s, ctx.bounds, ctx.center)) == NULL){
+            addReplyError(c, "cursor failure");
+            goto done;
+        }
+        exhausted = !searchCursorPage(&ctx, cur);
+        next = exhausted ? 0 : (long long)cur->id;
+    } else if (!searchFieldIndex(&ctx)){
+        // counting the nodes can't skip the fields a slave hides.
+        if ((ctx.cells || ctx.output == OUTPUT_COUNT) && 
+            ctx.targetType == BOUNDS && ctx.allfields && !ctx.nwhere &&
+            staleLength(ctx.s) == 0)
+        {
+            indexSearch(ctx.s, ctx.bounds, searchNodeIterator, searchIterator, &ctx);
+        } else {
+            indexSearch(ctx.s, ctx.bounds, NULL, searchIterator, &ctx);
+        }
     }
     if (!ctx.fail){
-        if (ctx.output == OUTPUT_COUNT) {
+        if (ctx.cells) {
+            dictIterator *di = dictGetIterator(ctx.cells);
+            dictEntry *de;
+            addReplyMultiBulkLen(c, 2);
+            addReplyBulkLongLong(c, 0);
+            addReplyMultiBulkLen(c, dictSize(ctx.cells));
+            while((de = dictNext(di)) != NULL) {
+                sds cell = dictGetKey(de);
+                if (ctx.output == OUTPUT_GRID){
+                    int32_t tile[2];
+                    memcpy(tile, cell, sizeof(tile));
+                    addReplyMultiBulkLen(c, 3);
+                    addReplyLongLong(c, tile[0]);
+                    addReplyLongLong(c, tile[1]);
+                } else {
+                    addReplyMultiBulkLen(c, 2);
+                    addReplyBulkCBuffer(c, cell, sdslen(cell));
+                }
+                addReplyLongLong(c, (long long)dictGetUnsignedIntegerVal(de));
+            }
+            dictReleaseIterator(di);
+        } else if (ctx.output == OUTPUT_COUNT) {
             addReplyLongLong(c, ctx.len);
         } else {
             addReplyMultiBulkLen(c, 2);
-            addReplyBulkLongLong(c, 0); // future cursor support
+            addReplyBulkLongLong(c, next);
             if (ctx.output == OUTPUT_FIELD){
                 addReplyMultiBulkLen(c, ctx.len);
             } else {
@@ -1517,12 +4974,14 @@ void gsearchCommand(client *c){
             for (int i=0;i<ctx.len;i++){
                 addReplyBulkCBuffer(c, ctx.results[i].field, ctx.results[i].fieldLen);
                 if (ctx.output != OUTPUT_FIELD){
-                    switch (ctx.output){
+                    int sz;
+                    geom g = valueGeom(ctx.results[i].value, ctx.results[i].valueLen, &ctx.s->scratch, &sz);
+                    switch (g ? ctx.output : 0){
                     default:
                         addReplyBulkCBuffer(c, "", 0);
                         break;
                     case OUTPUT_WKT:{
-                        char *wkt = geomEncodeWKT((geom)ctx.results[i].value, 0);
+                        char *wkt = geomEncodeWKT(g, 0);
                         if (!wkt){
                             addReplyBulkCBuffer(c, "", 0);
                         } else {
@@ -1532,7 +4991,7 @@ void gsearchCommand(client *c){
                         break;
                     }
                     case OUTPUT_JSON:{
-                        char *json = geomEncodeJSON((geom)ctx.results[i].value);
+                        char *json = geomEncodeJSON(g);
                         if (!json){
                             addReplyBulkCBuffer(c, "", 0);
                         } else {
@@ -1542,17 +5001,17 @@ void gsearchCommand(client *c){
                         break;
                     }
                     case OUTPUT_WKB:
-                        addReplyBulkCBuffer(c, ctx.results[i].value, ctx.results[i].valueLen);
+                        addReplyBulkCBuffer(c, g, sz);
                         break;
                     case OUTPUT_POINT:{
-                        geomCoord center = geomCenter((geom)ctx.results[i].value);
+                        geomCoord center = geomCenter(g);
                         addReplyMultiBulkLen(c, 2);
                         addReplyDouble(c, center.x);
                         addReplyDouble(c, center.y);
                         break;
                     }
                     case OUTPUT_BOUNDS:{
-                        geomRect bounds = geomBounds((geom)ctx.results[i].value);
+                        geomRect bounds = geomBounds(g);
                         addReplyMultiBulkLen(c, 4);
                         addReplyDouble(c, bounds.min.x);
                         addReplyDouble(c, bounds.min.y);
@@ -1561,19 +5020,19 @@ void gsearchCommand(client *c){
                         break;
                     }
                     case OUTPUT_HASH:{
-                        geomCoord center = geomCenter((geom)ctx.results[i].value);
-                        hashEncode(center.x, center.y, ctx.precision, output);
+                        geomCoord center = geomCenter(g);
+                        hashEncode(center.y, center.x, ctx.precision, output);
                         addReplyBulkCBuffer(c, output, strlen(output));
                         break;
                     }
                     case OUTPUT_QUAD:{
-                        geomCoord center = geomCenter((geom)ctx.results[i].value);
+                        geomCoord center = geomCenter(g);
                         bingLatLongToQuadKey(center.y, center.x, ctx.precision, output);
                         addReplyBulkCBuffer(c, output, strlen(output));
                         break;
                     }
                     case OUTPUT_TILE:{
-                        geomCoord center = geomCenter((geom)ctx.results[i].value);
+                        geomCoord center = geomCenter(g);
                         int x, y;
                         bingLatLonToTileXY(center.y, center.x, ctx.precision, &x, &y);
                         addReplyMultiBulkLen(c, 2);
@@ -1587,17 +5046,255 @@ void gsearchCommand(client *c){
             }
         }
     }
+    // the page may point to fields that only the cursor kept.
+    if (cur && (exhausted || ctx.fail)){
+        releaseSearchCursor(cur);
+    }
+done:
+    freeSearchContext(&ctx);
+}
+
+
+
+
+static void dropNamedFence(sds name){
+    dictEntry *de = dictFind(server.named_fences, name);
+    if (!de){
+        return;
+    }
+    fence *f = dictGetVal(de);
+    dictDelete(server.named_fences, name);
+    unregisterFence(f);
+    releaseFence(f);
+}
+
+static void gfenceCreateCommand(client *c){
+    searchContext ctx;
+    fence *f;
+    robj *channel;
+    int j;
+
+    initSearchContext(c, &ctx);
+    ctx.fence = FENCE_ALL;
+    if (parseSearchArgs(c, 4, &ctx) != C_OK){
+        goto done;
+    }
+    if (!ctx.g && ctx.targetType != NEARBY){
+        addReplyError(c, "need fence area");
+        goto done;
+    }
+    channel = createStringObject(c->argv[2]->ptr, sdslen(c->argv[2]->ptr));
+    f = newFence(&ctx, channel, c->db->id, c->argv[3]->ptr);
+    decrRefCount(channel);
+    if (!f){
+        addReplyError(c, "fence failure");
+        goto done;
+    }
+
+    // keep the arguments for persistence. MEMBER refers to an object that
+    // may change or go away, so it's replaced by a copy of its geometry.
+    f->argv = zmalloc(sizeof(robj*)*(c->argc-2));
+    for (j=2;j<c->argc;j++){
+        if (ctx.memberpos && j == ctx.memberpos){
+            f->argv[f->argc++] = createStringObject("GEOMETRY", 8);
+            f->argv[f->argc++] = createStringObject((char*)ctx.g, ctx.sz);
+            j += 2;
+            continue;
+        }
+        f->argv[f->argc++] = createStringObject(c->argv[j]->ptr, 
+            sdslen(c->argv[j]->ptr));
+    }
+
+    dropNamedFence(f->channel->ptr);
+    dictAdd(server.named_fences, sdsdup(f->channel->ptr), f);
+    registerFence(f);
+
+    if (ctx.memberpos){
+        robj **argv = zmalloc(sizeof(robj*)*(f->argc+2));
+        argv[0] = createStringObject("GFENCE", 6);
+        argv[1] = createStringObject("CREATE", 6);
+        for (j=0;j<f->argc;j++){
+            argv[j+2] = f->argv[j];
+            incrRefCount(f->argv[j]);
+        }
+        replaceClientCommandVector(c, f->argc+2, argv);
+    }
+    server.dirty++;
+    addReply(c, shared.ok);
 done:
-    if (ctx.g&&ctx.releaseg){
-        geomFree(ctx.g);
+    freeSearchContext(&ctx);
+}
+
+// GFENCE CREATE name key 
+//   [WITHIN|INTERSECTS] 
+//   [MATCH pattern]
+//   [PAYLOAD] [BATCH]
+//   [OUTPUT ...]
+//   area
+// GFENCE DROP name [name ...]
+//
+// Named fences are server side fences that do not belong to a client. 
+// They are persisted and replicated, and publish their notifications to 
+// the channel 'name', thus any client may SUBSCRIBE to them. The options 
+// and the area are the same as GSEARCH ... FENCE.
+void gfenceCommand(client *c){
+    if (!strcasecmp(c->argv[1]->ptr, "create") && c->argc >= 5){
+        gfenceCreateCommand(c);
+    } else if (!strcasecmp(c->argv[1]->ptr, "drop") && c->argc >= 3){
+        long long dropped = 0;
+        for (int j=2;j<c->argc;j++){
+            if (dictFind(server.named_fences, c->argv[j]->ptr)){
+                dropNamedFence(c->argv[j]->ptr);
+                dropped++;
+            }
+        }
+        server.dirty += dropped;
+        addReplyLongLong(c, dropped);
+    } else {
+        addReplyError(c, "Unknown GFENCE subcommand or wrong number of arguments");
+    }
+}
+
+// GFENCES
+//
+// Lists the named fences of the current db, each as the arguments of the
+// GFENCE CREATE that would create it again. It's a command of its own as
+// GFENCE changes the dataset, which replicas don't accept.
+void gfencesCommand(client *c){
+    dictIterator *di = dictGetIterator(server.named_fences);
+    dictEntry *de;
+    void *replylen = addDeferredMultiBulkLength(c);
+    long count = 0;
+    while((de = dictNext(di)) != NULL) {
+        fence *f = dictGetVal(de);
+        if (f->dbid != c->db->id){
+            continue;
+        }
+        addReplyMultiBulkLen(c, f->argc);
+        for (int j=0;j<f->argc;j++){
+            addReplyBulk(c, f->argv[j]);
+        }
+        count++;
+    }
+    dictReleaseIterator(di);
+    setDeferredMultiBulkLength(c, replylen, count);
+}
+
+/* spatialForEachNamedFence calls 'proc' with the db and the arguments of 
+ * GFENCE CREATE, starting at the name, for every named fence. It's used 
+ * to persist the fences to RDB and AOF. Returns 0 as soon as 'proc' 
+ * returns 0, otherwise 1. */
+int spatialForEachNamedFence(spatialFenceProc proc, void *privdata){
+    dictIterator *di = dictGetIterator(server.named_fences);
+    dictEntry *de;
+    int ok = 1;
+    while((de = dictNext(di)) != NULL) {
+        fence *f = dictGetVal(de);
+        if (!proc(privdata, f->dbid, f->argc, f->argv)){
+            ok = 0;
+            break;
+        }
     }
-    if (ctx.m){
-        geomFreePolyMap(ctx.m);
+    dictReleaseIterator(di);
+    return ok;
+}
+
+/* spatialLoadNamedFence creates a named fence from its RDB representation,
+ * which is the db followed by the arguments of GFENCE CREATE. */
+int spatialLoadNamedFence(sds repr){
+    client *c;
+    sds *args;
+    int argc, j;
+    long long dbid;
+    int ok = 0;
+
+    args = sdssplitargs(repr, &argc);
+    if (!args){
+        return C_ERR;
     }
-    if (ctx.results){
-        zfree(ctx.results);
+    if (argc >= 4 && string2ll(args[0], sdslen(args[0]), &dbid) && 
+        dbid >= 0 && dbid < server.dbnum)
+    {
+        c = createFakeClient();
+        selectDb(c, (int)dbid);
+        c->argc = argc+1;
+        c->argv = zmalloc(sizeof(robj*)*c->argc);
+        c->argv[0] = createStringObject("GFENCE", 6);
+        c->argv[1] = createStringObject("CREATE", 6);
+        for (j=1;j<argc;j++){
+            c->argv[j+1] = createStringObject(args[j], sdslen(args[j]));
+        }
+        gfenceCommand(c);
+        ok = dictFind(server.named_fences, args[1]) != NULL;
+        freeFakeClientArgv(c);
+        freeFakeClient(c);
     }
+    sdsfreesplitres(args, argc);
+    return ok ? C_OK : C_ERR;
 }
 
+/* spatialReleaseNamedFences drops all of the named fences. Called before
+ * loading a dataset that replaces the current one. */
+void spatialReleaseNamedFences(void){
+    dictIterator *di = dictGetSafeIterator(server.named_fences);
+    dictEntry *de;
+    while((de = dictNext(di)) != NULL) {
+        dropNamedFence(dictGetKey(de));
+    }
+    dictReleaseIterator(di);
+}
 
+// fenceMemory estimates the memory used by a fence. The poly map mostly
+// points into the copy of the geometry, thus it's only counted once.
+static size_t fenceMemory(fence *f){
+    size_t mem = sizeof(fence) + sdsAllocSize(f->key) + f->sz;
+    if (f->pattern) mem += sdsAllocSize(f->pattern);
+    if (f->m) mem += sizeof(geomPolyMap);
+    if (f->batched) mem += sdsAllocSize(f->batched);
+    for (int i=0;i<f->argc;i++){
+        mem += sizeof(robj*) + sizeof(robj) + sdsAllocSize(f->argv[i]->ptr);
+    }
+    return mem;
+}
 
+/* spatialGenFencesInfoString appends the Fences section of INFO, with the
+ * number of fences and their memory usage for each key being watched. */
+sds spatialGenFencesInfoString(sds info){
+    size_t total = 0;
+    unsigned long keys = 0;
+    sds lines = sdsempty();
+
+    for (int j=0;j<server.dbnum;j++){
+        dictIterator *di = dictGetIterator(server.db[j].fences);
+        dictEntry *de;
+        while((de = dictNext(di)) != NULL) {
+            list *l = dictGetVal(de);
+            listIter li;
+            listNode *ln;
+            size_t mem = 0;
+            listRewind(l, &li);
+            while((ln = listNext(&li)) != NULL){
+                mem += fenceMemory(ln->value);
+            }
+            // keep the INFO format parsable whatever the key is.
+            sds key = sdsmapchars(sdsdup(dictGetKey(de)), ":,\r\n ", "_____", 5);
+            lines = sdscatprintf(lines, "db%d.%s:fences=%lu,memory=%zu\r\n",
+                j, key, listLength(l), mem);
+            sdsfree(key);
+            total += mem;
+            keys++;
+        }
+        dictReleaseIterator(di);
+    }
+    info = sdscatprintf(info,
+        "client_fences:%lu\r\n"
+        "named_fences:%lu\r\n"
+        "fenced_keys:%lu\r\n"
+        "fence_memory:%zu\r\n",
+        dictSize(server.fences),
+        dictSize(server.named_fences),
+        keys, total);
+    info = sdscatsds(info, lines);
+    sdsfree(lines);
+    return info;
+}
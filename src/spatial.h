@@ -14,4 +14,7 @@ void *robjSpatialGetHash(void *o);
 /* robjSpatialNewHash creates a spatial robj from a base hash. */
 void *robjSpatialNewHash(void *o);
 
+/* spatialFlushFenceBatches publishes batched fence notifications. */
+void spatialFlushFenceBatches(void);
+
 #endif
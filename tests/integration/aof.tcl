@@ -251,6 +251,36 @@ tags {"aof"} {
         }
     }
 
+    ## Test that the server exits when a GLOADFIELDS can't be applied
+    foreach {name fields err} {
+        "bounds" {a v x} "invalid bounds"
+        "duplicate" {a v AAAAAAAABBBBBBBB a v AAAAAAAABBBBBBBB} "duplicate field"
+    } {
+        create_aof {
+            append_to_aof [formatCommand set foo hello]
+            append_to_aof [formatCommand gloadfields k 2 {*}$fields]
+            append_to_aof [formatCommand set bar world]
+        }
+
+        start_server_aof [list dir $server_path aof-load-truncated yes] {
+            test "GLOADFIELDS $name: Server should have logged an error" {
+                set pattern "*Bad GLOADFIELDS reading the append only file: $err*"
+                set retry 10
+                while {$retry} {
+                    set result [exec tail -n1 < [dict get $srv stdout]]
+                    if {[string match $pattern $result]} {
+                        break
+                    }
+                    incr retry -1
+                    after 1000
+                }
+                if {$retry == 0} {
+                    error "assertion:expected error not found on config file"
+                }
+            }
+        }
+    }
+
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {Redis should not try to convert DEL into EXPIREAT for EXPIRE -1} {
             r set x 10
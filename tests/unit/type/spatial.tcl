@@ -0,0 +1,927 @@
+# Reads the next fence notification of a deferring client.
+proc spatial_fence_read {rd} {
+    lindex [$rd read] 2
+}
+
+# A roaming fence only notifies the objects that cross its edge when its
+# anchor moves, c and d are written as markers of the notifications.
+proc spatial_roaming_fence_test {} {
+    r del k
+    r gset k truck42 {POINT(0 0)}
+    r gset k a {POINT(0 0.001)}
+    r gset k b {POINT(1 1)}
+    set rd [redis_deferring_client]
+    $rd gsearch k FENCE NEARBY truck42 500
+    assert_equal subscribe [lindex [$rd read] 0]
+    r gset k truck42 {POINT(0 0.0005)}
+    r gset k c {POINT(50 50)}
+    assert_equal outside:c [spatial_fence_read $rd]
+    r gset k truck42 {POINT(1 1.001)}
+    assert_equal outside:a [spatial_fence_read $rd]
+    assert_equal inside:b [spatial_fence_read $rd]
+    r gdel k truck42
+    assert_equal outside:b [spatial_fence_read $rd]
+    r gset k d {POINT(1 1)}
+    assert_equal outside:d [spatial_fence_read $rd]
+    $rd close
+}
+
+start_server {tags {"spatial"}} {
+    test {GSEARCH OUTPUT HASH encodes the center as lat/lon} {
+        r del k
+        r gset k a {POINT(-5.6 42.6)}
+        r gsearch k OUTPUT HASH 5 BOUNDS -180 -90 180 90
+    } {0 {a ezs42}}
+
+    test {Fence PAYLOAD OUTPUT HASH encodes the center as lat/lon} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE PAYLOAD OUTPUT HASH 5 BOUNDS -180 -90 180 90
+        assert_equal subscribe [lindex [$rd read] 0]
+        r gset k a {POINT(-5.6 42.6)}
+        set msg [lindex [$rd read] 2]
+        $rd close
+        assert_match {*"object":"ezs42"*} $msg
+    }
+
+    test {Fence PAYLOAD carries the object, distance and time of the write} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE PAYLOAD OUTPUT WKT RADIUS 1 1 100000
+        assert_equal subscribe [lindex [$rd read] 0]
+        r gset k a {POINT(1 1)}
+        r gdel k a
+        set set [spatial_fence_read $rd]
+        set del [spatial_fence_read $rd]
+        $rd close
+        assert_match {{"detect":"inside","field":"a","time":*,"distance":0,"object":"POINT(1 1)"}} $set
+        assert_match {{"detect":"outside","field":"a","time":*}} $del
+    }
+
+    test {PAYLOAD and BATCH are only valid with FENCE} {
+        catch {r gsearch k PAYLOAD BOUNDS 0 0 10 10} e
+        set e
+    } {ERR PAYLOAD and BATCH are only valid with FENCE}
+
+    test {Fence BATCH requires PAYLOAD} {
+        catch {r gsearch k FENCE BATCH BOUNDS 0 0 10 10} e1
+        catch {r gfence create f1 k BATCH BOUNDS 0 0 10 10} e2
+        list $e1 $e2
+    } {{ERR BATCH requires PAYLOAD} {ERR BATCH requires PAYLOAD}}
+
+    test {Fence BATCH publishes one JSON entry per line} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE PAYLOAD BATCH OUTPUT POINT BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        r multi
+        r gset k "a\nb" {POINT(1 1)}
+        r gset k c {POINT(2 2)}
+        r exec
+        set entries [split [lindex [$rd read] 2] "\n"]
+        $rd close
+        assert_equal 2 [llength $entries]
+        assert_match {*"field":"a\\nb"*} [lindex $entries 0]
+        assert_match {*"field":"c"*} [lindex $entries 1]
+    }
+
+    test {Roaming fence notifies the objects that cross its edge} {
+        spatial_roaming_fence_test
+    }
+
+    test {GSEARCH OUTPUT COUNT counts what a full search returns} {
+        r del k
+        set script {for i=1,ARGV[1] do redis.call('gset',KEYS[1],'p'..i,'POINT('..(i%50)..' '..(i%40)..')') end}
+        r eval $script 1 k 2000
+        for {set j 0} {$j < 20} {incr j} {
+            r gset k poly$j "POLYGON(($j $j,[expr {$j+3}] $j,$j [expr {$j+3}],$j $j))"
+        }
+        foreach area {{BOUNDS -180 -90 180 90} {BOUNDS 10.5 5.5 30.5 20.5}
+                      {WITHIN BOUNDS 0 0 12 12} {RADIUS 10 10 300000}} {
+            set n [llength [lindex [r gsearch k OUTPUT FIELD {*}$area] 1]]
+            assert {$n > 0}
+            assert_equal $n [r gsearch k OUTPUT COUNT {*}$area]
+        }
+        r gsearch k OUTPUT COUNT BOUNDS -180 -90 180 90
+    } {2020}
+
+    test {GSET and GMSET are propagated with the geometry as WKB} {
+        r del k
+        set repl [attach_to_replication_stream]
+        r gset k a {POINT(1 2)}
+        r gmset k b {{"type":"Point","coordinates":[3,4]}} c {POINT(5 6)}
+        assert_replication_stream $repl {{select *}}
+        set gset [read_from_replication_stream $repl]
+        set gmset [read_from_replication_stream $repl]
+        close_replication_stream $repl
+        assert_equal [list gset k a [binary format ciqq 1 1 1 2]] $gset
+        assert_equal [list gmset k b [binary format ciqq 1 1 3 4] \
+            c [binary format ciqq 1 1 5 6]] $gmset
+    }
+
+    test {GSET WKB propagation round trips through the AOF} {
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r gset k d {POINT(7 8)}
+        r gset k a {LINESTRING(1 2,3 4)}
+        set fp [open [lindex [r config get dir] 1]/appendonly.aof r]
+        fconfigure $fp -translation binary
+        set aof [read $fp]
+        close $fp
+        assert {[string first {POINT(7 8)} $aof] == -1}
+        assert {[string first [binary format ciqq 1 1 7 8] $aof] != -1}
+        r debug loadaof
+        r config set appendonly no
+        list [r gget k a] [r gget k b] [r gget k d]
+    } {{LINESTRING(1 2,3 4)} {POINT(3 4)} {POINT(7 8)}}
+
+    test {GSEARCH NEARBY searches around a field, excluding it} {
+        r del k
+        r gset k truck {POINT(1 1)}
+        r gset k a {POINT(1.001 1)}
+        r gset k b {POINT(2 2)}
+        catch {r gsearch k NEARBY nosuchfield 1000} e
+        assert_equal {ERR nearby field is not available in database} $e
+        r gsearch k OUTPUT FIELD NEARBY truck 1000
+    } {0 a}
+
+    test {GFENCE CREATE, DROP and GFENCES} {
+        r gfence create f1 k BOUNDS 0 0 10 10
+        r gfence create f2 k PAYLOAD OUTPUT POINT RADIUS 1 1 1000
+        set fences [lsort [r gfences]]
+        assert_equal {{f1 k BOUNDS 0 0 10 10} {f2 k PAYLOAD OUTPUT POINT RADIUS 1 1 1000}} $fences
+        assert_equal 1 [r gfence drop f1 nosuchfence]
+        r gfences
+    } {{f2 k PAYLOAD OUTPUT POINT RADIUS 1 1 1000}}
+
+    test {COMMAND GETKEYS finds the key of GFENCE CREATE only} {
+        assert_equal {k} [r command getkeys gfence create f1 k BOUNDS 0 0 10 10]
+        r command getkeys gfence drop f1 f2
+    } {}
+
+    test {GFENCE publishes to the fence name, whatever client created it} {
+        r del k
+        r gfence create f1 k BOUNDS 0 0 10 10
+        set rd [redis_deferring_client]
+        $rd subscribe f1
+        assert_equal {subscribe f1 1} [$rd read]
+        r gset k a {POINT(1 1)}
+        assert_equal inside:a [spatial_fence_read $rd]
+        $rd close
+        r gfence drop f1
+    } {1}
+
+    test {A client holds many fences on one connection} {
+        r del k1 k2
+        set rd [redis_deferring_client]
+        $rd gsearch k1 FENCE BOUNDS 0 0 10 10
+        set ch1 [lindex [$rd read] 1]
+        $rd gsearch k2 FENCE BOUNDS 20 20 30 30
+        set ch2 [lindex [$rd read] 1]
+        assert {$ch1 ne $ch2}
+        r gset k1 a {POINT(1 1)}
+        r gset k2 b {POINT(25 25)}
+        assert_equal [list message $ch1 inside:a] [$rd read]
+        assert_equal [list message $ch2 inside:b] [$rd read]
+        assert_match "*client_fences:2*" [r info fences]
+        $rd close
+        wait_for_condition 50 100 {
+            [string match "*client_fences:0*" [r info fences]]
+        } else {
+            fail "Fences not dropped on disconnect"
+        }
+    }
+
+    test {INFO fences counts the fences of each key} {
+        r del k1 k2
+        foreach f [r gfences] {r gfence drop [lindex $f 0]}
+        r gfence create named k1 BOUNDS 0 0 50 50
+        set rd [redis_deferring_client]
+        $rd gsearch k1 FENCE BOUNDS 0 0 10 10
+        $rd read
+        $rd gsearch k2 FENCE BOUNDS 20 20 30 30
+        $rd read
+        set info [r info fences]
+        assert_match "*client_fences:2*" $info
+        assert_match "*named_fences:1*" $info
+        assert_match "*db9.k1:fences=2,*" $info
+        assert_match "*db9.k2:fences=1,*" $info
+        assert_equal {{named k1 BOUNDS 0 0 50 50}} [r gfences]
+        $rd close
+        wait_for_condition 50 100 {
+            [string match "*client_fences:0*" [r info fences]]
+        } else {
+            fail "Fences not dropped on disconnect"
+        }
+        assert_match "*db9.k1:fences=1,*" [r info fences]
+        assert {![string match "*db9.k2:*" [r info fences]]}
+        r gfence drop named
+        r gfences
+    } {}
+
+    test {Named fences survive DEBUG RELOAD and an AOF rewrite} {
+        r del k
+        r gfence create f1 k BOUNDS 0 0 10 10
+        r gfence create f2 k PAYLOAD MATCH t* RADIUS 1 1 1000
+        set fences [lsort [r gfences]]
+        r debug reload
+        assert_equal $fences [lsort [r gfences]]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_equal $fences [lsort [r gfences]]
+        set rd [redis_deferring_client]
+        $rd subscribe f1
+        $rd read
+        r gset k a {POINT(1 1)}
+        assert_equal inside:a [spatial_fence_read $rd]
+        $rd close
+        r gfence drop f1 f2
+    } {2}
+
+    test {GFENCE is denied when over maxmemory} {
+        r config set maxmemory 1
+        catch {r gfence create f3 k BOUNDS 0 0 10 10} e
+        r config set maxmemory 0
+        r gfence drop f2
+        set e
+    } {OOM*}
+
+    test {GSET EX, PX and PXAT set the expire of a field} {
+        r del k
+        r gset k a {POINT(1 1)} EX 100
+        r gset k b {POINT(1 1)} PX 100000
+        r gset k c {POINT(1 1)} PXAT [expr {[clock milliseconds]+100000}]
+        r gset k d {POINT(1 1)}
+        assert {[r gttl k a] > 90 && [r gttl k a] <= 100}
+        assert {[r gpttl k b] > 90000 && [r gpttl k b] <= 100000}
+        assert {[r gpttl k c] > 90000 && [r gpttl k c] <= 100000}
+        list [r gttl k d] [r gttl k nosuchfield] [r gttl nosuchkey a]
+    } {-1 -2 -2}
+
+    test {Writing a field again drops its expire} {
+        r gset k a {POINT(2 2)}
+        r gttl k a
+    } {-1}
+
+    test {Expired fields are deleted and notified to the fences} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        r gset k a {POINT(1 1)} PX 100
+        r gset k b {POINT(1 1)}
+        assert_equal inside:a [spatial_fence_read $rd]
+        assert_equal inside:b [spatial_fence_read $rd]
+        assert_equal outside:a [spatial_fence_read $rd]
+        $rd close
+        r gkeys k
+    } {b}
+
+    test {Field expires survive DEBUG RELOAD and an AOF rewrite} {
+        r del k
+        r gset k a {POINT(1 1)} EX 100
+        r gset k b {POINT(1 1)}
+        r debug reload
+        assert {[r gttl k a] > 90 && [r gttl k a] <= 100}
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert {[r gttl k a] > 90 && [r gttl k a] <= 100}
+        r gttl k b
+    } {-1}
+
+    test {GSET FIELDS attaches numeric attributes} {
+        r del k
+        r gset k a {POINT(1 1)} FIELDS speed 10 heading 90
+        r gset k b {POINT(2 2)} FIELDS speed 50
+        r gset k c {POINT(3 3)}
+        list [r gfields k a] [r gfields k c] [r gfields k nosuchfield]
+    } {{speed 10 heading 90} {} {}}
+
+    test {GSEARCH WHERE filters on the attributes} {
+        assert_equal {0 {a b}} [r gsearch k OUTPUT FIELD WHERE speed 0 100 BOUNDS 0 0 10 10]
+        assert_equal {0 b} [r gsearch k OUTPUT FIELD WHERE speed 20 100 BOUNDS 0 0 10 10]
+        assert_equal {0 a} [r gsearch k OUTPUT FIELD WHERE speed 0 100 WHERE heading 90 90 BOUNDS 0 0 10 10]
+        r gsearch k OUTPUT COUNT WHERE speed 0 100 BOUNDS 0 0 10 10
+    } {2}
+
+    test {Writing a field again drops its attributes} {
+        r gset k a {POINT(1 1)}
+        r gfields k a
+    } {}
+
+    test {WHERE is not valid with FENCE} {
+        catch {r gsearch k FENCE WHERE speed 0 100 BOUNDS 0 0 10 10} e
+        set e
+    } {ERR*}
+
+    test {Attributes survive DEBUG RELOAD and an AOF rewrite} {
+        r del k
+        r gset k a {POINT(1 1)} FIELDS speed 10
+        r debug reload
+        assert_equal {speed 10} [r gfields k a]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        r gfields k a
+    } {speed 10}
+
+    test {GINDEX FIELDS ON gives the same MATCH results} {
+        r del k
+        for {set j 0} {$j < 200} {incr j} {
+            r gset k truck:$j "POINT([expr {$j%10}] [expr {$j/20}])"
+            r gset k car:$j "POINT([expr {$j%10}] [expr {$j/20}])"
+        }
+        set prefix [lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1* BOUNDS 0 0 5 5] 1]]
+        set exact [r gsearch k OUTPUT FIELD MATCH car:42 BOUNDS 0 0 5 5]
+        r gindex k FIELDS ON
+        assert_equal {FIELDS ON} [r gindex k]
+        assert_equal $prefix [lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1* BOUNDS 0 0 5 5] 1]]
+        assert_equal $exact [r gsearch k OUTPUT FIELD MATCH car:42 BOUNDS 0 0 5 5]
+        r gdel k truck:1 truck:10
+        lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1 BOUNDS 0 0 5 5] 1]
+    } {}
+
+    test {MATCH patterns of every kind in GSEARCH and GSCAN} {
+        r del k
+        foreach f {foo foobar barfoo afoob fao fbo foo* bar} {
+            r gset k $f {POINT(1 1)}
+        }
+        set cases {
+            foo {foo}
+            foo* {foo foo* foobar}
+            *foo {barfoo foo}
+            *foo* {afoob barfoo foo foo* foobar}
+            f?o {fao fbo foo}
+            f\[ab\]? {fao fbo}
+            * {afoob bar barfoo fao fbo foo foo* foobar}
+            foo\\* {foo*}
+        }
+        foreach fields {OFF ON} {
+            r gindex k FIELDS $fields
+            foreach {pattern expected} $cases {
+                set got [lindex [r gsearch k MATCH $pattern OUTPUT FIELD BOUNDS 0 0 2 2] 1]
+                assert_equal $expected [lsort $got]
+                set got [dict keys [lindex [r gscan k 0 MATCH $pattern COUNT 100] 1]]
+                assert_equal $expected [lsort $got]
+            }
+        }
+    }
+
+    test {GINDEX options survive DEBUG RELOAD and an AOF rewrite} {
+        r gindex k TYPE GRID ENCODING PACKED 6
+        set options [r gindex k]
+        set fields [lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1* BOUNDS 0 0 5 5] 1]]
+        r debug reload
+        assert_equal $options [r gindex k]
+        assert_equal $fields [lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1* BOUNDS 0 0 5 5] 1]]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_equal $options [r gindex k]
+        assert_equal $fields [lsort [lindex [r gsearch k OUTPUT FIELD MATCH truck:1* BOUNDS 0 0 5 5] 1]]
+        r gindex k
+    } {TYPE GRID 12 FIELDS ON ENCODING PACKED 6}
+
+    test {TYPE GRID searches like TYPE RTREE over a range of cells} {
+        r del grid rtree
+        for {set j 0} {$j < 500} {incr j} {
+            set p "POINT([expr {($j*37%500)/500.0}] [expr {($j*91%500)/500.0}])"
+            r gset grid p$j $p
+            r gset rtree p$j $p
+        }
+        r gindex grid TYPE GRID
+        assert_equal 500 [dict get [r ginfo grid] grid_objects]
+        assert {[dict get [r ginfo grid] grid_cells] > 1}
+        foreach area {{BOUNDS 0.1 0.1 0.6 0.35} {BOUNDS 0 0 1 1}
+                      {RADIUS 0.5 0.5 20000} {GEOMETRY {POLYGON((0 0,0.7 0.1,0.3 0.8,0 0))}}} {
+            set expected [lsort [lindex [r gsearch rtree OUTPUT FIELD {*}$area] 1]]
+            assert {[llength $expected] > 0}
+            assert_equal $expected [lsort [lindex [r gsearch grid OUTPUT FIELD {*}$area] 1]]
+            assert_equal [llength $expected] [r gsearch grid OUTPUT COUNT {*}$area]
+        }
+    }
+
+    test {TYPE GRID moves a point from cell to cell and deletes it} {
+        r del k
+        r gset k a {POINT(0.01 0.01)}
+        r gindex k TYPE GRID
+        r gset k a {POINT(0.5 0.5)}
+        assert_equal {} [lindex [r gsearch k OUTPUT FIELD BOUNDS 0 0 0.1 0.1] 1]
+        assert_equal {a} [lindex [r gsearch k OUTPUT FIELD BOUNDS 0.4 0.4 0.6 0.6] 1]
+        assert_equal 1 [dict get [r ginfo k] grid_cells]
+        r gset k b {POINT(0.5 0.5)}
+        r gdel k a
+        assert_equal {b} [lindex [r gsearch k OUTPUT FIELD BOUNDS 0.4 0.4 0.6 0.6] 1]
+        r gdel k b
+        r exists k
+    } {0}
+
+    test {TYPE GRID RADIUS finds the points on both sides of a cell edge} {
+        # cells of step 12 are 360/4096 degrees wide.
+        set edge [expr {360.0/4096}]
+        r del grid rtree
+        foreach key {grid rtree} {
+            r gset $key west "POINT([expr {$edge-0.0001}] 0.02)"
+            r gset $key east "POINT([expr {$edge+0.0001}] 0.02)"
+            r gset $key far "POINT([expr {$edge+0.01}] 0.02)"
+        }
+        r gindex grid TYPE GRID
+        assert_equal 3 [dict get [r ginfo grid] grid_objects]
+        assert_equal 2 [dict get [r ginfo grid] grid_cells]
+        set expected [lsort [lindex [r gsearch rtree OUTPUT FIELD RADIUS $edge 0.02 50] 1]]
+        assert_equal $expected [lsort [lindex [r gsearch grid OUTPUT FIELD RADIUS $edge 0.02 50] 1]]
+        set expected
+    } {east west}
+
+    test {TYPE GRID keeps the points beyond the geohash limits in the R-tree} {
+        r del k
+        r gset k a {POINT(1 1)}
+        r gindex k TYPE GRID
+        r gset k north {POINT(10 86)}
+        set info [r ginfo k]
+        assert_equal 1 [dict get $info grid_objects]
+        assert_equal 1 [dict get $info rtree_objects]
+        assert_equal 2 [r gsearch k OUTPUT COUNT BOUNDS 0 0 20 89]
+        lindex [r gsearch k OUTPUT FIELD BOUNDS 9 85.5 11 87] 1
+    } {north}
+
+    test {GSET IFNEWER drops out of order updates} {
+        r del k
+        assert_equal 1 [r gset k a {POINT(1 1)} IFNEWER 100]
+        assert_equal {} [r gset k a {POINT(2 2)} IFNEWER 50]
+        assert_equal {} [r gset k a {POINT(2 2)} IFNEWER 100]
+        assert_equal 0 [r gset k a {POINT(3 3)} IFNEWER 150]
+        r gget k a
+    } {POINT(3 3)}
+
+    test {GSET GET replies with the previous geometry} {
+        assert_equal {1 {}} [r gset k b {POINT(1 1)} GET]
+        assert_equal {0 {POINT(1 1)}} [r gset k b {POINT(2 2)} GET]
+        r gset k a {POINT(4 4)} IFNEWER 120 GET
+    } {{} {POINT(3 3)}}
+
+    test {Writing a field without IFNEWER drops its timestamp} {
+        r gset k a {POINT(5 5)}
+        r gset k a {POINT(6 6)} IFNEWER 1
+    } {0}
+
+    test {Field timestamps survive DEBUG RELOAD and an AOF rewrite} {
+        r del k
+        r gset k a {POINT(1 1)} IFNEWER 100
+        r debug reload
+        assert_equal {} [r gset k a {POINT(2 2)} IFNEWER 50]
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_equal {} [r gset k a {POINT(2 2)} IFNEWER 50]
+        r gget k a
+    } {POINT(1 1)}
+
+    test {GMSETPOINTS writes packed points} {
+        r del k
+        set records {}
+        foreach {f lon lat} {a 1 2 b -3.5 4.25 a 5 6} {
+            append records [binary format ia*qq [string length $f] $f $lon $lat]
+        }
+        assert_equal 2 [r gmsetpoints k BINARY $records]
+        list [r gget k a] [r gget k b] [r glen k]
+    } {{POINT(5 6)} {POINT(-3.5 4.25)} 2}
+
+    test {GMSETPOINTS rejects truncated records} {
+        set records [binary format ia*q 1 c 1]
+        catch {r gmsetpoints k BINARY $records} e
+        list $e [r gexists k c]
+    } {{ERR invalid packed points} 0}
+
+    test {GMSETPOINTS and GSET reject points out of range} {
+        r del k
+        set errors {}
+        foreach {lon lat} {200 1 1 -91 Inf 1 1 NaN} {
+            catch {r gmsetpoints k BINARY [binary format ia*qq 1 c $lon $lat]} e
+            lappend errors $e
+            catch {r gset k c "POINT($lon $lat)"} e
+            lappend errors $e
+        }
+        assert_equal 0 [r exists k]
+        lsort -unique $errors
+    } {{ERR invalid longitude/latitude pair} {ERR invalid packed points}}
+
+    test {GMSET and GMSETPOINTS notify the fences of each point} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        r gmset k a {POINT(1 1)} b {POINT(20 20)}
+        r gmsetpoints k BINARY [binary format ia*qq 1 c 2 2]
+        set got [list [spatial_fence_read $rd] [spatial_fence_read $rd] [spatial_fence_read $rd]]
+        $rd close
+        lsort $got
+    } {inside:a inside:c outside:b}
+
+    test {Fields that look like integers are searchable} {
+        r del k
+        r gset k 123 {POINT(1 1)}
+        r gset k a {POLYGON((0 0,2 0,2 2,0 2,0 0))}
+        assert_equal {123 a} [lsort [lindex [r gsearch k CURSOR 0 COUNT 10 OUTPUT FIELD BOUNDS 0.5 0.5 1.5 1.5] 1]]
+        assert_equal {123} [lindex [r gsearch k MATCH 12* OUTPUT FIELD BOUNDS 0.5 0.5 1.5 1.5] 1]
+        assert_equal {123 {POINT(1 1)}} [dict filter [r ggetall k] key 123]
+        list [lsort [r gkeys k]] [lsort [lindex [r gsearch k OUTPUT FIELD BOUNDS 0.5 0.5 1.5 1.5] 1]]
+    } {{123 a} {123 a}}
+
+    test {Small spatial keys survive DEBUG RELOAD, integer fields included} {
+        r debug reload
+        list [r gget k 123] [lsort [lindex [r gsearch k OUTPUT FIELD BOUNDS 0.5 0.5 1.5 1.5] 1]]
+    } {{POINT(1 1)} {123 a}}
+
+    test {Large spatial keys survive DEBUG RELOAD} {
+        r del k
+        for {set j 0} {$j < 1000} {incr j} {
+            r gset k p$j "POINT([expr {$j%40}] [expr {$j/40}])"
+        }
+        r gset k poly {POLYGON((0 0,10 0,10 10,0 10,0 0))}
+        set before [lsort [lindex [r gsearch k OUTPUT FIELD BOUNDS 5 5 15 15] 1]]
+        r debug reload
+        assert_equal 1001 [r glen k]
+        assert_equal $before [lsort [lindex [r gsearch k OUTPUT FIELD BOUNDS 5 5 15 15] 1]]
+        r gsearch k OUTPUT COUNT BOUNDS 5 5 15 15
+    } [expr {11*11+1}]
+
+    test {GLOADFIELDS is only valid when loading the AOF} {
+        catch {r gloadfields k 1 a {POINT(1 1)} x} e
+        set e
+    } {ERR GLOADFIELDS is only valid when loading the AOF}
+
+    test {AOF rewrite of spatial keys with GLOADFIELDS} {
+        r flushall
+        for {set j 0} {$j < 300} {incr j} {
+            r gset big p$j "POINT([expr {$j%20}] [expr {$j/20}])"
+        }
+        r gset big poly {POLYGON((0 0,5 0,5 5,0 5,0 0))}
+        r gset big t {POINT(1 1)} EX 100 IFNEWER 10 FIELDS speed 5
+        r gindex big FIELDS ON
+        r gset small a {POINT(1 1)}
+        r gset small b {LINESTRING(0 0,1 1)}
+        set digest {}
+        foreach key {big small} {
+            lappend digest [lsort [r ggetall $key]] \
+                [lsort [lindex [r gsearch $key OUTPUT FIELD BOUNDS 2 2 8 8] 1]]
+        }
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        foreach key {big small} {
+            assert_equal [lindex $digest 0] [lsort [r ggetall $key]]
+            assert_equal [lindex $digest 1] [lsort [lindex [r gsearch $key OUTPUT FIELD BOUNDS 2 2 8 8] 1]]
+            set digest [lrange $digest 2 end]
+        }
+        assert {[r gttl big t] > 90}
+        assert_equal {speed 5} [r gfields big t]
+        assert_equal {} [r gset big t {POINT(2 2)} IFNEWER 5]
+        r gindex big
+    } {FIELDS ON}
+
+    test {DUMP and RESTORE keep the field state and the index options} {
+        foreach n {10 600} {
+            r del k k2
+            for {set j 0} {$j < $n} {incr j} {
+                r gset k p$j "POINT([expr {$j%30}] [expr {$j/30}])"
+            }
+            r gset k t {POINT(1 1)} EX 100 IFNEWER 10 FIELDS speed 5
+            r gindex k FIELDS ON ENCODING PACKED 6
+            set all [lsort [r ggetall k]]
+            r restore k2 0 [r dump k]
+            assert_equal $all [lsort [r ggetall k2]]
+            assert_equal [r gindex k] [r gindex k2]
+            assert {[r gttl k2 t] > 90}
+            assert_equal {speed 5} [r gfields k2 t]
+            assert_equal {} [r gset k2 t {POINT(2 2)} IFNEWER 5]
+            assert_equal [r gsearch k OUTPUT COUNT BOUNDS 2 2 8 8] \
+                [r gsearch k2 OUTPUT COUNT BOUNDS 2 2 8 8]
+        }
+    }
+
+    test {DEBUG RELOAD keeps the field state of small and large keys} {
+        r flushall
+        foreach {key n} {small 10 large 600} {
+            for {set j 0} {$j < $n} {incr j} {
+                r gset $key p$j "POINT([expr {$j%30}] [expr {$j/30}])"
+            }
+            r gset $key t {POINT(1 1)} EX 100 IFNEWER 10 FIELDS speed 5
+            r gindex $key TYPE GRID 10
+        }
+        r debug reload
+        set res {}
+        foreach key {small large} {
+            assert {[r gttl $key t] > 90}
+            assert_equal {} [r gset $key t {POINT(2 2)} IFNEWER 5]
+            lappend res [r gfields $key t] [r gindex $key]
+        }
+        set res
+    } {{speed 5} {TYPE GRID 10} {speed 5} {TYPE GRID 10}}
+
+    test {GSEARCH COUNT pages through a snapshot of the key} {
+        r del k
+        for {set j 0} {$j < 100} {incr j} {
+            r gset k p$j "POINT([expr {$j%10}] [expr {$j/10}])"
+        }
+        set expected [lsort [lindex [r gsearch k OUTPUT FIELD BOUNDS 0 0 10 10] 1]]
+        set cursors [status r search_cursors]
+        set got {}
+        set cursor 0
+        set j 0
+        while 1 {
+            set reply [r gsearch k CURSOR $cursor COUNT 7 OUTPUT FIELD BOUNDS 0 0 10 10]
+            set cursor [lindex $reply 0]
+            assert {[llength [lindex $reply 1]] <= 7}
+            lappend got {*}[lindex $reply 1]
+            if {$cursor == 0} break
+            # writes between the pages are not seen by the cursor.
+            r gdel k p$j
+            r gset k q$j {POINT(5 5)}
+            r gset k p[expr {99-$j}] {POINT(50 50)}
+            incr j
+        }
+        assert_equal $expected [lsort $got]
+        assert_equal $cursors [status r search_cursors]
+    }
+
+    test {GSEARCH CURSOR errors} {
+        catch {r gsearch k CURSOR 12345 COUNT 10 BOUNDS 0 0 10 10} e1
+        catch {r gsearch k CURSOR 0 COUNT 10 OUTPUT COUNT BOUNDS 0 0 10 10} e2
+        list $e1 $e2
+    } {{ERR invalid cursor} {ERR CURSOR and COUNT are only valid with searches that list objects}}
+
+    test {GINFO reports the objects and memory of a key} {
+        r del k
+        r gset k a {POINT(1 1)} EX 100
+        r gset k b {POINT(2 2)} FIELDS speed 1
+        set small [r ginfo k]
+        assert_equal 2 [dict get $small objects]
+        assert_equal 1 [dict get $small volatile_fields]
+        assert_equal 1 [dict get $small fields_with_attributes]
+        assert {[dict get $small expires_bytes] > 0}
+        assert {[dict get $small attributes_bytes] > 0}
+        for {set j 0} {$j < 1000} {incr j} {
+            r gset k p$j "POINT([expr {$j%40}] [expr {$j/40}])"
+        }
+        set large [r ginfo k SAMPLES 0]
+        assert_equal 1002 [dict get $large objects]
+        assert_equal 1002 [dict get $large rtree_objects]
+        assert {[dict get $large rtree_height] > 1}
+        assert {[dict get $large total_bytes] > [dict get $small total_bytes]}
+        assert {[dict get $large total_bytes] > 1000*32}
+        list [r ginfo nosuchkey] [catch {r ginfo k SAMPLES -1}] [catch {r ginfo k FOO}]
+    } {{} 1 1}
+
+    test {maxmemory-spatial-fields evicts the least recently written fields} {
+        r flushall
+        r config set maxmemory-spatial-fields yes
+        r config set maxmemory-policy allkeys-lru
+        r gset k first {POINT(1 1)}
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE MATCH first BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        set evicted [s evicted_fields]
+        r config set maxmemory [expr {[s used_memory]+200*1024}]
+        for {set j 0} {$j < 5000} {incr j} {
+            r gset k p$j "POINT([expr {$j%100}] [expr {$j/100}])"
+        }
+        r config set maxmemory 0
+        r config set maxmemory-spatial-fields no
+        r config set maxmemory-policy noeviction
+        assert_equal outside:first [spatial_fence_read $rd]
+        $rd close
+        assert {[s evicted_fields] > $evicted}
+        assert {[r glen k] < 5000}
+        assert_equal [expr {$evicted+5001-[r glen k]}] [s evicted_fields]
+        list [r gexists k p0] [r gexists k p4999]
+    } {0 1}
+
+    test {Evicting from a large key doesn't index its write order first} {
+        r flushall
+        set script {for i=1,ARGV[1] do redis.call('gset',KEYS[1],'p'..i,'POINT('..(i%100)..' '..(i%80)..')') end}
+        r eval $script 1 k 20000
+        r config set maxmemory-spatial-fields yes
+        r config set maxmemory-policy allkeys-lru
+        set evicted [s evicted_fields]
+        set used [s used_memory]
+        r config set maxmemory [expr {$used-16*1024}]
+        set after [s used_memory]
+        r config set maxmemory 0
+        r config set maxmemory-spatial-fields no
+        r config set maxmemory-policy noeviction
+        # indexing the key would take megabytes, evicted right back.
+        assert {[s evicted_fields] > $evicted}
+        assert {[s evicted_fields]-$evicted < 1000}
+        assert {$after < $used}
+        assert_equal [expr {20000-[s evicted_fields]+$evicted}] [r glen k]
+        dict get [r ginfo k] write_times_bytes
+    } {0}
+
+    test {Past due fields are expired on access} {
+        r del k
+        r debug set-active-expire 0
+        r gset k a {POINT(1 1)} PX 50
+        r gset k b {POINT(2 2)}
+        after 100
+        set expired [status r expired_fields]
+        assert_equal -2 [r gpttl k a]
+        assert_equal {} [r gget k a]
+        assert_equal 0 [r gexists k a]
+        assert_equal 1 [r glen k]
+        assert_equal {0 {b {POINT(2 2)}}} [r gsearch k BOUNDS 0 0 10 10]
+        assert_equal [expr {$expired+1}] [status r expired_fields]
+        r gset k b {POINT(2 2)} PX 50
+        after 100
+        r debug set-active-expire 1
+        assert_equal 0 [r glen k]
+        r exists k
+    } {0}
+}
+
+start_server {tags {"spatial repl"}} {
+    start_server {} {
+        test {Spatial replica is connected} {
+            r -1 slaveof [srv 0 host] [srv 0 port]
+            wait_for_condition 50 100 {
+                [s -1 master_link_status] eq {up}
+            } else {
+                fail "Replication not started."
+            }
+        }
+
+        test {GFENCE CREATE and DROP are replicated} {
+            r gfence create f1 k BOUNDS 0 0 10 10
+            r gfence create f2 k BOUNDS 0 0 20 20
+            r gfence drop f2
+            wait_for_condition 50 100 {
+                [r -1 gfences] eq {{f1 k BOUNDS 0 0 10 10}}
+            } else {
+                fail "Named fences not replicated"
+            }
+        }
+
+        test {A read only replica refuses GFENCE} {
+            catch {r -1 gfence create f3 k BOUNDS 0 0 10 10} e
+            assert_match {READONLY*} $e
+            catch {r -1 gfence drop f1} e
+            assert_match {READONLY*} $e
+            r -1 gfences
+        } {{f1 k BOUNDS 0 0 10 10}}
+
+        test {GMSETPOINTS is replicated} {
+            r del k
+            r gmsetpoints k BINARY [binary format ia*qqia*qq 1 a 1 2 1 b 3 4]
+            wait_for_condition 50 100 {
+                [r -1 glen k] == 2
+            } else {
+                fail "Points not replicated"
+            }
+            list [r -1 gget k a] [r -1 gget k b]
+        } {{POINT(1 2)} {POINT(3 4)}}
+
+        test {GSET IFNEWER keeps the replica in sync} {
+            r del k
+            r gset k a {POINT(1 1)} IFNEWER 100
+            r gset k a {POINT(2 2)} IFNEWER 50
+            r gset k b {POINT(3 3)}
+            wait_for_condition 50 100 {
+                [r -1 gget k b] eq {POINT(3 3)}
+            } else {
+                fail "Fields not replicated"
+            }
+            assert {[dict get [r -1 ginfo k] stamps_bytes] > 0}
+            r -1 gget k a
+        } {POINT(1 1)}
+
+        test {Field expires are replicated} {
+            r del k
+            r gset k a {POINT(1 1)} EX 100
+            wait_for_condition 50 100 {
+                [r -1 gttl k a] > 0
+            } else {
+                fail "Field expire not replicated"
+            }
+            assert {[r -1 gttl k a] > 90 && [r -1 gttl k a] <= 100}
+        }
+
+        test {Evicted fields are deleted on the replica} {
+            r del k
+            r config set maxmemory-spatial-fields yes
+            r config set maxmemory-policy allkeys-lru
+            r config set maxmemory [expr {[s used_memory]+200*1024}]
+            for {set j 0} {$j < 5000} {incr j} {
+                r gset k p$j "POINT([expr {$j%100}] [expr {$j/100}])"
+            }
+            r config set maxmemory 0
+            r config set maxmemory-spatial-fields no
+            r config set maxmemory-policy noeviction
+            assert {[r glen k] < 5000}
+            wait_for_condition 50 100 {
+                [r -1 glen k] == [r glen k]
+            } else {
+                fail "Evicted fields not deleted on the replica"
+            }
+            r -1 gexists k p0
+        } {0}
+
+        test {A full resync carries the field state and the named fences} {
+            r del k
+            r gset k a {POINT(1 1)} EX 100 IFNEWER 10 FIELDS speed 5
+            r gset k b {POINT(2 2)}
+            r gindex k FIELDS ON
+            r -1 slaveof no one
+            r -1 flushall
+            r -1 slaveof [srv 0 host] [srv 0 port]
+            wait_for_condition 50 100 {
+                [s -1 master_link_status] eq {up} && [r -1 glen k] == 2
+            } else {
+                fail "Full resync failed"
+            }
+            assert {[r -1 gttl k a] > 90}
+            assert_equal {speed 5} [r -1 gfields k a]
+            assert {[dict get [r -1 ginfo k] stamps_bytes] > 0}
+            assert {[dict get [r -1 ginfo k] fields_index_bytes] > 0}
+            r -1 gfences
+        } {{f1 k BOUNDS 0 0 10 10}}
+
+        test {A replica hides the past due fields until the master expires them} {
+            r del k
+            r debug set-active-expire 0
+            r gset k a {POINT(1 1)} PX 50
+            r gset k b {POINT(2 2)}
+            wait_for_condition 50 100 {
+                [r -1 glen k] == 2
+            } else {
+                fail "Fields not replicated"
+            }
+            after 100
+            assert_equal -2 [r -1 gpttl k a]
+            assert_equal {} [r -1 gget k a]
+            assert_equal 0 [r -1 gexists k a]
+            assert_equal 1 [r -1 glen k]
+            assert_equal {b} [r -1 gkeys k]
+            assert_equal {0 {b {POINT(2 2)}}} [r -1 gsearch k BOUNDS 0 0 10 10]
+            assert_equal 2 [dict get [r -1 ginfo k] objects]
+            # A read of the master expires the field and propagates the GDEL.
+            assert_equal {} [r gget k a]
+            r debug set-active-expire 1
+            wait_for_condition 50 100 {
+                [dict get [r -1 ginfo k] objects] == 1
+            } else {
+                fail "Expired field not deleted on the replica"
+            }
+        }
+    }
+}
+
+start_server {tags {"spatial"} overrides {fence-threads 2}} {
+    test {The fence pool publishes the notifications in write order} {
+        r del k
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        set expected {}
+        for {set j 0} {$j < 200} {incr j} {
+            if {$j % 3} {
+                r gset k f$j {POINT(1 1)}
+                lappend expected inside:f$j
+            } else {
+                r gset k f$j {POINT(20 20)}
+                lappend expected outside:f$j
+            }
+        }
+        set got {}
+        for {set j 0} {$j < 200} {incr j} {
+            lappend got [spatial_fence_read $rd]
+        }
+        $rd close
+        assert_equal $expected $got
+        status r fence_pending_jobs
+    } {0}
+
+    test {Roaming fence notifies the objects that cross its edge (fence pool)} {
+        spatial_roaming_fence_test
+    }
+
+    test {Fence PAYLOAD OUTPUT WKB publishes the unpacked object of a packed key} {
+        r del k
+        r gset k z {POINT(50 50)}
+        r gindex k ENCODING PACKED
+        set rd [redis_deferring_client]
+        $rd gsearch k FENCE PAYLOAD OUTPUT WKB BOUNDS 0 0 10 10
+        assert_equal subscribe [lindex [$rd read] 0]
+        r gset k a {POINT(1 1)}
+        set msg [lindex [$rd read] 2]
+        $rd close
+        assert_match {*"detect":"inside"*"object":"01*"*} $msg
+    }
+}